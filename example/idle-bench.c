@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Measures the memory held by idle client connections: persistent
+ * connections waiting for their next request, then established CONNECT
+ * tunnels with no traffic. The proxy, its clients and a local origin share
+ * the process:
+ *
+ *     idle-bench [connections]
+ *
+ * Resident memory is read from /proc, so it includes allocator slack; the
+ * arena figure counts libevent's allocations alone. Each tunnel holds a
+ * target connection in addition to its client connection, while idle
+ * persistent connections share a pooled one.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pproxy/pproxy.h"
+
+#define MAX_ARENAS 64
+
+/* descriptors used per connection by each phase, across all parties; a
+ * spliced tunnel holds a pipe for each direction */
+#define FDS_PER_IDLE 2
+#define FDS_PER_TUNNEL 8
+
+struct origin {
+    int listener;
+    unsigned short port;
+};
+
+struct sample {
+    long long rss;
+    long long arena;
+};
+
+static int listen_local(unsigned short *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(fd, 1024) ||
+            getsockname(fd, (struct sockaddr *) &addr, &len)) {
+        perror("origin");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connect_local(unsigned short port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+/* Answers every request head with an empty response, keeping connections
+ * open; tunnels are accepted and left silent */
+static void* run_origin(void *arg) {
+    static const char kResponse[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    struct origin *origin = (struct origin *) arg;
+    char buf[4096];
+
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = origin->listener;
+    epoll_ctl(ep, EPOLL_CTL_ADD, origin->listener, &ev);
+
+    for (;;) {
+        struct epoll_event events[64];
+        int n = epoll_wait(ep, events, 64, -1);
+        int i;
+        for (i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == origin->listener) {
+                int conn = accept(fd, NULL, NULL);
+                if (conn == -1) {
+                    continue;
+                }
+                ev.data.fd = conn;
+                epoll_ctl(ep, EPOLL_CTL_ADD, conn, &ev);
+                continue;
+            }
+
+            /* Requests are small enough to arrive whole */
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if (len <= 0) {
+                close(fd);
+            } else if (write(fd, kResponse, sizeof(kResponse) - 1) < 0) {
+                perror("origin write");
+            }
+        }
+    }
+    return NULL;
+}
+
+static void* run_proxy(void *arg) {
+    pproxy_start((struct pproxy *) arg);
+    return NULL;
+}
+
+/* Reads a response head with no body */
+static void read_head(int fd, const char *expected) {
+    char buf[256];
+    size_t got = 0;
+    while (got < 4 || memcmp(buf + got - 4, "\r\n\r\n", 4)) {
+        if (got == sizeof(buf) || read(fd, buf + got, 1) != 1) {
+            fprintf(stderr, "Bad response\n");
+            exit(1);
+        }
+        ++got;
+    }
+    if (strncmp(buf, expected, strlen(expected))) {
+        fprintf(stderr, "Unexpected response: %.*s\n", (int) got, buf);
+        exit(1);
+    }
+}
+
+static void send_request(int fd, const char *method, const char *target,
+        unsigned short port) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+        "%s %s HTTP/1.1\r\nHost: 127.0.0.1:%hu\r\n\r\n", method, target,
+        port);
+    if (write(fd, buf, len) != len) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/* Opens a persistent connection, and leaves it idle after one request */
+static int open_idle(unsigned short proxy_port, unsigned short port) {
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%hu/", port);
+
+    int fd = connect_local(proxy_port);
+    send_request(fd, "GET", url, port);
+    read_head(fd, "HTTP/1.1 200");
+    return fd;
+}
+
+static int open_tunnel(unsigned short proxy_port, unsigned short port) {
+    char authority[64];
+    snprintf(authority, sizeof(authority), "127.0.0.1:%hu", port);
+
+    int fd = connect_local(proxy_port);
+    send_request(fd, "CONNECT", authority, port);
+    read_head(fd, "HTTP/1.1 200");
+    return fd;
+}
+
+static void take_sample(struct sample *sample) {
+    /* Let the proxy finish with the last connection */
+    usleep(100 * 1000);
+
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm || fscanf(statm, "%*s %ld", &pages) != 1) {
+        fprintf(stderr, "Failed to read /proc/self/statm\n");
+        exit(1);
+    }
+    fclose(statm);
+    sample->rss = (long long) pages * sysconf(_SC_PAGESIZE);
+
+    struct pproxy_allocator_stats stats[MAX_ARENAS];
+    int arenas = pproxy_get_allocator_stats(stats, MAX_ARENAS);
+    sample->arena = 0;
+    int i;
+    for (i = 0; i < arenas && i < MAX_ARENAS; ++i) {
+        sample->arena += stats[i].bytes_outstanding;
+    }
+}
+
+static void report(const char *name, const struct sample *before,
+        const struct sample *after, int count) {
+    printf("%-10s %8d conns %10.0f B/conn resident", name, count,
+        (double) (after->rss - before->rss) / count);
+    if (after->arena > 0) {
+        printf(" %10.0f B/conn libevent",
+            (double) (after->arena - before->arena) / count);
+    }
+    printf("\n");
+}
+
+/* @return how many connections the descriptor limit allows */
+static int raise_fd_limit(int wanted) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("getrlimit");
+        exit(1);
+    }
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    long available = ((long) limit.rlim_cur - 64) /
+        (FDS_PER_IDLE + FDS_PER_TUNNEL);
+    return available < wanted ? (int) available : wanted;
+}
+
+int main(int argc, char **argv) {
+    int wanted = argc > 1 ? atoi(argv[1]) : 10000;
+    int count = raise_fd_limit(wanted);
+    if (count <= 0) {
+        fprintf(stderr, "Not enough file descriptors\n");
+        exit(1);
+    }
+    if (count < wanted) {
+        printf("Limited to %d connections by RLIMIT_NOFILE\n", count);
+    }
+
+    /* Fails harmlessly without PPROXY_ARENA_ALLOCATOR */
+    pproxy_install_allocator(0);
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.num_workers = 1;
+
+    struct pproxy *handle = 0;
+    if (pproxy_init_ex(&handle, "127.0.0.1", 0, &options)) {
+        fprintf(stderr, "Failed to initialize pproxy\n");
+        exit(1);
+    }
+    int16_t signed_port = 0;
+    pproxy_get_port(handle, &signed_port);
+    unsigned short proxy_port = (unsigned short) signed_port;
+
+    struct origin origin;
+    origin.listener = listen_local(&origin.port);
+    pthread_t origin_thread;
+    pthread_create(&origin_thread, NULL, run_origin, &origin);
+
+    pthread_t proxy_thread;
+    pthread_create(&proxy_thread, NULL, run_proxy, handle);
+
+    int *fds = (int *) malloc(2 * count * sizeof(int));
+    if (!fds) {
+        exit(1);
+    }
+
+    /* Warm up the pooled target connection and the proxy's free lists */
+    close(open_idle(proxy_port, origin.port));
+
+    struct sample base, idle, tunnels;
+    take_sample(&base);
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        fds[i] = open_idle(proxy_port, origin.port);
+    }
+    take_sample(&idle);
+    report("idle", &base, &idle, count);
+
+    for (i = 0; i < count; ++i) {
+        fds[count + i] = open_tunnel(proxy_port, origin.port);
+    }
+    take_sample(&tunnels);
+    report("tunnel", &idle, &tunnels, count);
+
+    for (i = 0; i < 2 * count; ++i) {
+        close(fds[i]);
+    }
+    free(fds);
+
+    pproxy_stop(handle);
+    pthread_join(proxy_thread, NULL);
+    pproxy_free(handle);
+
+    /* The origin thread is left blocked; the process is exiting */
+    return 0;
+}
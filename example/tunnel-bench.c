@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Measures CONNECT tunnel throughput, and the CPU time the proxy spends on
+ * it, for each tunnel engine. A client pushes data through a tunnel to a
+ * local sink:
+ *
+ *     tunnel-bench [megabytes]
+ *
+ * The proxy's CPU time is that of its event loop thread; work the kernel
+ * does on the proxy's behalf in softirq context (notably all sockmap
+ * forwarding) is not attributed to it.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pproxy/pproxy.h"
+
+#define CHUNK (1 << 16)
+
+struct sink {
+    int listener;
+    unsigned short port;
+    size_t expected;
+};
+
+static double now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int listen_local(unsigned short *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(fd, 1) ||
+            getsockname(fd, (struct sockaddr *) &addr, &len)) {
+        perror("sink");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connect_local(unsigned short port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+/* Reads the expected number of bytes from the tunnel, then exits */
+static void* run_sink(void *arg) {
+    struct sink *sink = (struct sink *) arg;
+    static char buf[CHUNK];
+
+    int fd = accept(sink->listener, NULL, NULL);
+    size_t received = 0;
+    while (received < sink->expected) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            fprintf(stderr, "sink: tunnel closed early\n");
+            exit(1);
+        }
+        received += (size_t) n;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void* run_proxy(void *arg) {
+    pproxy_start((struct pproxy *) arg);
+    return NULL;
+}
+
+static int open_tunnel(unsigned short proxy_port, unsigned short port) {
+    char buf[256];
+    int fd = connect_local(proxy_port);
+
+    int len = snprintf(buf, sizeof(buf),
+        "CONNECT 127.0.0.1:%hu HTTP/1.1\r\nHost: 127.0.0.1:%hu\r\n\r\n",
+        port, port);
+    if (write(fd, buf, len) != len) {
+        perror("write");
+        exit(1);
+    }
+
+    /* The 200 response has no body */
+    size_t got = 0;
+    while (got < 4 || memcmp(buf + got - 4, "\r\n\r\n", 4)) {
+        if (got == sizeof(buf) || read(fd, buf + got, 1) != 1) {
+            fprintf(stderr, "Bad CONNECT response\n");
+            exit(1);
+        }
+        ++got;
+    }
+    if (strncmp(buf, "HTTP/1.1 200", 12)) {
+        fprintf(stderr, "CONNECT failed: %.*s\n", (int) got, buf);
+        exit(1);
+    }
+    return fd;
+}
+
+static void bench(const char *name, int engine, size_t bytes) {
+    static char payload[CHUNK];
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.tunnel_engine = engine;
+
+    struct pproxy *handle = 0;
+    if (pproxy_init_ex(&handle, "127.0.0.1", 0, &options)) {
+        fprintf(stderr, "Failed to initialize pproxy\n");
+        exit(1);
+    }
+    int16_t proxy_port = 0;
+    pproxy_get_port(handle, &proxy_port);
+
+    pthread_t proxy_thread;
+    pthread_create(&proxy_thread, NULL, run_proxy, handle);
+    clockid_t proxy_clock;
+    pthread_getcpuclockid(proxy_thread, &proxy_clock);
+
+    struct sink sink;
+    sink.listener = listen_local(&sink.port);
+    sink.expected = bytes;
+    pthread_t sink_thread;
+    pthread_create(&sink_thread, NULL, run_sink, &sink);
+
+    int fd = open_tunnel((unsigned short) proxy_port, sink.port);
+
+    double start = now(CLOCK_MONOTONIC);
+    double start_cpu = now(proxy_clock);
+
+    size_t sent = 0;
+    while (sent < bytes) {
+        size_t len = bytes - sent < sizeof(payload) ?
+            bytes - sent : sizeof(payload);
+        ssize_t n = write(fd, payload, len);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        sent += (size_t) n;
+    }
+    pthread_join(sink_thread, NULL);
+
+    double elapsed = now(CLOCK_MONOTONIC) - start;
+    double cpu = now(proxy_clock) - start_cpu;
+
+    printf("%-10s %10.1f MiB/s %10.1f ms proxy CPU\n", name,
+        bytes / elapsed / (1 << 20), cpu * 1000);
+
+    close(fd);
+    close(sink.listener);
+    pproxy_stop(handle);
+    pthread_join(proxy_thread, NULL);
+    pproxy_free(handle);
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+    size_t bytes = megabytes << 20;
+
+    bench("buffered", PPROXY_TUNNEL_BUFFERED, bytes);
+    bench("splice", PPROXY_TUNNEL_SPLICE, bytes);
+    bench("sockmap", PPROXY_TUNNEL_SOCKMAP, bytes);
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Admission control for new client connections.
+ *
+ * With a connection limit, a listener is disabled once the proxy holds
+ * that many connections, leaving further clients in the kernel's accept
+ * queue rather than taking on work that would slow every connection
+ * already admitted. While disabled, the count is polled every timer tick,
+ * and accepting resumes once it has fallen to the low watermark. Each
+ * listener is only touched from its own event loop.
+ *
+ * Separately, each worker can shed new connections with CoDel, using the
+ * time from accepting a connection to reading its first byte as the
+ * queueing delay. Once that delay has stayed above the target for a whole
+ * interval, new connections are closed as soon as they are accepted, at a
+ * rate that grows with the square root of the number shed, until a
+ * connection is again served within the target.
+ */
+
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include "pproxy-internal.h"
+
+static long connection_count(struct pproxy *handle) {
+    FENCE();
+    long count = handle->num_connections;
+    if (handle->acceptor) {
+        /* Sockets queued for the workers are already accepted */
+        int i;
+        for (i = 0; i < handle->num_workers; ++i) {
+            count += pproxy_handoff_queue_size(&handle->workers[i].handoff);
+        }
+    }
+    return count;
+}
+
+static long low_watermark(const struct pproxy_options *options) {
+    if (options->connection_low_watermark > 0) {
+        return options->connection_low_watermark;
+    }
+    return options->max_connections - options->max_connections / 8;
+}
+
+static void resume_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+
+    struct pproxy_admission *admission = (struct pproxy_admission*) arg;
+    if (connection_count(admission->handle) >
+            low_watermark(&admission->handle->options)) {
+        return;
+    }
+
+    log_debug("Below the connection limit; resuming accepts\n");
+    event_del(admission->resume_timer);
+    evconnlistener_enable(admission->listener);
+    admission->paused = 0;
+}
+
+int pproxy_admission_init(struct pproxy_admission *admission,
+        struct pproxy *handle, struct event_base *base,
+        struct evconnlistener *listener) {
+    memset(admission, 0, sizeof(*admission));
+    admission->handle = handle;
+    admission->listener = listener;
+
+    if (handle->options.max_connections == 0) {
+        return 0;
+    }
+
+    admission->resume_timer = event_new(base, -1, EV_PERSIST, resume_cb,
+        admission);
+    if (!admission->resume_timer) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void pproxy_admission_free(struct pproxy_admission *admission) {
+    if (admission->resume_timer) {
+        event_free(admission->resume_timer);
+        admission->resume_timer = NULL;
+    }
+}
+
+void pproxy_admission_check(struct pproxy_admission *admission) {
+    const struct pproxy_options *options = &admission->handle->options;
+    if (!admission->resume_timer || admission->paused ||
+            connection_count(admission->handle) < options->max_connections) {
+        return;
+    }
+
+    log_debug("At the connection limit; pausing accepts\n");
+    struct timeval interval = { options->timer_tick_ms / 1000,
+        (options->timer_tick_ms % 1000) * 1000 };
+    if (evconnlistener_disable(admission->listener) ||
+            event_add(admission->resume_timer, &interval)) {
+        evconnlistener_enable(admission->listener);
+        return;
+    }
+    admission->paused = 1;
+}
+
+static long isqrt(long n) {
+    long root = 0;
+    while ((root + 1) * (root + 1) <= n) {
+        ++root;
+    }
+    return root;
+}
+
+static long ms_between(const struct timeval *from, const struct timeval *to) {
+    struct timeval diff;
+    evutil_timersub(to, from, &diff);
+    return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
+static void add_ms(const struct timeval *tv, long ms, struct timeval *out) {
+    struct timeval delta = { ms / 1000, (ms % 1000) * 1000 };
+    evutil_timeradd(tv, &delta, out);
+}
+
+void pproxy_codel_sample(struct pproxy_codel *codel,
+        const struct pproxy_options *options, const struct timeval *now,
+        const struct timeval *accepted) {
+    if (ms_between(accepted, now) < options->codel_target_ms) {
+        evutil_timerclear(&codel->above_until);
+        codel->dropping = 0;
+        return;
+    }
+
+    if (!evutil_timerisset(&codel->above_until)) {
+        add_ms(now, options->codel_interval_ms, &codel->above_until);
+        return;
+    }
+
+    if (!codel->dropping && !evutil_timercmp(now, &codel->above_until, <)) {
+        log_debug("Connection queueing delay persistently above %d ms\n",
+            options->codel_target_ms);
+        codel->dropping = 1;
+        /* Pick up near the last shedding rate if that ended recently */
+        if (codel->drop_count > 2 && ms_between(&codel->drop_next, now) <
+                16 * (long) options->codel_interval_ms) {
+            codel->drop_count -= 2;
+        } else {
+            codel->drop_count = 0;
+        }
+        codel->drop_next = *now;
+    }
+}
+
+int pproxy_codel_admit(struct pproxy_codel *codel,
+        const struct pproxy_options *options, const struct timeval *now) {
+    if (!codel->dropping || evutil_timercmp(now, &codel->drop_next, <)) {
+        return 0;
+    }
+
+    ++codel->drop_count;
+    add_ms(now, options->codel_interval_ms / isqrt(codel->drop_count),
+        &codel->drop_next);
+    return -1;
+}
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Per-thread arenas for libevent's allocations; see
+ * pproxy_install_allocator.
+ *
+ * Memory is mapped in 2 MiB slabs aligned to their size, each carved into
+ * objects of one power-of-two size class, so the slab header found by
+ * masking a pointer gives its size class and owning arena without a
+ * per-object header. That matters because evbuffer chains are already
+ * power-of-two sized; a header would double them. Requests larger than the
+ * largest class get a mapping of their own with the same kind of header.
+ *
+ * The owning thread allocates and frees without locking. Other threads
+ * push freed objects onto a per-class remote list, which the owner takes
+ * over wholesale when its own free list runs dry. Slabs are never
+ * returned to the system; an exiting thread's arena, with its free lists,
+ * passes to the next thread that needs one.
+ */
+
+#if defined(PPROXY_ARENA_ALLOCATOR) && !defined(_WIN32)
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "pproxy-internal.h"
+
+#if defined(PPROXY_ARENA_ALLOCATOR) && !defined(_WIN32) && \
+    !defined(EVENT__DISABLE_MM_REPLACEMENT)
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SLAB_SIZE ((size_t) 2 << 20)
+#define MIN_CLASS_SHIFT 4
+#define MAX_CLASS_SHIFT 16
+#define NUM_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define LARGE_CLASS NUM_CLASSES
+/* offset of a large allocation in its mapping, past the header */
+#define LARGE_OFFSET 64
+
+struct arena_object {
+    struct arena_object *next;
+};
+
+/* at the start of every slab and large mapping */
+struct arena_slab {
+    struct pproxy_arena *arena;
+    int size_class;
+    size_t length; /* of the mapping */
+};
+
+struct arena_class {
+    /* owner only */
+    struct arena_object *free;
+    char *bump;
+    char *bump_end;
+    /* pushed by other threads */
+    struct arena_object *volatile remote;
+};
+
+struct pproxy_arena {
+    struct arena_class classes[NUM_CLASSES];
+    /* bytes allocated less bytes freed by the owner; owner only */
+    int64_t allocated;
+    /* bytes freed by other threads */
+    volatile int64_t remote_freed;
+    volatile int64_t reserved;
+    int in_use;
+    struct pproxy_arena *next;
+};
+
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guarded by arenas_lock */
+static struct pproxy_arena *arenas;
+static struct pproxy_arena **arenas_tail = &arenas;
+static int installed;
+static int hugepages;
+static pthread_key_t arena_key;
+
+static __thread struct pproxy_arena *thread_arena;
+
+static size_t class_size(int size_class) {
+    return (size_t) 1 << (size_class + MIN_CLASS_SHIFT);
+}
+
+static int size_class_of(size_t size) {
+    if (size <= class_size(0)) {
+        return 0;
+    }
+    return (int) (sizeof(unsigned long) * 8) -
+        __builtin_clzl((unsigned long) (size - 1)) - MIN_CLASS_SHIFT;
+}
+
+static struct arena_slab* slab_of(void *ptr) {
+    return (struct arena_slab*) ((uintptr_t) ptr & ~(SLAB_SIZE - 1));
+}
+
+/* Maps length bytes aligned to SLAB_SIZE; length may be rounded up */
+static void* map_aligned(size_t *length) {
+    char *p;
+#if defined(MAP_HUGETLB)
+    if (hugepages) {
+        size_t huge_length = (*length + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+        p = (char*) mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *length = huge_length;
+            return p;
+        }
+    }
+#endif
+
+    /* Over-map, then trim to an aligned range */
+    p = (char*) mmap(NULL, *length + SLAB_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char*) (((uintptr_t) p + SLAB_SIZE - 1) &
+        ~(SLAB_SIZE - 1));
+    if (aligned > p) {
+        munmap(p, aligned - p);
+    }
+    size_t tail = (p + *length + SLAB_SIZE) - (aligned + *length);
+    if (tail > 0) {
+        munmap(aligned + *length, tail);
+    }
+#if defined(MADV_HUGEPAGE)
+    if (hugepages) {
+        /* transparent huge pages, when none are reserved */
+        madvise(aligned, *length, MADV_HUGEPAGE);
+    }
+#endif
+    return aligned;
+}
+
+static void detach_arena(void *arg) {
+    struct pproxy_arena *arena = (struct pproxy_arena*) arg;
+    pthread_mutex_lock(&arenas_lock);
+    arena->in_use = 0;
+    pthread_mutex_unlock(&arenas_lock);
+    thread_arena = NULL;
+}
+
+static struct pproxy_arena* attach_arena(void) {
+    pthread_mutex_lock(&arenas_lock);
+    struct pproxy_arena *arena;
+    for (arena = arenas; arena && arena->in_use; arena = arena->next) { }
+    if (!arena) {
+        /* not from the arenas themselves, which would recurse */
+        arena = (struct pproxy_arena*) calloc(1, sizeof(*arena));
+        if (arena) {
+            *arenas_tail = arena;
+            arenas_tail = &arena->next;
+        }
+    }
+    if (arena) {
+        arena->in_use = 1;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (arena) {
+        thread_arena = arena;
+        pthread_setspecific(arena_key, arena);
+    }
+    return arena;
+}
+
+/* Takes a new object from the newest slab, mapping another if needed */
+static struct arena_object* carve(struct pproxy_arena *arena,
+        int size_class) {
+    struct arena_class *cls = &arena->classes[size_class];
+    size_t size = class_size(size_class);
+
+    if (!cls->bump || cls->bump + size > cls->bump_end) {
+        size_t length = SLAB_SIZE;
+        char *slab = (char*) map_aligned(&length);
+        if (!slab) {
+            return NULL;
+        }
+        struct arena_slab *header = (struct arena_slab*) slab;
+        header->arena = arena;
+        header->size_class = size_class;
+        header->length = length;
+        ATOMIC_ADD(&arena->reserved, (int64_t) length);
+
+        /* objects are aligned to their size, up to the header's */
+        cls->bump = slab + (size > LARGE_OFFSET ? size : LARGE_OFFSET);
+        cls->bump_end = slab + SLAB_SIZE;
+    }
+
+    struct arena_object *object = (struct arena_object*) cls->bump;
+    object->next = NULL;
+    cls->bump += size;
+    return object;
+}
+
+static void* alloc_large(struct pproxy_arena *arena, size_t size) {
+    size_t length = (size + LARGE_OFFSET + 4095) & ~(size_t) 4095;
+    char *mapping = (char*) map_aligned(&length);
+    if (!mapping) {
+        return NULL;
+    }
+    struct arena_slab *header = (struct arena_slab*) mapping;
+    header->arena = arena;
+    header->size_class = LARGE_CLASS;
+    header->length = length;
+    ATOMIC_ADD(&arena->reserved, (int64_t) length);
+    arena->allocated += length - LARGE_OFFSET;
+    return mapping + LARGE_OFFSET;
+}
+
+static size_t usable_size(void *ptr) {
+    struct arena_slab *slab = slab_of(ptr);
+    if (slab->size_class == LARGE_CLASS) {
+        return slab->length - LARGE_OFFSET;
+    }
+    return class_size(slab->size_class);
+}
+
+static void* arena_malloc(size_t size) {
+    struct pproxy_arena *arena = thread_arena;
+    if (!arena && !(arena = attach_arena())) {
+        return NULL;
+    }
+
+    if (size > class_size(NUM_CLASSES - 1)) {
+        return alloc_large(arena, size);
+    }
+
+    int size_class = size_class_of(size);
+    struct arena_class *cls = &arena->classes[size_class];
+    struct arena_object *object = cls->free;
+    if (!object) {
+        /* take everything other threads have freed */
+        do {
+            object = cls->remote;
+        } while (object && !ATOMIC_CAS(&cls->remote, object, NULL));
+    }
+    if (!object && !(object = carve(arena, size_class))) {
+        return NULL;
+    }
+
+    cls->free = object->next;
+    arena->allocated += class_size(size_class);
+    return object;
+}
+
+static void arena_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    struct arena_slab *slab = slab_of(ptr);
+    struct pproxy_arena *arena = slab->arena;
+    size_t size = usable_size(ptr);
+    int local = arena == thread_arena;
+
+    if (local) {
+        arena->allocated -= size;
+    } else {
+        ATOMIC_ADD(&arena->remote_freed, (int64_t) size);
+    }
+
+    if (slab->size_class == LARGE_CLASS) {
+        ATOMIC_ADD(&arena->reserved, -(int64_t) slab->length);
+        munmap(slab, slab->length);
+        return;
+    }
+
+    struct arena_class *cls = &arena->classes[slab->size_class];
+    struct arena_object *object = (struct arena_object*) ptr;
+    if (local) {
+        object->next = cls->free;
+        cls->free = object;
+    } else {
+        struct arena_object *head;
+        do {
+            head = cls->remote;
+            object->next = head;
+        } while (!ATOMIC_CAS(&cls->remote, head, object));
+    }
+}
+
+static void* arena_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return arena_malloc(size);
+    }
+    if (size == 0) {
+        arena_free(ptr);
+        return NULL;
+    }
+
+    /* Stay put unless that would waste over half the space */
+    size_t usable = usable_size(ptr);
+    if (size <= usable && (size > usable / 2 || usable == class_size(0))) {
+        return ptr;
+    }
+
+    void *ret = arena_malloc(size);
+    if (!ret) {
+        return NULL;
+    }
+    memcpy(ret, ptr, size < usable ? size : usable);
+    arena_free(ptr);
+    return ret;
+}
+
+static long long outstanding(struct pproxy_arena *arena) {
+    return (long long) (arena->allocated - arena->remote_freed);
+}
+
+int pproxy_install_allocator(int flags) {
+    pthread_mutex_lock(&arenas_lock);
+    int rc = -1;
+    if (!installed && pthread_key_create(&arena_key, detach_arena) == 0) {
+        hugepages = (flags & PPROXY_ALLOCATOR_HUGEPAGES) != 0;
+        event_set_mem_functions(arena_malloc, arena_realloc, arena_free);
+        installed = 1;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return rc;
+}
+
+int pproxy_get_allocator_stats(struct pproxy_allocator_stats *stats,
+        int max_arenas) {
+    pthread_mutex_lock(&arenas_lock);
+    int count = -1;
+    if (installed) {
+        struct pproxy_arena *arena;
+        for (count = 0, arena = arenas; arena;
+                ++count, arena = arena->next) {
+            if (count < max_arenas) {
+                stats[count].bytes_outstanding = outstanding(arena);
+                stats[count].bytes_reserved = (long long) arena->reserved;
+                stats[count].in_use = arena->in_use;
+            }
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return count;
+}
+
+long long pproxy_allocator_thread_bytes(void) {
+    return thread_arena ? outstanding(thread_arena) : 0;
+}
+
+#else
+
+int pproxy_install_allocator(int flags) {
+    (void) flags;
+    return -1;
+}
+
+int pproxy_get_allocator_stats(struct pproxy_allocator_stats *stats,
+        int max_arenas) {
+    (void) stats;
+    (void) max_arenas;
+    return -1;
+}
+
+long long pproxy_allocator_thread_bytes(void) {
+    return 0;
+}
+
+#endif
@@ -26,6 +26,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <event2/bufferevent.h>
+
 #include "pproxy-internal.h"
 
 int pproxy_set_callbacks(struct pproxy *handle,
@@ -65,10 +67,13 @@ int pproxy_connection_handle_init(struct pproxy_connection_handle *handle) {
 }
 
 void pproxy_connection_handle_free(struct pproxy_connection_handle *handle) {
-    if (handle->timer) {
-        event_del(handle->timer);
-        event_free(handle->timer);
-        handle->timer = NULL;
+    pproxy_timer_cancel(
+        &pproxy_cb_handle_connection(handle)->worker->timer_wheel,
+        &handle->timer);
+    /* The client bufferevent has been released, and no longer uses it */
+    if (handle->rate_limit) {
+        ev_token_bucket_cfg_free(handle->rate_limit);
+        handle->rate_limit = NULL;
     }
 }
 
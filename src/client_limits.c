@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Per-client limits on concurrent connections and request rate.
+ *
+ * Clients are tracked by address in a fixed-size table shared by the
+ * workers, so memory stays bounded however many clients there are. IPv6
+ * clients are tracked by their /64 prefix, which a single host can
+ * usually draw addresses from at will. The table is split into shards by
+ * address hash, each with its own lock, so that workers admitting
+ * different clients rarely contend.
+ *
+ * Each shard is open addressed with linear probing, and removal shifts
+ * later entries of a probe run back, so no tombstones accumulate. Entries
+ * of clients without connections are linked in order of use; when a shard
+ * is full, the least recently used of them is forgotten to make room. A
+ * client holding connections is never forgotten, as that would reset its
+ * limits, so a shard full of such clients refuses new ones.
+ *
+ * Requests draw on a token bucket per client, refilled continuously at
+ * the request rate up to the burst size.
+ */
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pproxy-internal.h"
+
+/* shards are only split further while each keeps at least this many
+ * entries */
+#define MIN_SHARD_ENTRIES 256
+
+static uint32_t hash_addr(const struct pproxy_client_addr *addr) {
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < sizeof(addr->bytes); ++i) {
+        hash ^= addr->bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Slots are indexed by the low bits of the hash, and shards by the high */
+static struct pproxy_client_shard *shard_for(
+        struct pproxy_client_table *table, uint32_t hash) {
+    return &table->shards[((uint64_t) hash * table->num_shards) >> 32];
+}
+
+static void unlink_recency(struct pproxy_client_shard *shard, int32_t index) {
+    struct pproxy_client_entry *entry = &shard->slots[index];
+    if (entry->newer != -1) {
+        shard->slots[entry->newer].older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
+    if (entry->older != -1) {
+        shard->slots[entry->older].newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+}
+
+static void link_newest(struct pproxy_client_shard *shard, int32_t index) {
+    struct pproxy_client_entry *entry = &shard->slots[index];
+    entry->newer = -1;
+    entry->older = shard->newest;
+    if (shard->newest != -1) {
+        shard->slots[shard->newest].newer = index;
+    } else {
+        shard->oldest = index;
+    }
+    shard->newest = index;
+}
+
+/* Moves a used entry to an empty slot, keeping its place in the recency
+ * list if it is on it */
+static void move_entry(struct pproxy_client_shard *shard, int32_t from,
+        int32_t to) {
+    struct pproxy_client_entry *entry = &shard->slots[from];
+    if (entry->connections == 0) {
+        if (entry->newer != -1) {
+            shard->slots[entry->newer].older = to;
+        } else {
+            shard->newest = to;
+        }
+        if (entry->older != -1) {
+            shard->slots[entry->older].newer = to;
+        } else {
+            shard->oldest = to;
+        }
+    }
+    shard->slots[to] = *entry;
+    entry->used = 0;
+}
+
+/* Removes an entry without connections */
+static void remove_entry(struct pproxy_client_shard *shard, int32_t index) {
+    unlink_recency(shard, index);
+    shard->slots[index].used = 0;
+    --shard->count;
+
+    /* Shift back entries whose probe run passed through the freed slot */
+    size_t hole = index;
+    size_t next = (hole + 1) & shard->mask;
+    while (shard->slots[next].used) {
+        size_t home = hash_addr(&shard->slots[next].addr) & shard->mask;
+        /* The entry can fill the hole unless its home lies cyclically
+         * after the hole, up to the entry itself */
+        if (((next - home) & shard->mask) >= ((next - hole) & shard->mask)) {
+            move_entry(shard, (int32_t) next, (int32_t) hole);
+            hole = next;
+        }
+        next = (next + 1) & shard->mask;
+    }
+}
+
+static struct pproxy_client_entry *find_entry(
+        struct pproxy_client_shard *shard,
+        const struct pproxy_client_addr *addr, uint32_t hash) {
+    size_t index = hash & shard->mask;
+    while (shard->slots[index].used) {
+        if (memcmp(&shard->slots[index].addr, addr, sizeof(*addr)) == 0) {
+            return &shard->slots[index];
+        }
+        index = (index + 1) & shard->mask;
+    }
+    return NULL;
+}
+
+/* Finds the client's entry, adding it if absent. Called with the shard's
+ * lock held.
+ * @return the entry, or NULL if the shard is full of clients with
+ * connections */
+static struct pproxy_client_entry *get_entry(
+        struct pproxy_client_table *table, struct pproxy_client_shard *shard,
+        const struct pproxy_client_addr *addr, uint32_t hash) {
+    struct pproxy_client_entry *entry = find_entry(shard, addr, hash);
+    if (entry) {
+        return entry;
+    }
+
+    if (shard->count == shard->max_count) {
+        if (shard->oldest == -1) {
+            return NULL;
+        }
+        remove_entry(shard, shard->oldest);
+    }
+
+    size_t index = hash & shard->mask;
+    while (shard->slots[index].used) {
+        index = (index + 1) & shard->mask;
+    }
+    entry = &shard->slots[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->addr = *addr;
+    entry->used = 1;
+    /* A new client's bucket is full, so it needs no refill time */
+    entry->tokens = (int64_t) table->request_burst * 1000;
+    link_newest(shard, (int32_t) index);
+    ++shard->count;
+    return entry;
+}
+
+int pproxy_client_table_init(struct pproxy_client_table *table,
+        const struct pproxy_options *options) {
+    memset(table, 0, sizeof(*table));
+    table->request_rate = options->client_request_rate;
+    table->request_burst = options->client_request_burst > 0 ?
+        options->client_request_burst : options->client_request_rate;
+    table->max_connections = options->client_max_connections;
+
+    if (table->request_rate == 0 && table->max_connections == 0) {
+        return 0;
+    }
+
+    /* A few shards per worker, unless the table is too small to split */
+    size_t num_shards = 1;
+    while (num_shards < (size_t) options->num_workers * 4 &&
+            (size_t) options->client_table_size / (num_shards * 2) >=
+                MIN_SHARD_ENTRIES) {
+        num_shards *= 2;
+    }
+    size_t max_count = (options->client_table_size + num_shards - 1) /
+        num_shards;
+
+    /* A quarter of the slots are kept free to keep probe runs short */
+    size_t size = 4;
+    while (size - size / 4 < max_count) {
+        size *= 2;
+    }
+
+    table->shards = (struct pproxy_client_shard*) calloc(num_shards,
+        sizeof(*table->shards));
+    if (!table->shards) {
+        return -1;
+    }
+    table->num_shards = num_shards;
+
+    size_t i;
+    for (i = 0; i < num_shards; ++i) {
+        struct pproxy_client_shard *shard = &table->shards[i];
+        shard->slots = (struct pproxy_client_entry*) calloc(size,
+            sizeof(*shard->slots));
+        if (!shard->slots) {
+            pproxy_client_table_free(table);
+            return -1;
+        }
+        shard->mask = size - 1;
+        shard->max_count = max_count;
+        shard->newest = shard->oldest = -1;
+        pproxy_mutex_init(&shard->lock);
+    }
+
+    return 0;
+}
+
+void pproxy_client_table_free(struct pproxy_client_table *table) {
+    if (!table->shards) {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < table->num_shards; ++i) {
+        if (table->shards[i].slots) {
+            pproxy_mutex_destroy(&table->shards[i].lock);
+            free(table->shards[i].slots);
+        }
+    }
+    free(table->shards);
+    table->shards = NULL;
+    table->num_shards = 0;
+}
+
+int pproxy_client_addr_set(struct pproxy_client_addr *addr,
+        const struct sockaddr *saddr) {
+    memset(addr, 0, sizeof(*addr));
+    switch (saddr->sa_family) {
+    case AF_INET:
+        addr->bytes[10] = addr->bytes[11] = 0xff;
+        memcpy(&addr->bytes[12],
+            &((const struct sockaddr_in*) saddr)->sin_addr, 4);
+        return 0;
+    case AF_INET6: {
+        const uint8_t *bytes = (const uint8_t*)
+            &((const struct sockaddr_in6*) saddr)->sin6_addr;
+        static const uint8_t mapped[12] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        if (memcmp(bytes, mapped, sizeof(mapped)) == 0) {
+            /* An IPv4 client of a dual-stack socket */
+            memcpy(addr->bytes, bytes, 16);
+        } else {
+            memcpy(addr->bytes, bytes, 8);
+        }
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+int pproxy_client_connect(struct pproxy_client_table *table,
+        const struct pproxy_client_addr *addr) {
+    int rc = 0;
+    uint32_t hash = hash_addr(addr);
+    struct pproxy_client_shard *shard = shard_for(table, hash);
+
+    pproxy_mutex_lock(&shard->lock);
+    struct pproxy_client_entry *entry = get_entry(table, shard, addr, hash);
+    if (!entry || (table->max_connections > 0 &&
+            entry->connections >= table->max_connections)) {
+        rc = -1;
+    } else if (entry->connections++ == 0) {
+        /* Not to be forgotten while it has connections */
+        unlink_recency(shard, (int32_t) (entry - shard->slots));
+    }
+    pproxy_mutex_unlock(&shard->lock);
+
+    return rc;
+}
+
+void pproxy_client_disconnect(struct pproxy_client_table *table,
+        const struct pproxy_client_addr *addr) {
+    uint32_t hash = hash_addr(addr);
+    struct pproxy_client_shard *shard = shard_for(table, hash);
+
+    pproxy_mutex_lock(&shard->lock);
+    struct pproxy_client_entry *entry = find_entry(shard, addr, hash);
+    if (entry && entry->connections > 0 && --entry->connections == 0) {
+        link_newest(shard, (int32_t) (entry - shard->slots));
+    }
+    pproxy_mutex_unlock(&shard->lock);
+}
+
+int pproxy_client_request(struct pproxy_client_table *table,
+        const struct pproxy_client_addr *addr, uint64_t now_ms) {
+    if (table->request_rate == 0) {
+        return 0;
+    }
+
+    int rc = 0;
+    uint32_t hash = hash_addr(addr);
+    struct pproxy_client_shard *shard = shard_for(table, hash);
+
+    pproxy_mutex_lock(&shard->lock);
+    /* The requesting connection keeps the client's entry in the table */
+    struct pproxy_client_entry *entry = find_entry(shard, addr, hash);
+    if (entry) {
+        /* Workers' clocks are cached separately, and may be slightly
+         * apart */
+        if (now_ms > entry->refilled_ms) {
+            entry->tokens += (int64_t) (now_ms - entry->refilled_ms) *
+                table->request_rate;
+            entry->refilled_ms = now_ms;
+            if (entry->tokens > (int64_t) table->request_burst * 1000) {
+                entry->tokens = (int64_t) table->request_burst * 1000;
+            }
+        }
+        if (entry->tokens < 1000) {
+            rc = -1;
+        } else {
+            entry->tokens -= 1000;
+        }
+    }
+    pproxy_mutex_unlock(&shard->lock);
+
+    return rc;
+}
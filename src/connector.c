@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Connection racing across a target's resolved addresses, after RFC 8305
+ * ("Happy Eyeballs"). Addresses are interleaved by family, starting with
+ * the family of the first address. One attempt starts immediately; another
+ * starts whenever the stagger delay passes without a success, or as soon as
+ * an attempt fails or times out, until the retry budget is spent. The first
+ * attempt to connect wins, and the rest are abandoned.
+ */
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "pproxy-internal.h"
+
+static void attempt_event_cb(struct bufferevent *bev, short what, void *ctx);
+static void stagger_cb(evutil_socket_t fd, short what, void *arg);
+
+static void set_port(struct sockaddr_storage *addr, uint16_t port) {
+    if (addr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *) addr)->sin_port = htons(port);
+    }
+}
+
+/* Copies up to PPROXY_MAX_CONNECT_ADDRS addresses, alternating families */
+static int copy_addrs(struct pproxy_connector *connector,
+        struct evutil_addrinfo *addrs, uint16_t port) {
+    struct evutil_addrinfo *ai;
+    int total = 0;
+    for (ai = addrs; ai && total < PPROXY_MAX_CONNECT_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) {
+            ++total;
+        }
+    }
+    if (total == 0) {
+        return -1;
+    }
+
+    connector->addrs = (struct sockaddr_storage*) malloc(
+        total * sizeof(struct sockaddr_storage));
+    connector->addrlens = (ev_socklen_t*) malloc(
+        total * sizeof(ev_socklen_t));
+    if (!connector->addrs || !connector->addrlens) {
+        return -1;
+    }
+
+    /* Take the next address of the wanted family, or of either family once
+     * the wanted one runs out */
+    struct evutil_addrinfo *cursor[2] = { addrs, addrs };
+    int family[2];
+    family[0] = addrs->ai_family == AF_INET ? AF_INET : AF_INET6;
+    family[1] = family[0] == AF_INET ? AF_INET6 : AF_INET;
+    int i;
+    for (i = 0; i < total; ++i) {
+        int which = i % 2;
+        for (ai = cursor[which]; ai && ai->ai_family != family[which];
+                ai = ai->ai_next) { }
+        if (!ai) {
+            which = !which;
+            for (ai = cursor[which]; ai && ai->ai_family != family[which];
+                    ai = ai->ai_next) { }
+        }
+        cursor[which] = ai->ai_next;
+
+        memcpy(&connector->addrs[i], ai->ai_addr, ai->ai_addrlen);
+        connector->addrlens[i] = (ev_socklen_t) ai->ai_addrlen;
+        set_port(&connector->addrs[i], port);
+    }
+    connector->num_addrs = total;
+
+    return 0;
+}
+
+/* Attempts may be mid-connect, so they aren't returned to the object pool */
+static void free_attempt(struct pproxy_connect_attempt *attempt) {
+    bufferevent_free(attempt->bev);
+    attempt->bev = NULL;
+    --attempt->connector->num_attempts;
+}
+
+static void release(struct pproxy_connector *connector) {
+    int i;
+    for (i = 0; i < PPROXY_MAX_CONNECT_ATTEMPTS; ++i) {
+        if (connector->attempts[i].bev) {
+            free_attempt(&connector->attempts[i]);
+        }
+    }
+    if (connector->stagger_timer) {
+        event_free(connector->stagger_timer);
+        connector->stagger_timer = NULL;
+    }
+    free(connector->addrs);
+    connector->addrs = NULL;
+    free(connector->addrlens);
+    connector->addrlens = NULL;
+}
+
+/*
+ * Starts an attempt on the next address that can be tried.
+ *
+ * @return 0 if an attempt started, -1 otherwise
+ */
+static int start_attempt(struct pproxy_connector *connector) {
+    struct pproxy_connect_attempt *attempt = NULL;
+    int i;
+    for (i = 0; i < PPROXY_MAX_CONNECT_ATTEMPTS; ++i) {
+        if (!connector->attempts[i].bev) {
+            attempt = &connector->attempts[i];
+            break;
+        }
+    }
+    if (!attempt) {
+        return -1;
+    }
+
+    const struct pproxy_options *options =
+        &connector->worker->handle->options;
+    while (connector->next_addr < connector->num_addrs &&
+            connector->next_addr < connector->max_attempts) {
+        int index = connector->next_addr++;
+
+        attempt->bev = pproxy_object_pool_get_bufferevent(
+            &connector->worker->object_pool, -1);
+        if (!attempt->bev) {
+            return -1;
+        }
+        ++connector->num_attempts;
+
+        /* While connecting, the write timeout bounds the attempt */
+        struct timeval timeout = {
+            options->connect_timeout_ms / 1000,
+            (options->connect_timeout_ms % 1000) * 1000
+        };
+        bufferevent_set_timeouts(attempt->bev, NULL, &timeout);
+        bufferevent_setcb(attempt->bev, NULL, NULL, attempt_event_cb,
+            attempt);
+        bufferevent_enable(attempt->bev, EV_READ | EV_WRITE);
+        if (bufferevent_socket_connect(attempt->bev,
+                (struct sockaddr *) &connector->addrs[index],
+                connector->addrlens[index]) == 0) {
+            return 0;
+        }
+
+        connector->last_error = EVUTIL_SOCKET_ERROR();
+        free_attempt(attempt);
+    }
+
+    return -1;
+}
+
+static void arm_stagger_timer(struct pproxy_connector *connector) {
+    if (connector->next_addr >= connector->num_addrs ||
+            connector->next_addr >= connector->max_attempts ||
+            connector->num_attempts >= PPROXY_MAX_CONNECT_ATTEMPTS) {
+        evtimer_del(connector->stagger_timer);
+        return;
+    }
+
+    int ms = connector->worker->handle->options.connect_stagger_ms;
+    struct timeval delay = { ms / 1000, (ms % 1000) * 1000 };
+    evtimer_add(connector->stagger_timer, &delay);
+}
+
+/* Reports failure once nothing is in flight and nothing is left to try */
+static void check_exhausted(struct pproxy_connector *connector) {
+    if (connector->num_attempts > 0) {
+        arm_stagger_timer(connector);
+        return;
+    }
+
+    pproxy_connector_cb cb = connector->cb;
+    void *arg = connector->arg;
+    int error = connector->last_error;
+    release(connector);
+    (*cb)(NULL, error, arg);
+}
+
+static void attempt_event_cb(struct bufferevent *bev, short what, void *ctx) {
+    struct pproxy_connect_attempt *attempt =
+        (struct pproxy_connect_attempt*) ctx;
+    struct pproxy_connector *connector = attempt->connector;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        /* Hand over the winner before abandoning the rest */
+        attempt->bev = NULL;
+        --connector->num_attempts;
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        bufferevent_set_timeouts(bev, NULL, NULL);
+
+        pproxy_connector_cb cb = connector->cb;
+        void *arg = connector->arg;
+        release(connector);
+        (*cb)(bev, 0, arg);
+        return;
+    }
+
+    if (what & BEV_EVENT_TIMEOUT) {
+        connector->last_error = PPROXY_ETIMEDOUT;
+    } else if (what & BEV_EVENT_ERROR) {
+        connector->last_error = EVUTIL_SOCKET_ERROR();
+    }
+    log_debug("Connect attempt failed: %s\n",
+        evutil_socket_error_to_string(connector->last_error));
+    free_attempt(attempt);
+
+    /* Move on to the next address right away */
+    start_attempt(connector);
+    check_exhausted(connector);
+}
+
+static void stagger_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+    struct pproxy_connector *connector = (struct pproxy_connector*) arg;
+
+    start_attempt(connector);
+    check_exhausted(connector);
+}
+
+int pproxy_connector_start(struct pproxy_connector *connector,
+        struct pproxy_worker *worker, struct evutil_addrinfo *addrs,
+        uint16_t port, pproxy_connector_cb cb, void *arg) {
+    memset(connector, 0, sizeof(*connector));
+    connector->worker = worker;
+    connector->cb = cb;
+    connector->arg = arg;
+    connector->max_attempts = worker->handle->options.connect_max_attempts;
+
+    int i;
+    for (i = 0; i < PPROXY_MAX_CONNECT_ATTEMPTS; ++i) {
+        connector->attempts[i].connector = connector;
+    }
+
+    for (;;) {
+        if (copy_addrs(connector, addrs, port)) {
+            break;
+        }
+
+        connector->stagger_timer = evtimer_new(worker->base, stagger_cb,
+            connector);
+        if (!connector->stagger_timer) {
+            break;
+        }
+
+        if (start_attempt(connector)) {
+            break;
+        }
+
+        arm_stagger_timer(connector);
+        return 0;
+    }
+
+    release(connector);
+    return -1;
+}
+
+void pproxy_connector_cancel(struct pproxy_connector *connector) {
+    release(connector);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pproxy-internal.h"
+
+int pproxy_handoff_queue_init(struct pproxy_handoff_queue *queue,
+        long capacity) {
+    memset(queue, 0, sizeof(*queue));
+
+    long size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    queue->fds = (evutil_socket_t*) malloc(size * sizeof(evutil_socket_t));
+    if (!queue->fds) {
+        return -1;
+    }
+    queue->capacity = size;
+
+    return 0;
+}
+
+void pproxy_handoff_queue_free(struct pproxy_handoff_queue *queue) {
+    free(queue->fds);
+    queue->fds = NULL;
+}
+
+int pproxy_handoff_queue_push(struct pproxy_handoff_queue *queue,
+        evutil_socket_t fd) {
+    long tail = queue->tail;
+    FENCE(); /* observe the consumer's latest head */
+    if (tail - queue->head == queue->capacity) {
+        return -1;
+    }
+
+    queue->fds[tail & (queue->capacity - 1)] = fd;
+    FENCE(); /* publish the slot before the index */
+    queue->tail = tail + 1;
+
+    return 0;
+}
+
+int pproxy_handoff_queue_pop(struct pproxy_handoff_queue *queue,
+        evutil_socket_t *fd) {
+    long head = queue->head;
+    FENCE(); /* observe the producer's latest tail */
+    if (head == queue->tail) {
+        return -1;
+    }
+
+    FENCE(); /* read the slot only after observing the index */
+    *fd = queue->fds[head & (queue->capacity - 1)];
+    FENCE(); /* finish reading the slot before releasing it */
+    queue->head = head + 1;
+
+    return 0;
+}
+
+long pproxy_handoff_queue_size(struct pproxy_handoff_queue *queue) {
+    FENCE();
+    return queue->tail - queue->head;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Latency injection. Profiles are defined on the proxy before it starts,
+ * and are read-only afterwards, so connections refer to them directly.
+ * Delays are drawn from a splitmix64 sequence per connection, seeded from
+ * the profile's seed and the connection's stream, so that a run can be
+ * repeated without sharing generator state between workers.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pproxy/callbacks.h"
+#include "pproxy-internal.h"
+
+#define TWO_PI 6.28318530717958647692
+
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+/* @return a uniform double in [0, 1) */
+static double next_uniform(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+static double sample_ms(uint64_t *state,
+        const struct pproxy_latency_dist *dist) {
+    switch (dist->type) {
+    case PPROXY_LATENCY_CONSTANT:
+        return dist->value_ms;
+    case PPROXY_LATENCY_UNIFORM:
+        return dist->value_ms + next_uniform(state) * dist->spread_ms;
+    case PPROXY_LATENCY_NORMAL: {
+        /* Box-Muller; 1 - u is in (0, 1] */
+        double radius = sqrt(-2.0 * log(1.0 - next_uniform(state)));
+        double angle = TWO_PI * next_uniform(state);
+        return dist->value_ms + dist->spread_ms * radius * cos(angle);
+    }
+    case PPROXY_LATENCY_EMPIRICAL: {
+        /* Inverse of the samples' distribution function */
+        double at = next_uniform(state) * (dist->num_samples - 1);
+        size_t i = (size_t) at;
+        if (i + 1 >= dist->num_samples) {
+            return dist->samples_ms[dist->num_samples - 1];
+        }
+        return dist->samples_ms[i] +
+            (at - i) * (dist->samples_ms[i + 1] - dist->samples_ms[i]);
+    }
+    default:
+        return 0;
+    }
+}
+
+void pproxy_latency_seed(struct pproxy_latency *latency,
+        const struct pproxy_latency_profile *profile) {
+    uint64_t stream = latency->stream;
+    latency->profile = profile;
+    latency->random = (profile ? profile->seed : 0) ^ next_random(&stream);
+}
+
+int pproxy_latency_sample(struct pproxy_latency *latency, int phase) {
+    if (!latency->profile) {
+        return 0;
+    }
+
+    double ms = sample_ms(&latency->random,
+        &latency->profile->phases[phase]);
+    if (!(ms > 0)) {
+        return 0;
+    }
+    if (ms >= INT_MAX) {
+        return INT_MAX;
+    }
+    return (int) ceil(ms);
+}
+
+static int valid_ms(double ms) {
+    return ms >= 0 && ms <= INT_MAX;
+}
+
+static int valid_dist(const struct pproxy_latency_dist *dist) {
+    switch (dist->type) {
+    case PPROXY_LATENCY_NONE:
+        return 1;
+    case PPROXY_LATENCY_CONSTANT:
+        return valid_ms(dist->value_ms);
+    case PPROXY_LATENCY_UNIFORM:
+    case PPROXY_LATENCY_NORMAL:
+        return valid_ms(dist->value_ms) && valid_ms(dist->spread_ms);
+    case PPROXY_LATENCY_EMPIRICAL: {
+        if (!dist->samples_ms || dist->num_samples == 0) {
+            return 0;
+        }
+        size_t i;
+        for (i = 0; i < dist->num_samples; ++i) {
+            if (!valid_ms(dist->samples_ms[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+static int compare_ms(const void *a, const void *b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void free_samples(struct pproxy_latency_profile *profile) {
+    int i;
+    for (i = 0; i < PPROXY_LATENCY_NUM_PHASES; ++i) {
+        free((void*) profile->phases[i].samples_ms);
+        profile->phases[i].samples_ms = NULL;
+    }
+}
+
+/* Copies the profile, with its own sorted samples */
+static int copy_profile(struct pproxy_latency_profile *to,
+        const struct pproxy_latency_profile *from) {
+    *to = *from;
+
+    int i;
+    for (i = 0; i < PPROXY_LATENCY_NUM_PHASES; ++i) {
+        struct pproxy_latency_dist *dist = &to->phases[i];
+        if (dist->type != PPROXY_LATENCY_EMPIRICAL) {
+            dist->samples_ms = NULL;
+            dist->num_samples = 0;
+            continue;
+        }
+
+        double *samples = (double*) malloc(
+            dist->num_samples * sizeof(*samples));
+        if (!samples) {
+            /* Later phases still refer to the caller's samples */
+            for (; i < PPROXY_LATENCY_NUM_PHASES; ++i) {
+                to->phases[i].samples_ms = NULL;
+            }
+            free_samples(to);
+            return -1;
+        }
+        memcpy(samples, dist->samples_ms,
+            dist->num_samples * sizeof(*samples));
+        qsort(samples, dist->num_samples, sizeof(*samples), compare_ms);
+        dist->samples_ms = samples;
+    }
+    return 0;
+}
+
+int pproxy_latency_find(struct pproxy *handle, const char *name) {
+    int i;
+    for (i = 0; i < handle->num_latency_profiles; ++i) {
+        if (strcmp(handle->latency_profiles[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void pproxy_latency_profiles_free(struct pproxy *handle) {
+    int i;
+    for (i = 0; i < handle->num_latency_profiles; ++i) {
+        free(handle->latency_profiles[i].name);
+        free_samples(&handle->latency_profiles[i].profile);
+    }
+    free(handle->latency_profiles);
+    handle->latency_profiles = NULL;
+    handle->num_latency_profiles = 0;
+    handle->latency_profile = -1;
+}
+
+int pproxy_define_latency_profile(struct pproxy *handle, const char *name,
+        const struct pproxy_latency_profile *profile) {
+    if (!handle || !name || !profile) {
+        return -1;
+    }
+
+    FENCE();
+    if (handle->run_state != PROXY_INIT) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < PPROXY_LATENCY_NUM_PHASES; ++i) {
+        if (!valid_dist(&profile->phases[i])) {
+            return -1;
+        }
+    }
+
+    struct pproxy_latency_profile copy;
+    if (copy_profile(&copy, profile)) {
+        return -1;
+    }
+
+    int index = pproxy_latency_find(handle, name);
+    if (index == -1) {
+        struct pproxy_latency_def *defs = (struct pproxy_latency_def*)
+            realloc(handle->latency_profiles,
+                (handle->num_latency_profiles + 1) * sizeof(*defs));
+        char *name_copy = defs ? strdup(name) : NULL;
+        if (!name_copy) {
+            if (defs) {
+                handle->latency_profiles = defs;
+            }
+            free_samples(&copy);
+            return -1;
+        }
+        handle->latency_profiles = defs;
+        index = handle->num_latency_profiles++;
+        defs[index].name = name_copy;
+    } else {
+        free_samples(&handle->latency_profiles[index].profile);
+    }
+
+    handle->latency_profiles[index].profile = copy;
+    return 0;
+}
+
+int pproxy_set_latency_profile(struct pproxy *handle, const char *name) {
+    if (!handle) {
+        return -1;
+    }
+
+    FENCE();
+    if (handle->run_state != PROXY_INIT) {
+        return -1;
+    }
+
+    int index = -1;
+    if (name) {
+        index = pproxy_latency_find(handle, name);
+        if (index == -1) {
+            return -1;
+        }
+    }
+    handle->latency_profile = index;
+    return 0;
+}
+
+int pproxy_conn_set_latency_profile(struct pproxy_connection_handle *handle,
+        const char *name) {
+    if (!handle) {
+        return -1;
+    }
+
+    struct pproxy_connection *conn = pproxy_cb_handle_connection(handle);
+    const struct pproxy_latency_profile *profile = NULL;
+    if (name) {
+        int index = pproxy_latency_find(conn->handle, name);
+        if (index == -1) {
+            return -1;
+        }
+        profile = &conn->handle->latency_profiles[index].profile;
+    }
+
+    pproxy_latency_seed(&conn->latency, profile);
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Work stealing for long-lived CONNECT tunnels.
+ *
+ * Each worker tracks its tunnels in CONN_DIRECT state. Periodically, a worker
+ * compares its load with its peers and, if some peer is sufficiently busier,
+ * posts a steal request to it. The victim handles the request from its own
+ * event loop--a safe point, since no connection callbacks are on the stack--
+ * by detaching tunnels and posting them to the thief's inbox. The thief then
+ * attaches them to its own event base.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "pproxy-internal.h"
+
+/* Minimum load imbalance that triggers a steal */
+#define STEAL_THRESHOLD 2
+
+static long worker_load(struct pproxy_worker *worker) {
+    FENCE();
+    return worker->active_connections;
+}
+
+static long worker_tunnels(struct pproxy_worker *worker) {
+    FENCE();
+    return worker->num_tunnels;
+}
+
+/* Detaches up to count tunnels from the victim and posts them to the thief.
+ * Runs on the victim's thread. */
+static void give_tunnels(struct pproxy_worker *victim,
+        struct pproxy_worker *thief, long count) {
+    struct pproxy_connection *batch = NULL;
+    struct pproxy_connection *last = NULL;
+
+    struct pproxy_connection *conn = victim->tunnels;
+    while (conn && count > 0) {
+        struct pproxy_connection *next = conn->tunnel_next;
+        if (pproxy_connection_can_migrate(conn)) {
+            pproxy_connection_detach(conn, thief);
+            conn->tunnel_next = batch;
+            batch = conn;
+            if (!last) {
+                last = conn;
+            }
+            --count;
+        }
+        conn = next;
+    }
+
+    if (!batch) {
+        return;
+    }
+
+    pproxy_mutex_lock(&thief->migrate_lock);
+    last->tunnel_next = thief->inbox;
+    thief->inbox = batch;
+    pproxy_mutex_unlock(&thief->migrate_lock);
+
+    event_active(thief->migrate_event, EV_READ, 0);
+}
+
+/* Services steal requests and adopts migrated tunnels. Runs on the worker's
+ * own thread. */
+static void migrate_cb(evutil_socket_t fd, short what, void *ctx) {
+    (void) fd;
+    (void) what;
+
+    struct pproxy_worker *worker = (struct pproxy_worker*) ctx;
+
+    pproxy_mutex_lock(&worker->migrate_lock);
+    struct pproxy_connection *inbox = worker->inbox;
+    struct pproxy_worker *thief = worker->steal_thief;
+    long count = worker->steal_count;
+    worker->inbox = NULL;
+    worker->steal_thief = NULL;
+    worker->steal_count = 0;
+    pproxy_mutex_unlock(&worker->migrate_lock);
+
+    while (inbox) {
+        struct pproxy_connection *conn = inbox;
+        inbox = conn->tunnel_next;
+        pproxy_connection_attach(conn);
+    }
+
+    if (thief) {
+        give_tunnels(worker, thief, count);
+    }
+}
+
+/* Periodically looks for a busier worker to steal tunnels from. */
+static void balance_cb(evutil_socket_t fd, short what, void *ctx) {
+    (void) fd;
+    (void) what;
+
+    struct pproxy_worker *thief = (struct pproxy_worker*) ctx;
+    struct pproxy *handle = thief->handle;
+
+    struct pproxy_worker *victim = NULL;
+    long thief_load = worker_load(thief);
+    long max_load = thief_load;
+
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        struct pproxy_worker *worker = &handle->workers[i];
+        if (worker == thief || worker_tunnels(worker) == 0) {
+            continue;
+        }
+
+        long load = worker_load(worker);
+        if (load > max_load) {
+            max_load = load;
+            victim = worker;
+        }
+    }
+
+    if (!victim || max_load - thief_load < STEAL_THRESHOLD) {
+        return;
+    }
+
+    int post = 0;
+    pproxy_mutex_lock(&victim->migrate_lock);
+    if (!victim->steal_thief) {
+        victim->steal_thief = thief;
+        victim->steal_count = (max_load - thief_load) / 2;
+        post = 1;
+    }
+    pproxy_mutex_unlock(&victim->migrate_lock);
+
+    if (post) {
+        event_active(victim->migrate_event, EV_READ, 0);
+    }
+}
+
+int pproxy_migration_init(struct pproxy_worker *worker) {
+    struct pproxy *handle = worker->handle;
+
+    pproxy_mutex_init(&worker->migrate_lock);
+    worker->migration_initialized = 1;
+
+    worker->migrate_event = event_new(worker->base, -1, 0, migrate_cb,
+        worker);
+    if (!worker->migrate_event) {
+        return -1;
+    }
+
+    if (!handle->options.migrate_tunnels || handle->num_workers < 2) {
+        return 0;
+    }
+
+    worker->balance_timer = event_new(worker->base, -1, EV_PERSIST,
+        balance_cb, worker);
+    if (!worker->balance_timer) {
+        return -1;
+    }
+
+    struct timeval interval = {
+        handle->options.migrate_interval_ms / 1000,
+        (handle->options.migrate_interval_ms % 1000) * 1000
+    };
+    return evtimer_add(worker->balance_timer, &interval);
+}
+
+void pproxy_migration_free(struct pproxy_worker *worker) {
+    if (worker->balance_timer) {
+        event_free(worker->balance_timer);
+        worker->balance_timer = NULL;
+    }
+
+    if (worker->migrate_event) {
+        event_free(worker->migrate_event);
+        worker->migrate_event = NULL;
+    }
+
+    if (worker->migration_initialized) {
+        pproxy_mutex_destroy(&worker->migrate_lock);
+        worker->migration_initialized = 0;
+    }
+}
+
+void pproxy_migration_add_tunnel(struct pproxy_worker *worker,
+        struct pproxy_connection *conn) {
+    conn->tunnel_prev = NULL;
+    conn->tunnel_next = worker->tunnels;
+    if (worker->tunnels) {
+        worker->tunnels->tunnel_prev = conn;
+    }
+    worker->tunnels = conn;
+    ATOMIC_ADD(&worker->num_tunnels, 1);
+}
+
+void pproxy_migration_remove_tunnel(struct pproxy_worker *worker,
+        struct pproxy_connection *conn) {
+    if (conn->tunnel_prev) {
+        conn->tunnel_prev->tunnel_next = conn->tunnel_next;
+    } else {
+        worker->tunnels = conn->tunnel_next;
+    }
+    if (conn->tunnel_next) {
+        conn->tunnel_next->tunnel_prev = conn->tunnel_prev;
+    }
+    conn->tunnel_next = NULL;
+    conn->tunnel_prev = NULL;
+    ATOMIC_ADD(&worker->num_tunnels, -1);
+}
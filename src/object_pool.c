@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Per-worker recycling of connection structures and bufferevents.
+ *
+ * Client connections churn quickly, and each one costs a connection
+ * allocation plus bufferevents for the client and target sockets, whose
+ * setup allocates their evbuffers and registers their events. Parsers are
+ * only attached to a connection while a message is in flight, so they churn
+ * with every request rather than every connection. Freed objects
+ * are kept on the worker that freed them and handed to its next
+ * connections. A bufferevent is kept as a shell: its socket is closed and
+ * detached, its callbacks, timeouts and watermarks cleared and its buffers
+ * drained, and it is given the next socket with bufferevent_setfd.
+ *
+ * Everything here runs on the owning worker's thread. A migrated tunnel's
+ * objects are returned to the worker that frees them, whose base its
+ * bufferevents belong to by then.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "pproxy-internal.h"
+
+int pproxy_object_pool_init(struct pproxy_object_pool *pool,
+        struct pproxy_worker *worker) {
+    memset(pool, 0, sizeof(*pool));
+    pool->worker = worker;
+    pool->capacity = worker->handle->options.object_pool_size;
+
+    if (pool->capacity > 0) {
+        pool->bevs = (struct bufferevent**) calloc(pool->capacity,
+            sizeof(struct bufferevent*));
+        if (!pool->bevs) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void pproxy_object_pool_free(struct pproxy_object_pool *pool) {
+    while (pool->connections) {
+        struct pproxy_free_object *next = pool->connections->next;
+        free(pool->connections);
+        pool->connections = next;
+    }
+    pool->num_connections = 0;
+
+    while (pool->parsers) {
+        struct pproxy_free_object *next = pool->parsers->next;
+        free(pool->parsers);
+        pool->parsers = next;
+    }
+    pool->num_parsers = 0;
+
+    while (pool->num_bevs > 0) {
+        bufferevent_free(pool->bevs[--pool->num_bevs]);
+    }
+    free(pool->bevs);
+    pool->bevs = NULL;
+}
+
+struct pproxy_connection* pproxy_object_pool_get_connection(
+        struct pproxy_object_pool *pool) {
+    struct pproxy_free_object *object = pool->connections;
+    if (!object) {
+        ++pool->connection_misses;
+        return (struct pproxy_connection*) malloc(
+            sizeof(struct pproxy_connection));
+    }
+
+    ++pool->connection_hits;
+    pool->connections = object->next;
+    --pool->num_connections;
+    return (struct pproxy_connection*) object;
+}
+
+void pproxy_object_pool_put_connection(struct pproxy_object_pool *pool,
+        struct pproxy_connection *conn) {
+    if (pool->num_connections >= pool->capacity) {
+        free(conn);
+        return;
+    }
+
+    struct pproxy_free_object *object = (struct pproxy_free_object*) conn;
+    object->next = pool->connections;
+    pool->connections = object;
+    ++pool->num_connections;
+}
+
+struct pproxy_parser* pproxy_object_pool_get_parser(
+        struct pproxy_object_pool *pool) {
+    struct pproxy_free_object *object = pool->parsers;
+    if (!object) {
+        return (struct pproxy_parser*) malloc(sizeof(struct pproxy_parser));
+    }
+
+    pool->parsers = object->next;
+    --pool->num_parsers;
+    return (struct pproxy_parser*) object;
+}
+
+void pproxy_object_pool_put_parser(struct pproxy_object_pool *pool,
+        struct pproxy_parser *parser) {
+    pproxy_parser_free(parser);
+
+    if (pool->num_parsers >= pool->capacity) {
+        free(parser);
+        return;
+    }
+
+    struct pproxy_free_object *object = (struct pproxy_free_object*) parser;
+    object->next = pool->parsers;
+    pool->parsers = object;
+    ++pool->num_parsers;
+}
+
+struct bufferevent* pproxy_object_pool_get_bufferevent(
+        struct pproxy_object_pool *pool, evutil_socket_t fd) {
+    if (pool->num_bevs == 0) {
+        ++pool->bufferevent_misses;
+        return bufferevent_socket_new(pool->worker->base, fd,
+            BEV_OPT_CLOSE_ON_FREE);
+    }
+
+    struct bufferevent *bev = pool->bevs[pool->num_bevs - 1];
+    if (fd != -1 && bufferevent_setfd(bev, fd)) {
+        return NULL;
+    }
+
+    ++pool->bufferevent_hits;
+    --pool->num_bevs;
+    return bev;
+}
+
+void pproxy_object_pool_put_bufferevent(struct pproxy_object_pool *pool,
+        struct bufferevent *bev) {
+    if (pool->num_bevs >= pool->capacity) {
+        bufferevent_free(bev);
+        return;
+    }
+
+    /* bufferevent_setfd does not close the socket it replaces */
+    evutil_socket_t fd = bufferevent_getfd(bev);
+    bufferevent_disable(bev, EV_READ | EV_WRITE);
+    bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+    if (bufferevent_setfd(bev, -1)) {
+        bufferevent_free(bev);
+        return;
+    }
+    if (fd != -1) {
+        evutil_closesocket(fd);
+    }
+
+    struct evbuffer *input = bufferevent_get_input(bev);
+    struct evbuffer *output = bufferevent_get_output(bev);
+    evbuffer_drain(input, evbuffer_get_length(input));
+    evbuffer_drain(output, evbuffer_get_length(output));
+    bufferevent_set_timeouts(bev, NULL, NULL);
+    bufferevent_setwatermark(bev, EV_READ | EV_WRITE, 0, 0);
+    /* A rate limit configuration belongs to the connection */
+    bufferevent_set_rate_limit(bev, NULL);
+    bufferevent_remove_from_rate_limit_group(bev);
+
+    pool->bevs[pool->num_bevs++] = bev;
+}
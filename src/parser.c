@@ -0,0 +1,759 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * HTTP parser backends. Connections parse through struct pproxy_parser,
+ * which either wraps http_parser or, for requests, runs the SIMD backend.
+ *
+ * The SIMD backend does not interpret a request head byte by byte. It
+ * finds line ends with vector compares until it has seen the empty line
+ * ending the head, and only then parses the request line and the headers
+ * that frame the message (Content-Length, Transfer-Encoding, Connection);
+ * other headers are forwarded unexamined. Framing that http_parser refuses
+ * as ambiguous is refused here too, so the backends agree on where each
+ * request ends. Bodies, including chunk framing, are parsed by a small
+ * state machine. Callbacks and pausing follow http_parser, so the
+ * connection code does not depend on the backend.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PPROXY_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#include <event2/util.h>
+
+#include "pproxy-internal.h"
+
+/* http_parser backend */
+
+static int http_url_cb(struct http_parser *http, const char *at,
+        size_t len) {
+    struct pproxy_parser *parser = (struct pproxy_parser*) http->data;
+    if (!parser->callbacks->on_url) {
+        return 0;
+    }
+    return (*parser->callbacks->on_url)(parser, at, len);
+}
+
+static int http_headers_complete_cb(struct http_parser *http) {
+    struct pproxy_parser *parser = (struct pproxy_parser*) http->data;
+    if (!parser->callbacks->on_headers_complete) {
+        return 0;
+    }
+    return (*parser->callbacks->on_headers_complete)(parser);
+}
+
+static int http_body_cb(struct http_parser *http, const char *at,
+        size_t len) {
+    struct pproxy_parser *parser = (struct pproxy_parser*) http->data;
+    if (!parser->callbacks->on_body) {
+        return 0;
+    }
+    return (*parser->callbacks->on_body)(parser, at, len);
+}
+
+static int http_message_complete_cb(struct http_parser *http) {
+    struct pproxy_parser *parser = (struct pproxy_parser*) http->data;
+    if (!parser->callbacks->on_message_complete) {
+        return 0;
+    }
+    return (*parser->callbacks->on_message_complete)(parser);
+}
+
+static const struct http_parser_settings http_settings = {
+    .on_url = http_url_cb,
+    .on_headers_complete = http_headers_complete_cb,
+    .on_body = http_body_cb,
+    .on_message_complete = http_message_complete_cb
+};
+
+/* SIMD backend */
+
+enum simd_state {
+    /* gathering the request head */
+    S_HEAD = 0,
+    /* paused in on_headers_complete; the last byte of the head is yet to be
+     * consumed */
+    S_HEAD_LAST_BYTE,
+    S_BODY,
+    S_CHUNK_SIZE_START,
+    S_CHUNK_SIZE,
+    S_CHUNK_EXT,
+    S_CHUNK_SIZE_LF,
+    S_CHUNK_DATA,
+    S_CHUNK_DATA_CR,
+    S_CHUNK_DATA_LF,
+    S_TRAILER_START,
+    S_TRAILER_LINE,
+    S_TRAILER_END_LF,
+};
+
+#if defined(PPROXY_X86_SIMD)
+__attribute__((target("sse2")))
+static const char *find_byte_sse2(const char *p, const char *end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    for (; p < end; ++p) {
+        if (*p == c) {
+            return p;
+        }
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *p, const char *end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) p);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_sse2(p, end, c);
+}
+#endif
+
+/* Returns the first c in [p, end), or null */
+static const char *find_byte(const char *p, const char *end, char c) {
+#if defined(PPROXY_X86_SIMD)
+    if (__builtin_cpu_supports("avx2")) {
+        return find_byte_avx2(p, end, c);
+    }
+    return find_byte_sse2(p, end, c);
+#else
+    return (const char*) memchr(p, c, end - p);
+#endif
+}
+
+static void release_head(struct pproxy_simd_parser *simd) {
+    free(simd->head);
+    simd->head = 0;
+    simd->head_len = 0;
+    simd->head_scanned = 0;
+    simd->head_lines = 0;
+}
+
+static int save_head(struct pproxy_simd_parser *simd, const char *data,
+        size_t len) {
+    char *head = (char*) realloc(simd->head, simd->head_len + len);
+    if (!head) {
+        return -1;
+    }
+    memcpy(head + simd->head_len, data, len);
+    simd->head = head;
+    simd->head_len += len;
+    return 0;
+}
+
+/* Looks for the empty line that ends a request head in buf, resuming at
+ * head_scanned. Returns the length of the head, or 0 if it is incomplete,
+ * leaving head_scanned at the start of the incomplete line. Empty lines
+ * before the request line are skipped, as by http_parser. */
+static size_t scan_head(struct pproxy_simd_parser *simd, const char *buf,
+        size_t len) {
+    const char *p = buf + simd->head_scanned;
+    const char *end = buf + len;
+    const char *nl;
+    while ((nl = find_byte(p, end, '\n'))) {
+        size_t line_len = nl - p;
+        if (line_len > 0 && nl[-1] == '\r') {
+            --line_len;
+        }
+        p = nl + 1;
+        if (line_len > 0) {
+            ++simd->head_lines;
+        } else if (simd->head_lines > 0) {
+            return p - buf;
+        }
+    }
+    simd->head_scanned = p - buf;
+    return 0;
+}
+
+static int find_method(const char *name, size_t len) {
+    if (len == 3 && memcmp(name, "GET", 3) == 0) {
+        return HTTP_GET;
+    }
+    int i;
+    for (i = 0; i < 64; ++i) {
+        const char *method = http_method_str((enum http_method) i);
+        if (strcmp(method, "<unknown>") == 0) {
+            break;
+        }
+        if (strlen(method) == len && memcmp(method, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int value_is(const char *value, size_t len, const char *token) {
+    return strlen(token) == len &&
+        evutil_ascii_strncasecmp(value, token, len) == 0;
+}
+
+/* Records the keep-alive and close tokens of a Connection header */
+static void parse_connection(const char *p, const char *end, int *close,
+        int *keep_alive) {
+    while (p < end) {
+        const char *comma = (const char*) memchr(p, ',', end - p);
+        const char *token_end = comma ? comma : end;
+        while (p < token_end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        const char *q = token_end;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t')) {
+            --q;
+        }
+        if (value_is(p, q - p, "close")) {
+            *close = 1;
+        } else if (value_is(p, q - p, "keep-alive")) {
+            *keep_alive = 1;
+        }
+        p = comma ? comma + 1 : end;
+    }
+}
+
+/* Returns the end of the line at p, excluding the line terminator, and
+ * sets next to the start of the following line */
+static const char *line_end(const char *p, const char *end,
+        const char **next) {
+    const char *nl = find_byte(p, end, '\n');
+    *next = nl + 1;
+    if (nl > p && nl[-1] == '\r') {
+        --nl;
+    }
+    return nl;
+}
+
+/* Parses a complete request head in [p, end) */
+static enum http_errno parse_head(struct pproxy_simd_parser *simd,
+        const char *p, const char *end, const char **url, size_t *url_len) {
+    while (*p == '\r' || *p == '\n') {
+        ++p;
+    }
+
+    const char *next;
+    const char *eol = line_end(p, end, &next);
+
+    const char *sp = (const char*) memchr(p, ' ', eol - p);
+    if (!sp || (simd->method = find_method(p, sp - p)) < 0) {
+        return HPE_INVALID_METHOD;
+    }
+
+    *url = sp + 1;
+    sp = (const char*) memchr(*url, ' ', eol - *url);
+    if (!sp || sp == *url) {
+        return HPE_INVALID_URL;
+    }
+    *url_len = sp - *url;
+
+    const char *v = sp + 1;
+    if (eol - v != 8 || memcmp(v, "HTTP/", 5) != 0 ||
+            v[5] < '0' || v[5] > '9' || v[6] != '.' ||
+            v[7] < '0' || v[7] > '9') {
+        return HPE_INVALID_VERSION;
+    }
+    int http11 = v[5] > '1' || (v[5] == '1' && v[7] > '0');
+
+    int close = 0;
+    int keep_alive = 0;
+    int has_length = 0;
+    int has_encoding = 0;
+    /* the previous header is one that isn't interpreted here */
+    int may_fold = 0;
+    simd->chunked = 0;
+    simd->content_length = 0;
+
+    for (p = next; ; p = next) {
+        eol = line_end(p, end, &next);
+        if (eol == p) {
+            break;
+        }
+        if (*p == ' ' || *p == '\t') {
+            /* A folded continuation is forwarded with its header, unless
+             * that header frames the message; then it would go unread */
+            if (!may_fold) {
+                return HPE_INVALID_HEADER_TOKEN;
+            }
+            continue;
+        }
+
+        const char *colon = (const char*) memchr(p, ':', eol - p);
+        if (!colon || colon == p) {
+            return HPE_INVALID_HEADER_TOKEN;
+        }
+        const char *c;
+        for (c = p; c < colon; ++c) {
+            if ((unsigned char) *c <= ' ' || *c == 0x7f) {
+                return HPE_INVALID_HEADER_TOKEN;
+            }
+        }
+
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        const char *value_end = eol;
+        while (value_end > value &&
+                (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            --value_end;
+        }
+
+        size_t name_len = colon - p;
+        may_fold = 0;
+        if (value_is(p, name_len, "content-length")) {
+            /* Intermediaries could disagree on which length applies */
+            if (has_length) {
+                return PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH;
+            }
+            has_length = 1;
+            if (value == value_end) {
+                return HPE_INVALID_CONTENT_LENGTH;
+            }
+            uint64_t length = 0;
+            for (c = value; c < value_end; ++c) {
+                if (*c < '0' || *c > '9' ||
+                        length > (UINT64_MAX - 10) / 10) {
+                    return HPE_INVALID_CONTENT_LENGTH;
+                }
+                length = length * 10 + (*c - '0');
+            }
+            simd->content_length = length;
+        } else if (value_is(p, name_len, "transfer-encoding")) {
+            /* chunked has to be the final coding */
+            has_encoding = 1;
+            size_t len = value_end - value;
+            simd->chunked = len >= 7 &&
+                value_is(value_end - 7, 7, "chunked") &&
+                (len == 7 || value_end[-8] == ',' || value_end[-8] == ' ');
+        } else if (value_is(p, name_len, "connection")) {
+            parse_connection(value, value_end, &close, &keep_alive);
+        } else {
+            may_fold = 1;
+        }
+    }
+
+    /* As http_parser, refuse framing that could be read two ways */
+    if (has_encoding) {
+        if (has_length) {
+            return PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH;
+        }
+        if (!simd->chunked) {
+            return PPROXY_HPE_INVALID_TRANSFER_ENCODING;
+        }
+    }
+
+    simd->keep_alive = http11 ? !close : keep_alive && !close;
+    return HPE_OK;
+}
+
+/* The completion handlers return nonzero if parsing has to stop */
+
+static int simd_message_complete(struct pproxy_parser *parser) {
+    struct pproxy_simd_parser *simd = &parser->simd;
+
+    simd->state = S_HEAD;
+    if (parser->callbacks->on_message_complete &&
+            (*parser->callbacks->on_message_complete)(parser) != 0 &&
+            simd->error == HPE_OK) {
+        simd->error = HPE_CB_message_complete;
+    }
+    return simd->error != HPE_OK;
+}
+
+/* Starts the body, if any, once the head has been handled */
+static int simd_head_done(struct pproxy_parser *parser) {
+    struct pproxy_simd_parser *simd = &parser->simd;
+
+    /* A tunnel's payload follows its head; it isn't a body */
+    if (simd->skip_body || simd->method == HTTP_CONNECT ||
+            (!simd->chunked && simd->content_length == 0)) {
+        return simd_message_complete(parser);
+    }
+
+    simd->remaining = simd->chunked ? 0 : simd->content_length;
+    simd->state = simd->chunked ? S_CHUNK_SIZE_START : S_BODY;
+    return simd->error != HPE_OK;
+}
+
+static int simd_body(struct pproxy_parser *parser, const char **p,
+        const char *end) {
+    struct pproxy_simd_parser *simd = &parser->simd;
+
+    size_t len = end - *p;
+    if (len > simd->remaining) {
+        len = (size_t) simd->remaining;
+    }
+    const char *data = *p;
+    *p += len;
+    simd->remaining -= len;
+
+    if (parser->callbacks->on_body &&
+            (*parser->callbacks->on_body)(parser, data, len) != 0 &&
+            simd->error == HPE_OK) {
+        simd->error = HPE_CB_body;
+    }
+    return simd->error != HPE_OK;
+}
+
+static int unhex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Handles the request head ending in the data at p; returns nonzero if
+ * parsing has to stop */
+static int simd_head(struct pproxy_parser *parser, const char **p,
+        const char *end) {
+    struct pproxy_simd_parser *simd = &parser->simd;
+
+    const char *head;
+    size_t head_len;
+    size_t consumed;
+    if (simd->head_len == 0) {
+        head_len = scan_head(simd, *p, end - *p);
+        if (head_len == 0) {
+            if ((size_t) (end - *p) > PPROXY_MAX_HEAD_SIZE) {
+                simd->error = HPE_HEADER_OVERFLOW;
+            } else if (save_head(simd, *p, end - *p)) {
+                simd->error = HPE_UNKNOWN;
+            } else {
+                *p = end;
+            }
+            return 1;
+        }
+        head = *p;
+        consumed = head_len;
+    } else {
+        size_t saved = simd->head_len;
+        size_t len = end - *p;
+        if (len > PPROXY_MAX_HEAD_SIZE - saved) {
+            len = PPROXY_MAX_HEAD_SIZE - saved;
+        }
+        if (save_head(simd, *p, len)) {
+            simd->error = HPE_UNKNOWN;
+            return 1;
+        }
+        head_len = scan_head(simd, simd->head, simd->head_len);
+        if (head_len == 0) {
+            if (len < (size_t) (end - *p)) {
+                simd->error = HPE_HEADER_OVERFLOW;
+            } else {
+                *p = end;
+            }
+            return 1;
+        }
+        head = simd->head;
+        consumed = head_len - saved;
+    }
+
+    const char *url;
+    size_t url_len;
+    simd->error = parse_head(simd, head, head + head_len, &url, &url_len);
+    if (simd->error != HPE_OK) {
+        release_head(simd);
+        return 1;
+    }
+    *p += consumed;
+
+    /* url may point into the saved head */
+    if (parser->callbacks->on_url &&
+            (*parser->callbacks->on_url)(parser, url, url_len) != 0 &&
+            simd->error == HPE_OK) {
+        simd->error = HPE_CB_url;
+    }
+    release_head(simd);
+    if (simd->error != HPE_OK) {
+        return 1;
+    }
+
+    int rc = 0;
+    if (parser->callbacks->on_headers_complete) {
+        rc = (*parser->callbacks->on_headers_complete)(parser);
+    }
+    if (rc != 0 && rc != 1) {
+        if (simd->error == HPE_OK || simd->error == HPE_PAUSED) {
+            simd->error = HPE_CB_headers_complete;
+        }
+        return 1;
+    }
+    simd->skip_body = rc;
+
+    if (simd->error == HPE_PAUSED) {
+        /* The body is started on resume, which needs a byte to parse;
+         * leave it the last one of the head, as http_parser does */
+        simd->state = S_HEAD_LAST_BYTE;
+        --*p;
+        return 1;
+    }
+    if (simd->error != HPE_OK) {
+        return 1;
+    }
+    return simd_head_done(parser);
+}
+
+static size_t simd_execute(struct pproxy_parser *parser, const char *data,
+        size_t len) {
+    struct pproxy_simd_parser *simd = &parser->simd;
+    const char *p = data;
+    const char *end = data + len;
+
+    if (simd->error != HPE_OK) {
+        return 0;
+    }
+
+    while (p < end) {
+        int stop = 0;
+        int digit;
+
+        switch (simd->state) {
+        case S_HEAD:
+            stop = simd_head(parser, &p, end);
+            break;
+        case S_HEAD_LAST_BYTE:
+            ++p;
+            stop = simd_head_done(parser);
+            break;
+        case S_BODY:
+            stop = simd_body(parser, &p, end);
+            if (!stop && simd->remaining == 0) {
+                stop = simd_message_complete(parser);
+            }
+            break;
+        case S_CHUNK_SIZE_START:
+        case S_CHUNK_SIZE:
+            digit = unhex(*p);
+            if (digit >= 0) {
+                if (simd->remaining >> 60) {
+                    simd->error = HPE_INVALID_CHUNK_SIZE;
+                    return p - data;
+                }
+                simd->remaining = simd->remaining * 16 + digit;
+                simd->state = S_CHUNK_SIZE;
+            } else if (simd->state == S_CHUNK_SIZE_START) {
+                simd->error = HPE_INVALID_CHUNK_SIZE;
+                return p - data;
+            } else if (*p == '\r') {
+                simd->state = S_CHUNK_SIZE_LF;
+            } else if (*p == '\n') {
+                simd->state = simd->remaining ? S_CHUNK_DATA :
+                    S_TRAILER_START;
+            } else if (*p == ';' || *p == ' ' || *p == '\t') {
+                simd->state = S_CHUNK_EXT;
+            } else {
+                simd->error = HPE_INVALID_CHUNK_SIZE;
+                return p - data;
+            }
+            ++p;
+            break;
+        case S_CHUNK_EXT:
+            if (*p == '\r') {
+                simd->state = S_CHUNK_SIZE_LF;
+            } else if (*p == '\n') {
+                simd->state = simd->remaining ? S_CHUNK_DATA :
+                    S_TRAILER_START;
+            }
+            ++p;
+            break;
+        case S_CHUNK_SIZE_LF:
+            if (*p != '\n') {
+                simd->error = HPE_LF_EXPECTED;
+                return p - data;
+            }
+            simd->state = simd->remaining ? S_CHUNK_DATA : S_TRAILER_START;
+            ++p;
+            break;
+        case S_CHUNK_DATA:
+            stop = simd_body(parser, &p, end);
+            if (simd->remaining == 0) {
+                simd->state = S_CHUNK_DATA_CR;
+            }
+            break;
+        case S_CHUNK_DATA_CR:
+            if (*p == '\r') {
+                simd->state = S_CHUNK_DATA_LF;
+            } else if (*p == '\n') {
+                simd->state = S_CHUNK_SIZE_START;
+            } else {
+                simd->error = HPE_STRICT;
+                return p - data;
+            }
+            ++p;
+            break;
+        case S_CHUNK_DATA_LF:
+            if (*p != '\n') {
+                simd->error = HPE_LF_EXPECTED;
+                return p - data;
+            }
+            simd->state = S_CHUNK_SIZE_START;
+            ++p;
+            break;
+        case S_TRAILER_START:
+            if (*p == '\r') {
+                simd->state = S_TRAILER_END_LF;
+                ++p;
+            } else if (*p == '\n') {
+                ++p;
+                stop = simd_message_complete(parser);
+            } else {
+                simd->state = S_TRAILER_LINE;
+            }
+            break;
+        case S_TRAILER_LINE: {
+            const char *nl = (const char*) memchr(p, '\n', end - p);
+            if (nl) {
+                simd->state = S_TRAILER_START;
+                p = nl + 1;
+            } else {
+                p = end;
+            }
+            break;
+        }
+        case S_TRAILER_END_LF:
+            if (*p != '\n') {
+                simd->error = HPE_LF_EXPECTED;
+                return p - data;
+            }
+            ++p;
+            stop = simd_message_complete(parser);
+            break;
+        }
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return p - data;
+}
+
+void pproxy_parser_init(struct pproxy_parser *parser,
+        enum http_parser_type type, int backend,
+        const struct pproxy_parser_callbacks *callbacks, void *data) {
+    memset(parser, 0, sizeof(*parser));
+    parser->type = type;
+    parser->backend = type == HTTP_REQUEST ? backend :
+        PPROXY_PARSER_HTTP_PARSER;
+    parser->callbacks = callbacks;
+    parser->data = data;
+    pproxy_parser_reset(parser);
+}
+
+void pproxy_parser_reset(struct pproxy_parser *parser) {
+    http_parser_init(&parser->http, parser->type);
+    parser->http.data = parser;
+
+    release_head(&parser->simd);
+    memset(&parser->simd, 0, sizeof(parser->simd));
+}
+
+void pproxy_parser_free(struct pproxy_parser *parser) {
+    release_head(&parser->simd);
+}
+
+size_t pproxy_parser_execute(struct pproxy_parser *parser, const char *data,
+        size_t len) {
+    if (parser->backend == PPROXY_PARSER_SIMD) {
+        return simd_execute(parser, data, len);
+    }
+    return http_parser_execute(&parser->http, &http_settings, data, len);
+}
+
+void pproxy_parser_pause(struct pproxy_parser *parser, int paused) {
+    if (parser->backend != PPROXY_PARSER_SIMD) {
+        http_parser_pause(&parser->http, paused);
+    } else if (paused && parser->simd.error == HPE_OK) {
+        parser->simd.error = HPE_PAUSED;
+    } else if (!paused && parser->simd.error == HPE_PAUSED) {
+        parser->simd.error = HPE_OK;
+    }
+}
+
+enum http_errno pproxy_parser_errno(struct pproxy_parser *parser) {
+    if (parser->backend == PPROXY_PARSER_SIMD) {
+        return parser->simd.error;
+    }
+    return HTTP_PARSER_ERRNO(&parser->http);
+}
+
+int pproxy_parser_method(struct pproxy_parser *parser) {
+    if (parser->backend == PPROXY_PARSER_SIMD) {
+        return parser->simd.method;
+    }
+    return parser->http.method;
+}
+
+int pproxy_parser_status_code(struct pproxy_parser *parser) {
+    /* only responses have one, and those use http_parser */
+    return parser->http.status_code;
+}
+
+int pproxy_parser_should_keep_alive(struct pproxy_parser *parser) {
+    if (parser->backend == PPROXY_PARSER_SIMD) {
+        return parser->simd.keep_alive;
+    }
+    return http_should_keep_alive(&parser->http);
+}
+
+uint64_t pproxy_parser_body_remaining(struct pproxy_parser *parser) {
+    if (parser->backend == PPROXY_PARSER_SIMD) {
+        if (parser->simd.state != S_BODY &&
+                parser->simd.state != S_CHUNK_DATA) {
+            return 0;
+        }
+        return parser->simd.remaining;
+    }
+    if (parser->http.content_length == ULLONG_MAX) {
+        return 0;
+    }
+    return parser->http.content_length;
+}
+
+void pproxy_parser_skip_body(struct pproxy_parser *parser, uint64_t len) {
+    if (parser->backend == PPROXY_PARSER_SIMD) {
+        parser->simd.remaining -= len;
+    } else {
+        parser->http.content_length -= len;
+    }
+}
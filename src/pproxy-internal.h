@@ -23,9 +23,16 @@
 #ifndef PPROXY_INTERNAL_H_
 #define PPROXY_INTERNAL_H_
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #include <event2/buffer.h>
 #include <event2/event.h>
 #include <http_parser.h>
@@ -33,22 +40,644 @@
 #include "pproxy/callbacks.h"
 #include "pproxy/pproxy.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #if !defined(NDEBUG)
 #define log_debug(...) fprintf(stderr, __VA_ARGS__)
 #else
 #define log_debug(...) while (0) fprintf(stderr, __VA_ARGS__)
 #endif
 
+#if defined(_WIN32)
+#define FENCE MemoryBarrier
+#define ATOMIC_ADD(ptr, v) InterlockedExchangeAdd((ptr), (v))
+#define ATOMIC_CAS(ptr, old, new) \
+    (InterlockedCompareExchange((ptr), (new), (old)) == (old))
+#else
+#define FENCE __sync_synchronize
+#define ATOMIC_ADD(ptr, v) __sync_fetch_and_add((ptr), (v))
+#define ATOMIC_CAS(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#endif
+
 /* states that the server run loop can be in */
 enum proxy_server_state { PROXY_INIT, PROXY_RUNNING, PROXY_TERMINATED };
 
-struct pproxy {
-    int16_t port;
+#if defined(_WIN32)
+typedef HANDLE pproxy_thread_t;
+typedef CRITICAL_SECTION pproxy_mutex_t;
+#define pproxy_mutex_init(m) InitializeCriticalSection(m)
+#define pproxy_mutex_destroy(m) DeleteCriticalSection(m)
+#define pproxy_mutex_lock(m) EnterCriticalSection(m)
+#define pproxy_mutex_unlock(m) LeaveCriticalSection(m)
+#else
+typedef pthread_t pproxy_thread_t;
+typedef pthread_mutex_t pproxy_mutex_t;
+#define pproxy_mutex_init(m) pthread_mutex_init((m), NULL)
+#define pproxy_mutex_destroy(m) pthread_mutex_destroy(m)
+#define pproxy_mutex_lock(m) pthread_mutex_lock(m)
+#define pproxy_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+
+struct pproxy_connection;
+
+/*
+ * Bounded single-producer, single-consumer ring of accepted sockets. The
+ * acceptor thread is the only producer and the owning worker is the only
+ * consumer, so the head and tail indices are each written by one thread.
+ */
+struct pproxy_handoff_queue {
+    evutil_socket_t *fds;
+    long capacity; /* power of two */
+    volatile long head; /* next slot to consume; written by consumer */
+    volatile long tail; /* next slot to produce; written by producer */
+};
+
+int pproxy_handoff_queue_init(struct pproxy_handoff_queue *queue,
+    long capacity);
+void pproxy_handoff_queue_free(struct pproxy_handoff_queue *queue);
+
+/* @return 0 on success, -1 if the queue is full */
+int pproxy_handoff_queue_push(struct pproxy_handoff_queue *queue,
+    evutil_socket_t fd);
+
+/* @return 0 on success, -1 if the queue is empty */
+int pproxy_handoff_queue_pop(struct pproxy_handoff_queue *queue,
+    evutil_socket_t *fd);
+
+/* @return the number of sockets waiting in the queue */
+long pproxy_handoff_queue_size(struct pproxy_handoff_queue *queue);
+
+struct pproxy_worker;
+
+/* an idle upstream connection, linked most recently used first */
+struct pproxy_pooled_upstream {
+    struct pproxy_upstream_pool *pool;
+    struct bufferevent *bev;
+    char *host;
+    uint16_t port;
+    struct event *expiry;
+    struct pproxy_pooled_upstream *next;
+    struct pproxy_pooled_upstream *prev;
+};
+
+/* per-worker pool of idle keep-alive connections to targets */
+struct pproxy_upstream_pool {
+    struct pproxy_worker *worker;
+    struct pproxy_pooled_upstream *head;
+    struct pproxy_pooled_upstream *tail;
+    int size;
+};
+
+void pproxy_upstream_pool_init(struct pproxy_upstream_pool *pool,
+    struct pproxy_worker *worker);
+void pproxy_upstream_pool_free(struct pproxy_upstream_pool *pool);
+
+/*
+ * Takes an idle connection to host:port out of the pool. The bufferevent is
+ * returned with no callbacks installed.
+ *
+ * @return the connection, or NULL if there is none
+ */
+struct bufferevent* pproxy_upstream_pool_get(struct pproxy_upstream_pool *pool,
+    const char *host, uint16_t port);
+
+/*
+ * Offers an idle connection to host:port to the pool, which takes ownership
+ * on success.
+ *
+ * @return 0 on success, -1 if the connection was not pooled
+ */
+int pproxy_upstream_pool_put(struct pproxy_upstream_pool *pool,
+    struct bufferevent *bev, const char *host, uint16_t port);
+
+struct pproxy_timer;
+
+typedef void (*pproxy_timer_cb)(struct pproxy_timer *timer);
+
+/* a timer on a worker's wheel, embedded in the structure it times */
+struct pproxy_timer {
+    struct pproxy_timer *next;
+    struct pproxy_timer **pprev; /* NULL unless scheduled */
+    uint64_t expires; /* in ticks */
+    pproxy_timer_cb cb;
+};
+
+#define PPROXY_WHEEL_BITS 8
+#define PPROXY_WHEEL_SIZE (1 << PPROXY_WHEEL_BITS)
+#define PPROXY_WHEEL_LEVEL_BITS 6
+#define PPROXY_WHEEL_LEVEL_SIZE (1 << PPROXY_WHEEL_LEVEL_BITS)
+#define PPROXY_WHEEL_LEVELS 3
+
+/* per-worker hierarchical timer wheel; see timer_wheel.c */
+struct pproxy_timer_wheel {
+    struct pproxy_worker *worker;
+    struct event *tick_event;
+    int tick_ms;
+    struct timeval origin; /* start of tick 0 */
+    uint64_t next_tick; /* the next tick to expire */
+    long count; /* scheduled timers */
+    struct pproxy_timer *slots[PPROXY_WHEEL_SIZE];
+    struct pproxy_timer *levels[PPROXY_WHEEL_LEVELS][PPROXY_WHEEL_LEVEL_SIZE];
+};
+
+/* @return 0 on success, -1 on error */
+int pproxy_timer_wheel_init(struct pproxy_timer_wheel *wheel,
+    struct pproxy_worker *worker);
+/* Scheduled timers are abandoned */
+void pproxy_timer_wheel_free(struct pproxy_timer_wheel *wheel);
+
+void pproxy_timer_init(struct pproxy_timer *timer, pproxy_timer_cb cb);
+/*
+ * Schedules the timer to fire no earlier than ms from now, rescheduling it
+ * if it is pending. It fires at most about two ticks late.
+ */
+void pproxy_timer_schedule(struct pproxy_timer_wheel *wheel,
+    struct pproxy_timer *timer, int ms);
+void pproxy_timer_cancel(struct pproxy_timer_wheel *wheel,
+    struct pproxy_timer *timer);
+
+static inline int pproxy_timer_pending(const struct pproxy_timer *timer) {
+    return timer->pprev != NULL;
+}
+
+/* stops and restarts a listener around the connection limit; see
+ * admission.c */
+struct pproxy_admission {
+    struct pproxy *handle;
+    struct evconnlistener *listener;
+    struct event *resume_timer; /* polls while the listener is disabled */
+    int paused;
+};
+
+/* @return 0 on success, -1 on error */
+int pproxy_admission_init(struct pproxy_admission *admission,
+    struct pproxy *handle, struct event_base *base,
+    struct evconnlistener *listener);
+void pproxy_admission_free(struct pproxy_admission *admission);
+/* Disables the listener if the proxy is at its connection limit */
+void pproxy_admission_check(struct pproxy_admission *admission);
+
+/* per-worker CoDel state for shedding new connections under overload */
+struct pproxy_codel {
+    /* when a delay that has stayed above the target becomes persistent;
+     * unset while the delay is below it */
+    struct timeval above_until;
+    int dropping;
+    int drop_count;
+    struct timeval drop_next;
+};
+
+/*
+ * Records the queueing delay of a connection, from its acceptance to its
+ * first byte being read.
+ */
+void pproxy_codel_sample(struct pproxy_codel *codel,
+    const struct pproxy_options *options, const struct timeval *now,
+    const struct timeval *accepted);
+/* @return 0 to admit a new connection, -1 to shed it */
+int pproxy_codel_admit(struct pproxy_codel *codel,
+    const struct pproxy_options *options, const struct timeval *now);
+
+struct sockaddr;
+
+/* a client address, with IPv4 addresses mapped into IPv6, and IPv6
+ * addresses cut to their /64 prefix */
+struct pproxy_client_addr {
+    uint8_t bytes[16];
+};
+
+/* a slot of the client table */
+struct pproxy_client_entry {
+    struct pproxy_client_addr addr;
+    int used;
+    int connections;
+    /* request tokens, in thousandths */
+    int64_t tokens;
+    uint64_t refilled_ms;
+    /* recency list of used slots without connections, by index; -1 at
+     * either end */
+    int32_t newer;
+    int32_t older;
+};
+
+/* a part of the client table, by address hash */
+struct pproxy_client_shard {
+    pproxy_mutex_t lock;
+    struct pproxy_client_entry *slots;
+    size_t mask;
+    size_t count;
+    size_t max_count;
+    int32_t newest;
+    int32_t oldest;
+    /* keeps the shards' locks on separate cache lines */
+    char padding[64];
+};
+
+/* per-client limits shared by the workers; see client_limits.c */
+struct pproxy_client_table {
+    struct pproxy_client_shard *shards;
+    size_t num_shards;
+    int request_rate;
+    int request_burst;
+    int max_connections;
+};
+
+/* Tracking is disabled, and the table empty, without any per-client limit.
+ * @return 0 on success, -1 on error */
+int pproxy_client_table_init(struct pproxy_client_table *table,
+    const struct pproxy_options *options);
+void pproxy_client_table_free(struct pproxy_client_table *table);
+
+static inline int pproxy_client_table_enabled(
+        const struct pproxy_client_table *table) {
+    return table->shards != NULL;
+}
+
+/* @return 0 on success, -1 if the address family isn't supported */
+int pproxy_client_addr_set(struct pproxy_client_addr *addr,
+    const struct sockaddr *saddr);
+
+/* Counts a new connection from the client.
+ * @return 0 if it is admitted, -1 if the client has too many already, or
+ * the table is full of clients with connections */
+int pproxy_client_connect(struct pproxy_client_table *table,
+    const struct pproxy_client_addr *addr);
+void pproxy_client_disconnect(struct pproxy_client_table *table,
+    const struct pproxy_client_addr *addr);
+/* Takes a token from the client's request bucket.
+ * @return 0 if the request is admitted, -1 if it is over the rate */
+int pproxy_client_request(struct pproxy_client_table *table,
+    const struct pproxy_client_addr *addr, uint64_t now_ms);
+
+struct ev_token_bucket_cfg;
+struct bufferevent_rate_limit_group;
+
+/* a named rate limit group, defined before the proxy starts */
+struct pproxy_rate_group {
+    char *name;
+    size_t read_rate;
+    size_t write_rate;
+};
+
+/*
+ * Token bucket configuration for the rates, in bytes per second, refilled
+ * every timer tick; a rate of 0 is unlimited.
+ *
+ * @return the configuration, or NULL on error
+ */
+struct ev_token_bucket_cfg *pproxy_rate_limit_cfg(
+    const struct pproxy_options *options, size_t read_rate,
+    size_t write_rate);
+/* Frees the worker's instances of the groups, which must be empty */
+void pproxy_worker_rate_groups_free(struct pproxy_worker *worker);
+void pproxy_rate_groups_free(struct pproxy *handle);
+
+/* a named latency profile; its empirical samples are owned and sorted */
+struct pproxy_latency_def {
+    char *name;
+    struct pproxy_latency_profile profile;
+};
+
+/* a connection's injected latency; see latency.c */
+struct pproxy_latency {
+    /* NULL if none */
+    const struct pproxy_latency_profile *profile;
+    /* identifies the connection's sequence of delays */
+    uint64_t stream;
+    uint64_t random;
+    /* pending while a phase's delay runs, after which resume continues */
+    struct pproxy_timer timer;
+    void (*resume)(struct pproxy_connection *conn);
+    /* the target read being delivered has waited out its delay */
+    int released;
+    /* part of the current response has been delivered */
+    int responding;
+};
+
+/* @return the index of the named profile, or -1 */
+int pproxy_latency_find(struct pproxy *handle, const char *name);
+void pproxy_latency_seed(struct pproxy_latency *latency,
+    const struct pproxy_latency_profile *profile);
+/* @return the next delay of the phase, in milliseconds */
+int pproxy_latency_sample(struct pproxy_latency *latency, int phase);
+void pproxy_latency_profiles_free(struct pproxy *handle);
+
+/* a pooled object, linked through its first bytes */
+struct pproxy_free_object {
+    struct pproxy_free_object *next;
+};
+
+/* per-worker free lists of connection structures, parsers and
+ * bufferevents */
+struct pproxy_object_pool {
+    struct pproxy_worker *worker;
+    struct pproxy_free_object *connections;
+    int num_connections;
+    struct pproxy_free_object *parsers;
+    int num_parsers;
+    /* bufferevent shells, with no socket, callbacks or buffered data */
+    struct bufferevent **bevs;
+    int num_bevs;
+    /* limit on each kind of object */
+    int capacity;
+    /* written by the worker only; see pproxy_get_pool_stats */
+    volatile long connection_hits;
+    volatile long connection_misses;
+    volatile long bufferevent_hits;
+    volatile long bufferevent_misses;
+};
+
+/* @return 0 on success, -1 on error */
+int pproxy_object_pool_init(struct pproxy_object_pool *pool,
+    struct pproxy_worker *worker);
+void pproxy_object_pool_free(struct pproxy_object_pool *pool);
+
+/* @return uninitialized memory for a connection, or NULL on error */
+struct pproxy_connection* pproxy_object_pool_get_connection(
+    struct pproxy_object_pool *pool);
+void pproxy_object_pool_put_connection(struct pproxy_object_pool *pool,
+    struct pproxy_connection *conn);
+
+/* @return uninitialized memory for a parser, or NULL on error */
+struct pproxy_parser* pproxy_object_pool_get_parser(
+    struct pproxy_object_pool *pool);
+/* Frees the parser's state and keeps or frees its memory */
+void pproxy_object_pool_put_parser(struct pproxy_object_pool *pool,
+    struct pproxy_parser *parser);
+
+/*
+ * Gets a socket bufferevent on the worker's base for fd, which may be -1 as
+ * for bufferevent_socket_new. The socket is closed when the bufferevent is
+ * put back or freed.
+ *
+ * @return the bufferevent, or NULL on error
+ */
+struct bufferevent* pproxy_object_pool_get_bufferevent(
+    struct pproxy_object_pool *pool, evutil_socket_t fd);
+/* Closes the bufferevent's socket and keeps or frees the bufferevent. It
+ * must be an established connection's, not one in the middle of connecting,
+ * and it must belong to the worker's base. */
+void pproxy_object_pool_put_bufferevent(struct pproxy_object_pool *pool,
+    struct bufferevent *bev);
+
+/*
+ * Invoked when a shared lookup completes.
+ *
+ * @param result 0 on success, or an EVUTIL_EAI_* error; EVUTIL_EAI_AGAIN if
+ *        the configured DNS deadline passed first
+ * @param addrs the resolved addresses, owned by the cache; copy what is
+ *        needed before returning
+ */
+typedef void (*pproxy_resolve_cb)(int result, struct evutil_addrinfo *addrs,
+    void *arg);
+
+struct pproxy_dns_entry;
+
+/* a caller waiting on an in-flight lookup */
+struct pproxy_resolve_waiter {
+    pproxy_resolve_cb cb;
+    void *arg;
+    struct pproxy_dns_entry *entry; /* NULL unless waiting */
+    struct event *deadline;
+    struct pproxy_resolve_waiter *next;
+    struct pproxy_resolve_waiter *prev;
+};
+
+/* per-worker cache of hostname lookups; see resolver.c */
+struct pproxy_resolver {
+    struct pproxy_worker *worker;
+    struct pproxy_dns_entry **buckets;
+    unsigned long num_buckets; /* power of two */
+    struct pproxy_dns_entry *lru_head; /* most recently used */
+    struct pproxy_dns_entry *lru_tail;
+    int size;
+};
+
+int pproxy_resolver_init(struct pproxy_resolver *resolver,
+    struct pproxy_worker *worker);
+void pproxy_resolver_free(struct pproxy_resolver *resolver);
+
+/*
+ * Resolves a hostname through the cache. Concurrent lookups of the same name
+ * share a single query.
+ *
+ * @param addrs set to the cached addresses on a hit; owned by the cache
+ * @return 0 on a hit, 1 if the waiter's callback will be invoked later, or
+ *         -1 if the name is cached as nonexistent or the lookup failed
+ */
+int pproxy_resolver_resolve(struct pproxy_resolver *resolver,
+    const char *host, struct pproxy_resolve_waiter *waiter,
+    struct evutil_addrinfo **addrs);
+
+/* Stops waiting on a lookup; the lookup itself continues for the cache */
+void pproxy_resolver_cancel(struct pproxy_resolve_waiter *waiter);
+
+/*
+ * Invoked when a connector finishes.
+ *
+ * @param bev the connected bufferevent, with no callbacks installed and
+ *        owned by the callee; NULL if every address failed
+ * @param error the last socket error if every address failed
+ */
+typedef void (*pproxy_connector_cb)(struct bufferevent *bev, int error,
+    void *arg);
+
+/* upper bounds on the addresses tried, and on concurrent attempts */
+#define PPROXY_MAX_CONNECT_ADDRS 16
+#define PPROXY_MAX_CONNECT_ATTEMPTS 4
+
+/* reported for connect attempts that exceed their deadline */
+#if defined(_WIN32)
+#define PPROXY_ETIMEDOUT WSAETIMEDOUT
+#else
+#define PPROXY_ETIMEDOUT ETIMEDOUT
+#endif
+
+struct pproxy_connector;
+
+struct pproxy_connect_attempt {
+    struct pproxy_connector *connector;
+    struct bufferevent *bev; /* NULL if the slot is free */
+};
+
+/* races connections to a target's addresses; see connector.c */
+struct pproxy_connector {
+    struct pproxy_worker *worker;
+    pproxy_connector_cb cb;
+    void *arg;
+    struct sockaddr_storage *addrs; /* in the order they are tried */
+    ev_socklen_t *addrlens;
+    int num_addrs;
+    int next_addr;
+    int max_attempts; /* retry budget; attempts beyond it are not made */
+    struct pproxy_connect_attempt attempts[PPROXY_MAX_CONNECT_ATTEMPTS];
+    int num_attempts; /* in flight */
+    int last_error;
+    struct event *stagger_timer;
+};
+
+/*
+ * Starts connecting to the addresses, which are copied. If an attempt has
+ * not succeeded after the configured stagger delay, or fails, the next
+ * address is tried in parallel, alternating between address families.
+ * Attempts that exceed the connect timeout fail with PPROXY_ETIMEDOUT.
+ *
+ * @return 0 if the callback will be invoked, -1 if no attempt could start
+ */
+int pproxy_connector_start(struct pproxy_connector *connector,
+    struct pproxy_worker *worker, struct evutil_addrinfo *addrs,
+    uint16_t port, pproxy_connector_cb cb, void *arg);
+
+/* Abandons any attempts in flight; the callback will not be invoked */
+void pproxy_connector_cancel(struct pproxy_connector *connector);
+
+/* invoked when either side of a tunnel forwarded in the kernel closes */
+typedef void (*pproxy_tunnel_close_cb)(void *arg);
+
+struct pproxy_splice;
+
+/* one direction of a spliced tunnel */
+struct pproxy_splice_half {
+    struct pproxy_splice *splice;
+    evutil_socket_t from;
+    evutil_socket_t to;
+    int pipe[2];
+    size_t pending; /* bytes held in the pipe */
+    struct event *read_event;
+    struct event *write_event;
+};
+
+/* forwards a tunnel between two sockets in the kernel; see splice_tunnel.c */
+struct pproxy_splice {
+    struct pproxy_splice_half halves[2];
+    pproxy_tunnel_close_cb cb;
+    void *arg;
+    int active;
+};
+
+/*
+ * Takes over forwarding between the sockets, whose bufferevents must be
+ * disabled and drained. The callback is invoked when either side closes or
+ * fails, and should free the splice.
+ *
+ * @return 0 on success, -1 if splicing is unavailable
+ */
+int pproxy_splice_start(struct pproxy_splice *splice, struct event_base *base,
+    evutil_socket_t a, evutil_socket_t b, pproxy_tunnel_close_cb cb,
+    void *arg);
+void pproxy_splice_free(struct pproxy_splice *splice);
+
+/* Re-homes an active splice; see pproxy_connection_detach */
+void pproxy_splice_detach(struct pproxy_splice *splice, struct event_base *to);
+void pproxy_splice_attach(struct pproxy_splice *splice);
+
+/* capacity of the sockhash; two entries per tunnel */
+#define PPROXY_SOCKMAP_ENTRIES 65536
+
+/* BPF sockhash and verdict program shared by a proxy's tunnels; see
+ * sockmap_tunnel.c */
+struct pproxy_sockmap {
+    int map_fd;
+    int prog_fd;
+};
+
+/* a tunnel whose sockets are in the sockhash */
+struct pproxy_sockmap_link {
+    struct pproxy_sockmap *sockmap;
+    evutil_socket_t fds[2];
+    uint64_t cookies[2];
+    struct event *events[2]; /* watch for close */
+    pproxy_tunnel_close_cb cb;
+    void *arg;
+    int active;
+};
+
+/* @return 0 on success, -1 if BPF sockmaps are unavailable */
+int pproxy_sockmap_init(struct pproxy_sockmap *sockmap, int max_entries);
+void pproxy_sockmap_free(struct pproxy_sockmap *sockmap);
+
+/*
+ * As pproxy_splice_start, but the kernel forwards the tunnel without
+ * waking the proxy.
+ *
+ * @return 0 on success, -1 if the sockets could not be added
+ */
+int pproxy_sockmap_link_start(struct pproxy_sockmap_link *link,
+    struct pproxy_sockmap *sockmap, struct event_base *base,
+    evutil_socket_t a, evutil_socket_t b, pproxy_tunnel_close_cb cb,
+    void *arg);
+void pproxy_sockmap_link_free(struct pproxy_sockmap_link *link);
+void pproxy_sockmap_link_detach(struct pproxy_sockmap_link *link,
+    struct event_base *to);
+void pproxy_sockmap_link_attach(struct pproxy_sockmap_link *link);
+
+/* an event loop servicing a subset of the proxy's connections */
+struct pproxy_worker {
+    struct pproxy *handle;
     struct event_base *base;
     struct evdns_base *dns_base;
     struct evconnlistener *listener;
+    pproxy_thread_t thread;
+    int thread_started;
+    /* number of connections owned by this worker */
+    volatile long active_connections;
+    /* sockets handed off by the acceptor, in handoff mode */
+    struct pproxy_handoff_queue handoff;
+    evutil_socket_t wakeup_fds[2];
+    struct event *wakeup_event;
+    volatile long wakeup_pending;
+    /* tunnel migration; see migration.c */
+    struct pproxy_connection *tunnels; /* CONN_DIRECT connections */
+    volatile long num_tunnels;
+    struct event *balance_timer;
+    struct event *migrate_event;
+    int migration_initialized;
+    pproxy_mutex_t migrate_lock; /* guards the fields below */
+    struct pproxy_connection *inbox; /* tunnels migrated to this worker */
+    struct pproxy_worker *steal_thief; /* pending steal request */
+    long steal_count;
+    /* idle connections to targets; see upstream_pool.c */
+    struct pproxy_upstream_pool upstream_pool;
+    struct pproxy_resolver resolver;
+    /* recycled connections and bufferevents; see object_pool.c */
+    struct pproxy_object_pool object_pool;
+    /* pauses and connection timeouts */
+    struct pproxy_timer_wheel timer_wheel;
+    /* for the worker's own listener, if any */
+    struct pproxy_admission admission;
+    struct pproxy_codel codel;
+    /* this worker's instance of each rate limit group, created on first
+     * use; indexed as the proxy's groups */
+    struct bufferevent_rate_limit_group **rate_groups;
+    /* connections accepted, numbering their latency streams */
+    uint64_t latency_sequence;
+};
+
+struct pproxy {
+    int16_t port;
+    struct pproxy_options options;
+    struct pproxy_worker *workers;
+    int num_workers;
+    /* acceptor loop, in handoff mode */
+    struct event_base *acceptor_base;
+    struct evconnlistener *acceptor;
+    struct pproxy_admission acceptor_admission;
+    int next_worker;
+    /* connections across all workers */
+    volatile long num_connections;
+    struct pproxy_client_table clients;
+    struct pproxy_rate_group *rate_groups;
+    int num_rate_groups;
+    struct pproxy_latency_def *latency_profiles;
+    int num_latency_profiles;
+    /* applied to new connections; -1 if none */
+    int latency_profile;
     int run_state;
     struct pproxy_callbacks callbacks;
+    /* for PPROXY_TUNNEL_SOCKMAP; fds are -1 if unavailable */
+    struct pproxy_sockmap sockmap;
 };
 
 struct conn_handle;
@@ -64,57 +693,258 @@ enum pproxy_connection_state {
     CONN_FORWARD,
     /* completely received response */
     CONN_COMPLETE,
+    /* receiving a pipelined request while earlier responses are pending */
+    CONN_PIPELINED_RECV,
     /* direct (pass through) mode, parsing remaining HTTP request */
     CONN_DIRECT_PARSING,
     /* direct (pass through) mode */
     CONN_DIRECT,
+    /* sent an error response; closing once it is written */
+    CONN_CLOSING,
+};
+
+/*
+ * HTTP parsing. Connections drive their parsers through this interface so
+ * that the request parser backend can be chosen; see parser.c.
+ */
+struct pproxy_parser;
+
+struct pproxy_parser_callbacks {
+    int (*on_url)(struct pproxy_parser *parser, const char *at, size_t len);
+    /* may return 1 if the message has no body, as with http_parser */
+    int (*on_headers_complete)(struct pproxy_parser *parser);
+    int (*on_body)(struct pproxy_parser *parser, const char *at, size_t len);
+    int (*on_message_complete)(struct pproxy_parser *parser);
+};
+
+#if !defined(PPROXY_DEFAULT_PARSER_BACKEND)
+#define PPROXY_DEFAULT_PARSER_BACKEND PPROXY_PARSER_HTTP_PARSER
+#endif
+
+/* http_parser refuses ambiguous request framing from 2.9.3. Older
+ * versions may lack its codes for that, so the SIMD backend reports
+ * HPE_INVALID_CONTENT_LENGTH instead. */
+#if HTTP_PARSER_VERSION_MAJOR > 2 || (HTTP_PARSER_VERSION_MAJOR == 2 && \
+    (HTTP_PARSER_VERSION_MINOR > 9 || (HTTP_PARSER_VERSION_MINOR == 9 && \
+    HTTP_PARSER_VERSION_PATCH >= 3)))
+#define PPROXY_HTTP_PARSER_STRICT_FRAMING 1
+#define PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH HPE_UNEXPECTED_CONTENT_LENGTH
+#define PPROXY_HPE_INVALID_TRANSFER_ENCODING HPE_INVALID_TRANSFER_ENCODING
+#else
+#define PPROXY_HTTP_PARSER_STRICT_FRAMING 0
+#define PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH HPE_INVALID_CONTENT_LENGTH
+#define PPROXY_HPE_INVALID_TRANSFER_ENCODING HPE_INVALID_CONTENT_LENGTH
+#endif
+
+/* request heads larger than this are rejected, as by http_parser */
+#define PPROXY_MAX_HEAD_SIZE (80 * 1024)
+
+/* state of the PPROXY_PARSER_SIMD backend */
+struct pproxy_simd_parser {
+    int state;
+    /* HPE_PAUSED while paused, as with http_parser */
+    enum http_errno error;
+    int method;
+    int keep_alive;
+    int chunked;
+    uint64_t content_length;
+    /* on_headers_complete said the message has no body */
+    int skip_body;
+    /* bytes left in the body or current chunk */
+    uint64_t remaining;
+    /* a request head that spans reads is gathered here */
+    char *head;
+    size_t head_len;
+    /* start of the last incomplete line in head */
+    size_t head_scanned;
+    /* non-empty lines seen in head */
+    int head_lines;
+};
+
+struct pproxy_parser {
+    enum http_parser_type type;
+    int backend; /* a pproxy_parser_backend value */
+    const struct pproxy_parser_callbacks *callbacks;
+    void *data;
+    struct http_parser http;
+    struct pproxy_simd_parser simd;
+};
+
+/* Responses are always parsed by http_parser */
+void pproxy_parser_init(struct pproxy_parser *parser,
+    enum http_parser_type type, int backend,
+    const struct pproxy_parser_callbacks *callbacks, void *data);
+/* Prepares to parse a new message, as after init */
+void pproxy_parser_reset(struct pproxy_parser *parser);
+void pproxy_parser_free(struct pproxy_parser *parser);
+size_t pproxy_parser_execute(struct pproxy_parser *parser, const char *data,
+    size_t len);
+void pproxy_parser_pause(struct pproxy_parser *parser, int paused);
+enum http_errno pproxy_parser_errno(struct pproxy_parser *parser);
+int pproxy_parser_method(struct pproxy_parser *parser);
+int pproxy_parser_status_code(struct pproxy_parser *parser);
+int pproxy_parser_should_keep_alive(struct pproxy_parser *parser);
+/* Bytes left in the current body or chunk of known length, if the parser
+ * is inside one; they may be consumed without parsing by skipping them */
+uint64_t pproxy_parser_body_remaining(struct pproxy_parser *parser);
+void pproxy_parser_skip_body(struct pproxy_parser *parser, uint64_t len);
+
+/* tracks whether a parser stopped inside a body or chunk; see
+ * pproxy_connection.c */
+struct pproxy_body_bypass {
+    /* end of the body data most recently passed to on_body */
+    const char *data_end;
+    /* the parser's remaining body count is of bytes yet to arrive */
+    int in_body;
 };
 
 /* source side of the proxy connection */
 struct pproxy_source_state {
     struct bufferevent *bev;
-    struct evbuffer *buffer;
+    /* bytes at the front of the bufferevent's input that have been parsed
+     * but not yet forwarded */
     size_t peek_offset;
-    struct http_parser parser;
-    struct http_parser_settings parser_settings;
+    /* only while a request is being parsed; see acquire_source_parser */
+    struct pproxy_parser *parser;
+    struct pproxy_body_bypass body;
+    /* reads are stopped until the target's output drains */
+    int read_paused;
+    /* bytes of the current request head parsed so far */
+    size_t head_size;
+    /* when the current request head must be complete; unset until its
+     * first byte arrives */
+    struct timeval head_deadline;
+    int head_complete;
+    /* the current request's url, gathered until its head is complete */
+    char *url;
+    size_t url_len;
+    size_t url_size;
 };
 
 /* target side of the proxy connection */
 struct pproxy_target_state {
     struct bufferevent *bev;
-    struct http_parser parser;
-    struct http_parser_settings parser_settings;
+    /* only for forwarded requests; tunnels don't parse responses */
+    struct pproxy_parser *parser;
+    struct pproxy_body_bypass body;
+    /* reads are stopped until the client's output drains */
+    int read_paused;
+    /* some of the response has arrived */
+    int responding;
+    char *host;
+    uint16_t port;
+    /* the connection can be pooled once the response completes */
+    int reusable;
 };
 
-struct pproxy_connection;
+/* upper bound on @see pproxy_options.max_pipeline_depth */
+#define PPROXY_MAX_PIPELINE_DEPTH 32
+
+/* requests forwarded to the target whose responses are outstanding */
+struct pproxy_pipeline {
+    unsigned char methods[PPROXY_MAX_PIPELINE_DEPTH];
+    unsigned char keep_alive[PPROXY_MAX_PIPELINE_DEPTH];
+    int head;
+    int count;
+    /* the next request can't be pipelined; wait for outstanding responses */
+    int blocked;
+};
 
 /* handle for deferrable connection state */
 struct pproxy_connection_handle {
     enum pproxy_connection_state next_state;
     struct timeval delay;
     int (*transition)(struct pproxy_connection *);
-    struct event *timer;
+    /* pending while the delay runs */
+    struct pproxy_timer timer;
+    /* the client bufferevent's own rate limit, if any */
+    struct ev_token_bucket_cfg *rate_limit;
+    /* whether the client bufferevent is in a rate limit group */
+    int rate_limit_grouped;
 };
 
+/* Whether the connection's bandwidth is limited, in which case it must stay
+ * on its bufferevents */
+static inline int pproxy_connection_handle_is_shaped(
+        const struct pproxy_connection_handle *handle) {
+    return handle->rate_limit != NULL || handle->rate_limit_grouped;
+}
+
 /* proxy connection */
 struct pproxy_connection {
     struct pproxy *handle;
+    struct pproxy_worker *worker;
     enum pproxy_connection_state state;
     struct pproxy_source_state source_state;
     struct pproxy_target_state target_state;
     struct pproxy_connection_handle cb_handle;
+    /* the idle, read or response timeout of the current state */
+    struct pproxy_timer timeout;
+    /* when the connection was accepted, until its first byte is read;
+     * only sampled for CoDel */
+    struct timeval accepted;
+    /* the client's address, if its connection is counted in the client
+     * table */
+    struct pproxy_client_addr client;
+    int client_counted;
+    /* the request being parsed has drawn on the client's request rate,
+     * and isn't charged again if it is parsed again once unblocked */
+    int request_charged;
+    struct pproxy_pipeline pipeline;
+    struct pproxy_latency latency;
+    /* pending lookup of the target host */
+    struct pproxy_resolve_waiter resolve;
+    /* only while connecting to the target */
+    struct pproxy_connector *connector;
+    /* kernel forwarding of an established tunnel: a pproxy_tunnel_engine,
+     * PPROXY_TUNNEL_BUFFERED until one of the offload members is active */
+    int tunnel_engine;
+    union {
+        struct pproxy_splice splice;
+        struct pproxy_sockmap_link sockmap_link;
+    } offload;
+    /* the final response completed before the request did */
+    int response_complete;
+    /* whether the client connection persists after the current response */
+    int keep_alive;
+    /* links on the owning worker's tunnel list, or its migration inbox */
+    struct pproxy_connection *tunnel_next;
+    struct pproxy_connection *tunnel_prev;
+    /* the bufferevents' enabled events before the tunnel was detached */
+    short source_events;
+    short target_events;
 };
 
 struct pproxy_connection* pproxy_cb_handle_connection(
         struct pproxy_connection_handle *handle);
 
-int pproxy_connection_init(struct pproxy *handle, int fd,
+int pproxy_connection_init(struct pproxy_worker *worker, int fd,
     struct pproxy_connection **conn);
 void pproxy_connection_free(struct pproxy_connection *conn);
 
+/*
+ * Tunnel migration. A tunnel is detached from its worker on that worker's
+ * thread, and attached on the thread of the worker that receives it.
+ */
+int pproxy_connection_can_migrate(struct pproxy_connection *conn);
+void pproxy_connection_detach(struct pproxy_connection *conn,
+    struct pproxy_worker *to);
+void pproxy_connection_attach(struct pproxy_connection *conn);
+
+int pproxy_migration_init(struct pproxy_worker *worker);
+void pproxy_migration_free(struct pproxy_worker *worker);
+void pproxy_migration_add_tunnel(struct pproxy_worker *worker,
+    struct pproxy_connection *conn);
+void pproxy_migration_remove_tunnel(struct pproxy_worker *worker,
+    struct pproxy_connection *conn);
+
 int pproxy_connection_handle_init(struct pproxy_connection_handle *handle);
 void pproxy_connection_handle_free(struct pproxy_connection_handle *handle);
 
 int pproxy_connection_handle_has_delay(struct pproxy_connection_handle *handle);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* PPROXY_INTERNAL_H_ */
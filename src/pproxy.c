@@ -31,6 +31,10 @@
 #include <ws2tcpip.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -43,12 +47,6 @@
 #include "pproxy/pproxy.h"
 #include "pproxy-internal.h"
 
-#if defined(_WIN32)
-#define FENCE MemoryBarrier
-#else
-#define FENCE __sync_synchronize
-#endif
-
 static int get_state(struct pproxy *handle) {
     // TODO: cross platform / use modern C11 atomic intrinsics
     FENCE();
@@ -59,54 +57,208 @@ static int terminated(struct pproxy *handle) {
     return get_state(handle) == PROXY_TERMINATED;
 }
 
+#if defined(_WIN32)
+#define LOCAL_SOCKETPAIR_AF AF_INET
+#else
+#define LOCAL_SOCKETPAIR_AF AF_UNIX
+#endif
+
+/* Writes a final response to a socket that is being closed unserved; it is
+ * fresh, so the few bytes fit in its send buffer */
+static void refuse_socket(evutil_socket_t fd, const char *response) {
+    if (send(fd, response, strlen(response), 0) < 0) {
+        log_debug("Failed to refuse connection\n");
+    }
+    evutil_closesocket(fd);
+}
+
+/* Counts the connection against its client's limit, if any. The peer
+ * address is looked up unless the listener supplied it.
+ *
+ * @return 0 if the connection is admitted, -1 otherwise */
+static int admit_client(struct pproxy *handle, evutil_socket_t fd,
+        const struct sockaddr *saddr, struct pproxy_client_addr *addr) {
+    struct sockaddr_storage peer;
+    if (!saddr) {
+        socklen_t len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr*) &peer, &len)) {
+            return -1;
+        }
+        saddr = (const struct sockaddr*) &peer;
+    }
+
+    if (pproxy_client_addr_set(addr, saddr)) {
+        return -1;
+    }
+    return pproxy_client_connect(&handle->clients, addr);
+}
+
+static void accept_connection(struct pproxy_worker *worker,
+        evutil_socket_t fd, const struct sockaddr *saddr) {
+    static const char kTooManyConnections[] =
+        "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    const struct pproxy_options *options = &worker->handle->options;
+    struct timeval now;
+    if (options->codel_target_ms > 0) {
+        event_base_gettimeofday_cached(worker->base, &now);
+        if (pproxy_codel_admit(&worker->codel, options, &now)) {
+            log_debug("Overloaded; shedding connection\n");
+            evutil_closesocket(fd);
+            return;
+        }
+    }
+
+    struct pproxy_client_addr client;
+    int tracked = pproxy_client_table_enabled(&worker->handle->clients);
+    if (tracked && admit_client(worker->handle, fd, saddr, &client)) {
+        log_debug("Too many connections from client\n");
+        refuse_socket(fd, kTooManyConnections);
+        return;
+    }
+
+    struct pproxy_connection *conn = NULL;
+    if (-1 == pproxy_connection_init(worker, fd, &conn)) {
+        // TODO: error reporting, obv.
+        if (tracked) {
+            pproxy_client_disconnect(&worker->handle->clients, &client);
+        }
+        evutil_closesocket(fd);
+        return;
+    }
+
+    if (options->codel_target_ms > 0) {
+        conn->accepted = now;
+    }
+    if (tracked) {
+        conn->client = client;
+        conn->client_counted = 1;
+    }
+}
+
 static void listener_cb(struct evconnlistener* listener, evutil_socket_t fd,
         struct sockaddr *saddr, int saddr_len, void *ctx) {
     (void) listener;
-    (void) saddr;
     (void) saddr_len;
 
-    struct pproxy *handle = (struct pproxy*) ctx;
+    struct pproxy_worker *worker = (struct pproxy_worker*) ctx;
+    accept_connection(worker, fd, saddr);
+    pproxy_admission_check(&worker->admission);
+}
 
-    struct pproxy_connection *conn = NULL;
-    if (-1 == pproxy_connection_init(handle, fd, &conn)) {
-        // TODO: error reporting, obv.
-        close(fd);
+/* Signals a worker that its handoff queue is non-empty. Redundant signals are
+ * suppressed until the worker has observed the previous one. */
+static void wake_worker(struct pproxy_worker *worker) {
+    if (!ATOMIC_CAS(&worker->wakeup_pending, 0, 1)) {
         return;
     }
+#if defined(__linux__)
+    uint64_t one = 1;
+    if (write(worker->wakeup_fds[1], &one, sizeof(one)) != sizeof(one)) {
+        log_debug("Failed to signal worker\n");
+    }
+#else
+    char one = 1;
+    if (send(worker->wakeup_fds[1], &one, 1, 0) != 1) {
+        log_debug("Failed to signal worker\n");
+    }
+#endif
 }
 
-int pproxy_init(struct pproxy **handle, const char *bind_address,
-        int16_t port) {
-    /* le sigh */
-#ifdef _WIN32
-    evthread_use_windows_threads();
+/* Runs on the worker thread to drain its handoff queue. */
+static void handoff_cb(evutil_socket_t fd, short what, void *ctx) {
+    (void) what;
+
+    struct pproxy_worker *worker = (struct pproxy_worker*) ctx;
+
+#if defined(__linux__)
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        /* spurious wakeup */
+    }
 #else
-    evthread_use_pthreads();
+    char buf[64];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) { }
 #endif
 
-    if (!handle) {
-        return -1;
-    }
+    /* Re-arm signaling before draining so that a socket pushed after the
+     * final pop is guaranteed to generate another wakeup */
+    worker->wakeup_pending = 0;
+    FENCE();
 
-    if (!bind_address) {
-        return -1;
+    evutil_socket_t cfd;
+    while (0 == pproxy_handoff_queue_pop(&worker->handoff, &cfd)) {
+        accept_connection(worker, cfd, NULL);
     }
+}
 
-    struct pproxy *ret = (struct pproxy*) malloc(sizeof(struct pproxy));
-    if (!ret) {
-        return -1;
+static long worker_load(struct pproxy_worker *worker) {
+    FENCE();
+    return worker->active_connections +
+        pproxy_handoff_queue_size(&worker->handoff);
+}
+
+static int select_worker(struct pproxy *handle) {
+    int selected = 0;
+
+    switch (handle->options.balance_policy) {
+    case PPROXY_BALANCE_LEAST_LOADED: {
+        long min_load = worker_load(&handle->workers[0]);
+        int i;
+        for (i = 1; i < handle->num_workers; ++i) {
+            long load = worker_load(&handle->workers[i]);
+            if (load < min_load) {
+                min_load = load;
+                selected = i;
+            }
+        }
+        break;
+    }
+    case PPROXY_BALANCE_ROUND_ROBIN:
+    default:
+        selected = handle->next_worker;
+        handle->next_worker = (handle->next_worker + 1) % handle->num_workers;
+        break;
     }
-    memset(ret, 0, sizeof(*ret));
 
-    ret->run_state = PROXY_INIT;
+    return selected;
+}
 
-    int fd = -1;
-    for (;;) {
-        fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd == -1) {
-            break;
+static void handoff_listener_cb(struct evconnlistener* listener,
+        evutil_socket_t fd, struct sockaddr *saddr, int saddr_len, void *ctx) {
+    (void) listener;
+    (void) saddr;
+    (void) saddr_len;
+
+    struct pproxy *handle = (struct pproxy*) ctx;
+
+    /* Fall back to the next worker if the selected one's queue is full */
+    int start = select_worker(handle);
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        struct pproxy_worker *worker =
+            &handle->workers[(start + i) % handle->num_workers];
+        if (0 == pproxy_handoff_queue_push(&worker->handoff, fd)) {
+            wake_worker(worker);
+            pproxy_admission_check(&handle->acceptor_admission);
+            return;
         }
+    }
 
+    log_debug("All worker queues full; refusing connection\n");
+    evutil_closesocket(fd);
+}
+
+/* Creates a nonblocking socket bound to the requested address, returning the
+ * socket or -1 on error. The bound port is returned in bound_port. */
+static int bind_socket(const char *bind_address, int16_t port,
+        int reuse_port, int16_t *bound_port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    for (;;) {
         int rc = evutil_make_socket_nonblocking(fd);
         if (rc == -1) {
             break;
@@ -117,7 +269,15 @@ int pproxy_init(struct pproxy **handle, const char *bind_address,
             break;
         }
 
+        if (reuse_port) {
+            rc = evutil_make_listen_socket_reuseable_port(fd);
+            if (rc == -1) {
+                break;
+            }
+        }
+
         struct sockaddr_in saddr;
+        memset(&saddr, 0, sizeof(saddr));
         saddr.sin_family = AF_INET;
         rc = inet_pton(AF_INET, bind_address, &saddr.sin_addr);
         if (rc != 1) {
@@ -136,40 +296,383 @@ int pproxy_init(struct pproxy **handle, const char *bind_address,
         if (rc == -1) {
             break;
         }
-        ret->port = ntohs(saddr.sin_port);
+        *bound_port = ntohs(saddr.sin_port);
 
-        /* construct an event base */
-        ret->base = event_base_new();
-        if (!ret->base) {
-            break;
+        return fd;
+    }
+
+    /* cleanup on error */
+    evutil_closesocket(fd);
+    return -1;
+}
+
+static int init_worker(struct pproxy_worker *worker, struct pproxy *handle,
+        int fd) {
+    worker->handle = handle;
+
+    /* construct an event base */
+    worker->base = event_base_new();
+    if (!worker->base) {
+        return -1;
+    }
+
+    /* construct a DNS lookup base */
+    worker->dns_base = evdns_base_new(worker->base, /*initialize=*/ 1);
+    if (!worker->dns_base) {
+        return -1;
+    }
+
+    if (pproxy_resolver_init(&worker->resolver, worker)) {
+        return -1;
+    }
+
+    if (pproxy_migration_init(worker)) {
+        return -1;
+    }
+
+    pproxy_upstream_pool_init(&worker->upstream_pool, worker);
+
+    if (pproxy_object_pool_init(&worker->object_pool, worker)) {
+        return -1;
+    }
+
+    if (pproxy_timer_wheel_init(&worker->timer_wheel, worker)) {
+        return -1;
+    }
+
+    if (fd == -1) {
+        /* handoff mode; the acceptor owns the listener */
+        return 0;
+    }
+
+    /* set up a connection listener */
+    worker->listener = evconnlistener_new(worker->base,
+        listener_cb, worker, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+        fd);
+    if (!worker->listener) {
+        return -1;
+    }
+
+    return pproxy_admission_init(&worker->admission, handle, worker->base,
+        worker->listener);
+}
+
+static int init_worker_handoff(struct pproxy_worker *worker) {
+    if (pproxy_handoff_queue_init(&worker->handoff,
+            worker->handle->options.handoff_queue_size)) {
+        return -1;
+    }
+
+#if defined(__linux__)
+    worker->wakeup_fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wakeup_fds[0] == -1) {
+        return -1;
+    }
+    worker->wakeup_fds[1] = worker->wakeup_fds[0];
+#else
+    if (evutil_socketpair(LOCAL_SOCKETPAIR_AF, SOCK_STREAM, 0,
+            worker->wakeup_fds)) {
+        worker->wakeup_fds[0] = worker->wakeup_fds[1] = -1;
+        return -1;
+    }
+    if (evutil_make_socket_nonblocking(worker->wakeup_fds[0]) ||
+            evutil_make_socket_nonblocking(worker->wakeup_fds[1])) {
+        return -1;
+    }
+#endif
+
+    worker->wakeup_event = event_new(worker->base, worker->wakeup_fds[0],
+        EV_READ | EV_PERSIST, handoff_cb, worker);
+    if (!worker->wakeup_event) {
+        return -1;
+    }
+
+    return event_add(worker->wakeup_event, NULL);
+}
+
+static void free_worker(struct pproxy_worker *worker) {
+    pproxy_admission_free(&worker->admission);
+    if (worker->listener) {
+        evconnlistener_free(worker->listener);
+    }
+
+    pproxy_migration_free(worker);
+    pproxy_upstream_pool_free(&worker->upstream_pool);
+    pproxy_resolver_free(&worker->resolver);
+    /* after anything that can return bufferevents to it */
+    pproxy_object_pool_free(&worker->object_pool);
+    pproxy_timer_wheel_free(&worker->timer_wheel);
+    /* Connections still open at shutdown are abandoned, along with any
+     * groups they are in */
+    if (worker->active_connections == 0) {
+        pproxy_worker_rate_groups_free(worker);
+    }
+
+    if (worker->wakeup_event) {
+        event_free(worker->wakeup_event);
+    }
+
+    if (worker->wakeup_fds[0] != -1) {
+        evutil_closesocket(worker->wakeup_fds[0]);
+    }
+
+    if (worker->wakeup_fds[1] != -1 &&
+            worker->wakeup_fds[1] != worker->wakeup_fds[0]) {
+        evutil_closesocket(worker->wakeup_fds[1]);
+    }
+
+    if (worker->handoff.fds) {
+        /* close any sockets that were never picked up */
+        evutil_socket_t fd;
+        while (0 == pproxy_handoff_queue_pop(&worker->handoff, &fd)) {
+            evutil_closesocket(fd);
         }
+        pproxy_handoff_queue_free(&worker->handoff);
+    }
 
-        /* construct a DNS lookup base */
-        ret->dns_base = evdns_base_new(ret->base, /*initialize=*/ 1);
-        if (!ret->dns_base) {
-            break;
+    if (worker->dns_base) {
+        evdns_base_free(worker->dns_base, /*fail requests=*/ 1);
+    }
+
+    if (worker->base) {
+        event_base_free(worker->base);
+    }
+}
+
+void pproxy_options_init(struct pproxy_options *options) {
+    if (!options) {
+        return;
+    }
+
+    memset(options, 0, sizeof(*options));
+    options->num_workers = 1;
+    options->accept_mode = PPROXY_ACCEPT_REUSEPORT;
+    options->balance_policy = PPROXY_BALANCE_ROUND_ROBIN;
+    options->handoff_queue_size = 1024;
+    options->migrate_interval_ms = 1000;
+    options->max_pipeline_depth = 1;
+    options->upstream_pool_size = 0;
+    options->upstream_pool_per_host = 8;
+    options->upstream_idle_timeout_ms = 30000;
+    options->dns_cache_size = 1024;
+    options->dns_cache_ttl_ms = 60000;
+    options->dns_negative_ttl_ms = 5000;
+    options->connect_stagger_ms = 250;
+    options->connect_timeout_ms = 10000;
+    options->connect_max_attempts = 4;
+    options->dns_timeout_ms = 10000;
+    options->tunnel_engine = PPROXY_TUNNEL_SPLICE;
+    options->bypass_body_parsing = 1;
+    options->parser_backend = PPROXY_DEFAULT_PARSER_BACKEND;
+    options->object_pool_size = 1024;
+    options->output_high_watermark = 1024 * 1024;
+    options->output_low_watermark = 256 * 1024;
+    options->timer_tick_ms = 10;
+    options->idle_timeout_ms = 60000;
+    options->read_timeout_ms = 60000;
+    options->response_timeout_ms = 60000;
+    options->header_timeout_ms = 20000;
+    options->max_header_size = 32 * 1024;
+    options->max_connections = 0;
+    options->connection_low_watermark = 0;
+    options->codel_target_ms = 0;
+    options->codel_interval_ms = 100;
+    options->client_request_rate = 0;
+    options->client_request_burst = 0;
+    options->client_max_connections = 0;
+    options->client_table_size = 16384;
+}
+
+/* Binds the single listener for handoff mode, and sets up the workers to
+ * receive sockets from it. */
+static int init_handoff(struct pproxy *handle, const char *bind_address,
+        int16_t port) {
+    int fd = bind_socket(bind_address, port, /*reuse_port=*/ 0,
+        &handle->port);
+    if (fd == -1) {
+        return -1;
+    }
+
+    handle->acceptor_base = event_base_new();
+    if (!handle->acceptor_base) {
+        evutil_closesocket(fd);
+        return -1;
+    }
+
+    handle->acceptor = evconnlistener_new(handle->acceptor_base,
+        handoff_listener_cb, handle, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
+        -1, fd);
+    if (!handle->acceptor) {
+        evutil_closesocket(fd);
+        return -1;
+    }
+
+    if (pproxy_admission_init(&handle->acceptor_admission, handle,
+            handle->acceptor_base, handle->acceptor)) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        if (init_worker(&handle->workers[i], handle, -1)) {
+            return -1;
+        }
+        if (init_worker_handoff(&handle->workers[i])) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Binds a SO_REUSEPORT listener for each worker */
+static int init_reuseport(struct pproxy *handle, const char *bind_address,
+        int16_t port) {
+    /* Multiple workers each bind their own listener to the same port; the
+     * first binding determines the port if we were asked for a random one. */
+    int reuse_port = handle->num_workers > 1;
+    int16_t bound_port = port;
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        int fd = bind_socket(bind_address, bound_port, reuse_port,
+            &bound_port);
+        if (fd == -1) {
+            return -1;
         }
 
-        /* set up a connection listener */
-        ret->listener = evconnlistener_new(ret->base,
-            listener_cb, ret, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
-            fd);
-        if (!ret->listener) {
-            break;
+        if (init_worker(&handle->workers[i], handle, fd)) {
+            if (!handle->workers[i].listener) {
+                evutil_closesocket(fd);
+            }
+            return -1;
         }
-        fd = -1; /* listener owns the socket now */
+        /* listener owns the socket now */
+    }
+    handle->port = bound_port;
 
-        *handle = ret;
-        return 0;
+    return 0;
+}
+
+int pproxy_init(struct pproxy **handle, const char *bind_address,
+        int16_t port) {
+    return pproxy_init_ex(handle, bind_address, port, NULL);
+}
+
+int pproxy_init_ex(struct pproxy **handle, const char *bind_address,
+        int16_t port, const struct pproxy_options *options) {
+    /* le sigh */
+#ifdef _WIN32
+    evthread_use_windows_threads();
+#else
+    evthread_use_pthreads();
+#endif
+
+    if (!handle) {
+        return -1;
     }
 
-    /* cleanup on error */
+    if (!bind_address) {
+        return -1;
+    }
 
-    pproxy_free(ret);
-    if (fd != -1) {
-        close(fd);
+    if (options && (options->num_workers < 1 ||
+            options->handoff_queue_size < 1 ||
+            options->migrate_interval_ms < 1 ||
+            options->max_pipeline_depth < 1 ||
+            options->max_pipeline_depth > PPROXY_MAX_PIPELINE_DEPTH ||
+            options->upstream_pool_size < 0 ||
+            options->upstream_pool_per_host < 1 ||
+            options->upstream_idle_timeout_ms < 1 ||
+            options->dns_cache_size < 1 ||
+            options->dns_cache_ttl_ms < 0 ||
+            options->dns_negative_ttl_ms < 0 ||
+            options->connect_stagger_ms < 0 ||
+            options->connect_timeout_ms < 1 ||
+            options->connect_max_attempts < 1 ||
+            options->dns_timeout_ms < 1 ||
+            options->tunnel_engine < PPROXY_TUNNEL_BUFFERED ||
+            options->tunnel_engine > PPROXY_TUNNEL_SOCKMAP ||
+            options->parser_backend < PPROXY_PARSER_HTTP_PARSER ||
+            options->parser_backend > PPROXY_PARSER_SIMD ||
+            options->object_pool_size < 0 ||
+            options->output_high_watermark < 0 ||
+            options->output_low_watermark < 0 ||
+            (options->output_high_watermark > 0 &&
+                options->output_low_watermark >=
+                    options->output_high_watermark) ||
+            options->timer_tick_ms < 1 ||
+            options->idle_timeout_ms < 0 ||
+            options->read_timeout_ms < 0 ||
+            options->response_timeout_ms < 0 ||
+            options->header_timeout_ms < 0 ||
+            options->max_header_size < 0 ||
+            options->max_connections < 0 ||
+            options->connection_low_watermark < 0 ||
+            (options->max_connections > 0 &&
+                options->connection_low_watermark >=
+                    options->max_connections) ||
+            options->codel_target_ms < 0 ||
+            options->codel_interval_ms < 1 ||
+            options->client_request_rate < 0 ||
+            options->client_request_burst < 0 ||
+            options->client_max_connections < 0 ||
+            options->client_table_size < 1)) {
+        return -1;
     }
-    return -1;
+
+    struct pproxy *ret = (struct pproxy*) malloc(sizeof(struct pproxy));
+    if (!ret) {
+        return -1;
+    }
+    memset(ret, 0, sizeof(*ret));
+
+    ret->run_state = PROXY_INIT;
+    ret->latency_profile = -1;
+    ret->sockmap.map_fd = -1;
+    ret->sockmap.prog_fd = -1;
+
+    if (options) {
+        ret->options = *options;
+    } else {
+        pproxy_options_init(&ret->options);
+    }
+
+    ret->workers = (struct pproxy_worker*) calloc(ret->options.num_workers,
+        sizeof(struct pproxy_worker));
+    if (!ret->workers) {
+        free(ret);
+        return -1;
+    }
+    ret->num_workers = ret->options.num_workers;
+
+    int i;
+    for (i = 0; i < ret->num_workers; ++i) {
+        ret->workers[i].wakeup_fds[0] = -1;
+        ret->workers[i].wakeup_fds[1] = -1;
+    }
+
+    int rc;
+    if (pproxy_client_table_init(&ret->clients, &ret->options)) {
+        rc = -1;
+    } else if (ret->options.accept_mode == PPROXY_ACCEPT_HANDOFF) {
+        rc = init_handoff(ret, bind_address, port);
+    } else {
+        rc = init_reuseport(ret, bind_address, port);
+    }
+
+    if (rc) {
+        /* cleanup on error */
+        pproxy_free(ret);
+        return -1;
+    }
+
+    if (ret->options.tunnel_engine == PPROXY_TUNNEL_SOCKMAP &&
+            pproxy_sockmap_init(&ret->sockmap, PPROXY_SOCKMAP_ENTRIES)) {
+        log_debug("Sockmap unavailable; tunnels will be spliced\n");
+    }
+
+    *handle = ret;
+    return 0;
 }
 
 void pproxy_free(struct pproxy *handle) {
@@ -177,18 +680,27 @@ void pproxy_free(struct pproxy *handle) {
         return;
     }
 
-    if (handle->listener) {
-        evconnlistener_free(handle->listener);
+    pproxy_admission_free(&handle->acceptor_admission);
+    if (handle->acceptor) {
+        evconnlistener_free(handle->acceptor);
     }
 
-    if (handle->dns_base) {
-        evdns_base_free(handle->dns_base, /*fail requests=*/ 1);
+    if (handle->acceptor_base) {
+        event_base_free(handle->acceptor_base);
     }
 
-    if (handle->base) {
-        event_base_free(handle->base);
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        free_worker(&handle->workers[i]);
     }
 
+    /* after the workers, whose tunnels may still be in the sockhash */
+    pproxy_sockmap_free(&handle->sockmap);
+    pproxy_client_table_free(&handle->clients);
+    pproxy_rate_groups_free(handle);
+    pproxy_latency_profiles_free(handle);
+
+    free(handle->workers);
     free(handle);
 }
 
@@ -216,39 +728,134 @@ int pproxy_running(struct pproxy *handle) {
     return get_state(handle) == PROXY_RUNNING;
 }
 
-int pproxy_start(struct pproxy *handle) {
-    if (!handle) {
+int pproxy_get_pool_stats(struct pproxy *handle,
+        struct pproxy_pool_stats *stats) {
+    if (!handle || !stats) {
         return -1;
     }
 
-    if (pproxy_running(handle)) {
-        return -1;
+    memset(stats, 0, sizeof(*stats));
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        struct pproxy_object_pool *pool = &handle->workers[i].object_pool;
+        stats->connection_hits += pool->connection_hits;
+        stats->connection_misses += pool->connection_misses;
+        stats->bufferevent_hits += pool->bufferevent_hits;
+        stats->bufferevent_misses += pool->bufferevent_misses;
     }
+    return 0;
+}
 
-    handle->run_state = PROXY_RUNNING;
-    FENCE();
-
+static void run_loop(struct pproxy *handle, struct event_base *base) {
     /* Run the event loop until interrupted. We loop to guard against
        premature termination of some event dispatch backends. For example, the
        Windows select-based backend may terminate if network interfaces become
        available (select can exit with WSAENETDOWN). */
     do {
-        event_base_dispatch(handle->base);
+        event_base_dispatch(base);
     } while (!terminated(handle));
+}
+
+static void run_worker(struct pproxy_worker *worker) {
+    run_loop(worker->handle, worker->base);
+}
 
+#if defined(_WIN32)
+static DWORD WINAPI worker_thread(LPVOID arg) {
+    run_worker((struct pproxy_worker*) arg);
     return 0;
 }
 
+static int start_worker_thread(struct pproxy_worker *worker) {
+    worker->thread = CreateThread(NULL, 0, worker_thread, worker, 0, NULL);
+    return worker->thread ? 0 : -1;
+}
+
+static void join_worker_thread(struct pproxy_worker *worker) {
+    WaitForSingleObject(worker->thread, INFINITE);
+    CloseHandle(worker->thread);
+}
+#else
+static void* worker_thread(void *arg) {
+    run_worker((struct pproxy_worker*) arg);
+    return NULL;
+}
+
+static int start_worker_thread(struct pproxy_worker *worker) {
+    return pthread_create(&worker->thread, NULL, worker_thread, worker) ?
+        -1 : 0;
+}
+
+static void join_worker_thread(struct pproxy_worker *worker) {
+    pthread_join(worker->thread, NULL);
+}
+#endif
+
 static void terminate(struct pproxy *handle) {
     // TODO: cross platform / use modern C11 atomic intrinsics
     handle->run_state = PROXY_TERMINATED;
     FENCE();
 }
 
+static void stop_workers(struct pproxy *handle) {
+    if (handle->acceptor_base) {
+        event_base_loopexit(handle->acceptor_base, 0);
+    }
+
+    int i;
+    for (i = 0; i < handle->num_workers; ++i) {
+        event_base_loopexit(handle->workers[i].base, 0);
+    }
+}
+
+int pproxy_start(struct pproxy *handle) {
+    if (!handle) {
+        return -1;
+    }
+
+    if (pproxy_running(handle)) {
+        return -1;
+    }
+
+    handle->run_state = PROXY_RUNNING;
+    FENCE();
+
+    /* The calling thread services the acceptor in handoff mode, otherwise
+     * the first worker */
+    int first = handle->acceptor_base ? 0 : 1;
+    int rc = 0;
+    int i;
+    for (i = first; i < handle->num_workers; ++i) {
+        if (start_worker_thread(&handle->workers[i])) {
+            rc = -1;
+            break;
+        }
+        handle->workers[i].thread_started = 1;
+    }
+
+    if (rc != 0) {
+        terminate(handle);
+        stop_workers(handle);
+    } else if (handle->acceptor_base) {
+        run_loop(handle, handle->acceptor_base);
+    } else {
+        run_worker(&handle->workers[0]);
+    }
+
+    for (i = first; i < handle->num_workers; ++i) {
+        if (handle->workers[i].thread_started) {
+            join_worker_thread(&handle->workers[i]);
+            handle->workers[i].thread_started = 0;
+        }
+    }
+
+    return rc;
+}
+
 void pproxy_stop(struct pproxy *handle) {
     if (!handle) {
         return;
     }
     terminate(handle);
-    event_base_loopexit(handle->base, 0);
+    stop_workers(handle);
 }
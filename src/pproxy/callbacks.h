@@ -23,6 +23,7 @@
 #ifndef PPROXY_CALLBACKS_H_
 #define PPROXY_CALLBACKS_H_
 
+#include <stddef.h>
 #include <sys/time.h>
 
 #ifdef __cplusplus
@@ -66,6 +67,142 @@ struct pproxy* pproxy_conn_get_pproxy(struct pproxy_connection_handle *handle);
 void pproxy_conn_insert_pause(struct pproxy_connection_handle *handle,
     const struct timeval *tv);
 
+/**
+ * Limit the connection's bandwidth to the client.
+ *
+ * Rates are in bytes per second: read_rate applies to data from the client,
+ * and write_rate to data sent to it. A rate of 0 is unlimited, and setting
+ * both to 0 lifts the limit. The limit lasts for the life of the
+ * connection, across requests and after CONNECT, and holds back reading
+ * from the target as needed. A limited connection is not handed to the
+ * kernel for forwarding after CONNECT, and stays on its worker.
+ *
+ * @param handle the connection handle
+ * @param read_rate bytes per second from the client, or 0
+ * @param write_rate bytes per second to the client, or 0
+ * @return 0 on success, -1 on error
+ */
+int pproxy_conn_set_rate_limit(struct pproxy_connection_handle *handle,
+    size_t read_rate, size_t write_rate);
+
+/**
+ * Define a named group of connections that share read and write rates.
+ *
+ * Rates are as for @see pproxy_conn_set_rate_limit, but are shared by all
+ * the connections in the group. Each worker enforces the rates for the
+ * group's connections it owns. Groups can only be defined or redefined
+ * before the proxy is started.
+ *
+ * @param handle the pproxy handle
+ * @param name the group's name
+ * @param read_rate bytes per second from the clients, or 0
+ * @param write_rate bytes per second to the clients, or 0
+ * @return 0 on success, -1 on error
+ */
+int pproxy_define_rate_limit_group(struct pproxy *handle, const char *name,
+    size_t read_rate, size_t write_rate);
+
+/**
+ * Add the connection to a rate limit group, leaving any other.
+ *
+ * The group's rates apply in addition to any of the connection's own; see
+ * @see pproxy_conn_set_rate_limit.
+ *
+ * @param handle the connection handle
+ * @param name the name of a group defined with
+ *        @see pproxy_define_rate_limit_group
+ * @return 0 on success, -1 if there is no such group or on error
+ */
+int pproxy_conn_join_rate_limit_group(struct pproxy_connection_handle *handle,
+    const char *name);
+
+/* Distributions of injected latency */
+enum pproxy_latency_distribution {
+    /* no delay */
+    PPROXY_LATENCY_NONE = 0,
+    /* always value_ms */
+    PPROXY_LATENCY_CONSTANT,
+    /* uniform between value_ms and value_ms + spread_ms */
+    PPROXY_LATENCY_UNIFORM,
+    /* normal with mean value_ms and standard deviation spread_ms, with
+     * negative delays taken as none */
+    PPROXY_LATENCY_NORMAL,
+    /* as observed in samples_ms, interpolating between them */
+    PPROXY_LATENCY_EMPIRICAL,
+};
+
+/* Points in a connection's life at which latency can be injected */
+enum pproxy_latency_phase {
+    /* before looking up the target host */
+    PPROXY_LATENCY_DNS,
+    /* after the connection to the target is established */
+    PPROXY_LATENCY_CONNECT,
+    /* before the first read of each response is delivered */
+    PPROXY_LATENCY_FIRST_BYTE,
+    /* before each later read of a response is delivered */
+    PPROXY_LATENCY_CHUNK,
+    PPROXY_LATENCY_NUM_PHASES
+};
+
+/* A distribution of delays, in milliseconds */
+struct pproxy_latency_dist {
+    int type; /* a pproxy_latency_distribution */
+    double value_ms;
+    double spread_ms;
+    /* for PPROXY_LATENCY_EMPIRICAL; copied when the profile is defined */
+    const double *samples_ms;
+    size_t num_samples;
+};
+
+struct pproxy_latency_profile {
+    struct pproxy_latency_dist phases[PPROXY_LATENCY_NUM_PHASES];
+    /* Each connection draws its delays from its own sequence, derived from
+     * the seed, its worker and the order in which the worker accepted it;
+     * the same seed and arrivals give the same delays. */
+    unsigned long long seed;
+};
+
+/**
+ * Define a named latency profile.
+ *
+ * Connections with the profile have each phase delayed by a sample of its
+ * distribution, rounded up to the timer tick; other connections are
+ * serviced meanwhile. A reused connection to the target skips the DNS and
+ * connect phases, and responses forwarded through a CONNECT tunnel are not
+ * delayed. Profiles can only be defined or redefined before the proxy is
+ * started.
+ *
+ * @param handle the pproxy handle
+ * @param name the profile's name
+ * @param profile the distributions of each phase
+ * @return 0 on success, -1 on error or if a distribution is invalid
+ */
+int pproxy_define_latency_profile(struct pproxy *handle, const char *name,
+    const struct pproxy_latency_profile *profile);
+
+/**
+ * Apply a latency profile to every connection, unless changed by
+ * @see pproxy_conn_set_latency_profile. This can only be set before the
+ * proxy is started.
+ *
+ * @param handle the pproxy handle
+ * @param name the name of a profile defined with
+ *        @see pproxy_define_latency_profile, or NULL for none
+ * @return 0 on success, -1 if there is no such profile or on error
+ */
+int pproxy_set_latency_profile(struct pproxy *handle, const char *name);
+
+/**
+ * Apply a latency profile to the connection, as from on_connect.
+ *
+ * @param handle the connection handle
+ * @param name the name of a profile defined with
+ *        @see pproxy_define_latency_profile, or NULL for none
+ * @return 0 on success, -1 if there is no such profile or on error
+ */
+int pproxy_conn_set_latency_profile(struct pproxy_connection_handle *handle,
+    const char *name);
+
 #ifdef __cplusplus
 }
 #endif
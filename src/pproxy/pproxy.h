@@ -32,6 +32,196 @@ extern "C" {
 /** pproxy library handle. */
 struct pproxy;
 
+/** How accepted connections are distributed among workers. */
+enum pproxy_accept_mode {
+    /* Each worker binds its own SO_REUSEPORT listener. */
+    PPROXY_ACCEPT_REUSEPORT,
+    /* A single acceptor thread hands accepted sockets off to the workers. */
+    PPROXY_ACCEPT_HANDOFF,
+};
+
+/** Worker selection policy for @see PPROXY_ACCEPT_HANDOFF. */
+enum pproxy_balance_policy {
+    PPROXY_BALANCE_ROUND_ROBIN,
+    /* Prefer the worker with the fewest active and queued connections. */
+    PPROXY_BALANCE_LEAST_LOADED,
+};
+
+/** Forwarding of established CONNECT tunnels. */
+enum pproxy_tunnel_engine {
+    /* Tunnel bytes are read into and written from bufferevents. */
+    PPROXY_TUNNEL_BUFFERED,
+    /* Linux only: tunnel bytes are spliced between the sockets through a
+     * pipe, once the tunnel's buffers have drained. Falls back to
+     * PPROXY_TUNNEL_BUFFERED where splice() is unavailable. */
+    PPROXY_TUNNEL_SPLICE,
+    /* Linux only: the sockets are placed in a BPF sockmap whose sk_skb
+     * program redirects tunnel bytes between them in the kernel, and the
+     * proxy only watches for close. Requires CAP_BPF or CAP_SYS_ADMIN;
+     * falls back to PPROXY_TUNNEL_SPLICE when unavailable. */
+    PPROXY_TUNNEL_SOCKMAP,
+};
+
+/** Request parser implementations. */
+enum pproxy_parser_backend {
+    /* joyent http_parser. */
+    PPROXY_PARSER_HTTP_PARSER,
+    /* Parses a request head once it is complete, finding line ends with
+     * vector compares and interpreting only the request line and the
+     * headers that frame the message. Responses are still parsed by
+     * http_parser. */
+    PPROXY_PARSER_SIMD,
+};
+
+/** Options controlling a pproxy instance; see @see pproxy_init_ex. */
+struct pproxy_options {
+    /* Number of worker threads servicing connections. Each worker runs its
+     * own event loop and, when more than one is requested, binds its own
+     * SO_REUSEPORT listener on the shared port. */
+    int num_workers;
+    /* Connection distribution; a pproxy_accept_mode value. */
+    int accept_mode;
+    /* Worker selection in handoff mode; a pproxy_balance_policy value. */
+    int balance_policy;
+    /* Per-worker capacity of the handoff queue; rounded up to a power of
+     * two. Connections are refused when every worker's queue is full. */
+    int handoff_queue_size;
+    /* If non-zero, workers periodically steal established CONNECT tunnels
+     * from more heavily loaded workers. */
+    int migrate_tunnels;
+    /* Interval between load balancing checks, in milliseconds. */
+    int migrate_interval_ms;
+    /* Maximum number of requests on a persistent client connection that are
+     * forwarded to the target before their predecessors' responses have
+     * completed (at most 32). Pipelined requests for a different target
+     * wait for the outstanding responses. With the default of 1, pipelined
+     * requests are handled one at a time; responses are always returned
+     * in request order. */
+    int max_pipeline_depth;
+    /* Maximum number of idle keep-alive connections to targets that each
+     * worker keeps for reuse by later requests, keyed by the host and port
+     * in the request URL; 0 (the default) disables pooling. A target that
+     * closes a persistent connection without saying so can fail a request
+     * that reuses it. */
+    int upstream_pool_size;
+    /* Maximum number of those idle connections to any one host and port. */
+    int upstream_pool_per_host;
+    /* Idle pooled connections are closed after this many milliseconds. */
+    int upstream_idle_timeout_ms;
+    /* Maximum number of hostnames in each worker's DNS cache. */
+    int dns_cache_size;
+    /* Lifetime of cached addresses, in milliseconds; 0 disables caching,
+     * though concurrent lookups of a name still share one query. */
+    int dns_cache_ttl_ms;
+    /* Lifetime of cached nonexistent-name results, in milliseconds. */
+    int dns_negative_ttl_ms;
+    /* Delay before racing a connection to a target's next address, when
+     * the attempts in flight have neither succeeded nor failed. */
+    int connect_stagger_ms;
+    /* Deadline for each connection attempt, in milliseconds. */
+    int connect_timeout_ms;
+    /* Maximum number of connection attempts per request, across the
+     * target's addresses. */
+    int connect_max_attempts;
+    /* Deadline for resolving a target's hostname, in milliseconds. */
+    int dns_timeout_ms;
+    /* Forwarding of established tunnels; a pproxy_tunnel_engine value. */
+    int tunnel_engine;
+    /* If non-zero (the default), bodies of known length and chunks of
+     * chunked bodies are forwarded without being parsed, apart from their
+     * last byte; the parser only sees the framing. */
+    int bypass_body_parsing;
+    /* Request parser; a pproxy_parser_backend value. Defaults to
+     * PPROXY_PARSER_HTTP_PARSER unless the library is built with
+     * PPROXY_SIMD_PARSER. */
+    int parser_backend;
+    /* Maximum number of freed connection structures, and of bufferevents,
+     * that each worker keeps for reuse by later connections; 0 disables
+     * recycling. */
+    int object_pool_size;
+    /* Reading from one side of a connection stops while the output buffer
+     * of the other side holds at least this many bytes, e.g. while a slow
+     * client takes a large response; 0 disables the limit. A single read
+     * can overshoot it. */
+    int output_high_watermark;
+    /* Reading resumes once that output has drained to this many bytes;
+     * must be less than output_high_watermark. */
+    int output_low_watermark;
+    /* Granularity of pauses and of the timeouts below, in milliseconds;
+     * each fires up to about two ticks late. Bandwidth limits are also
+     * refilled every tick. */
+    int timer_tick_ms;
+    /* A client connection with no request in progress is closed after
+     * this many milliseconds; 0 disables the timeout. This also bounds the
+     * time taken to write a final response to a client that stops reading
+     * it. */
+    int idle_timeout_ms;
+    /* A client that has begun a request, then sends nothing more of it for
+     * this many milliseconds, is disconnected; 0 disables the timeout. */
+    int read_timeout_ms;
+    /* A forwarded request whose response doesn't progress for this many
+     * milliseconds, while neither paused nor held back by the client, is
+     * abandoned: with 504 if none of the response has arrived, otherwise by
+     * closing the connection. Progress on the request body also counts. 0
+     * disables the timeout. */
+    int response_timeout_ms;
+    /* A request head that hasn't completed this many milliseconds after
+     * its first byte arrived, however steadily it trickles in, is refused
+     * with 408; 0 disables the deadline. */
+    int header_timeout_ms;
+    /* A request head larger than this many bytes is refused with 431; 0
+     * leaves only the parser's own limit. */
+    int max_header_size;
+    /* Maximum number of client connections across the workers, past
+     * which listeners stop accepting and further clients wait in the
+     * kernel's accept queue; 0 (the default) is unlimited. The limit can
+     * be overshot by connections accepted concurrently on other workers. */
+    int max_connections;
+    /* Accepting resumes once the number of connections has fallen to this
+     * many; must be less than max_connections. 0 picks seven eighths of
+     * max_connections. */
+    int connection_low_watermark;
+    /* If non-zero, new connections are shed (closed on accept) while the
+     * time from accepting a connection to reading its first byte stays
+     * above this many milliseconds for codel_interval_ms, as in CoDel.
+     * Disabled by default. */
+    int codel_target_ms;
+    /* CoDel interval, in milliseconds. */
+    int codel_interval_ms;
+    /* Requests per second allowed from each client address; a request
+     * over the rate is refused with 429 before any connection to its
+     * target. 0 (the default) is unlimited. */
+    int client_request_rate;
+    /* Requests a client can make in a burst above that rate; 0 allows as
+     * many as the rate. */
+    int client_request_burst;
+    /* Concurrent connections allowed from each client address; further
+     * connections are refused with 429. 0 (the default) is unlimited. */
+    int client_max_connections;
+    /* Number of client addresses (IPv6 /64 prefixes) tracked for those
+     * limits. Beyond this, the least recently active clients without
+     * connections are forgotten; if every tracked client has connections,
+     * new clients are refused with 429. */
+    int client_table_size;
+};
+
+/** Object recycling counters, summed over the workers. */
+struct pproxy_pool_stats {
+    /* connection structures taken from a pool or newly allocated */
+    long connection_hits;
+    long connection_misses;
+    /* bufferevents for client and target sockets likewise */
+    long bufferevent_hits;
+    long bufferevent_misses;
+};
+
+/**
+ * Initializes an options structure with the default values.
+ *
+ * @param options the options to initialize
+ */
+void pproxy_options_init(struct pproxy_options *options);
+
 /**
  * Allocates and initializes a pproxy instance.
  *
@@ -47,6 +237,20 @@ struct pproxy;
  */
 int pproxy_init(struct pproxy **handle, const char *bind_address, int16_t port);
 
+/**
+ * Allocates and initializes a pproxy instance with the provided options.
+ *
+ * Behaves as @see pproxy_init when options is NULL.
+ *
+ * @param handle the allocated handle
+ * @param bind_address a bind address, in dotted-quad notation
+ * @param port the port to bind to
+ * @param options the options, or NULL for the defaults
+ * @return 0 on success, -1 on error
+ */
+int pproxy_init_ex(struct pproxy **handle, const char *bind_address,
+    int16_t port, const struct pproxy_options *options);
+
 /**
  * Releases the pproxy instance.
  *
@@ -58,14 +262,17 @@ void pproxy_free(struct pproxy *handle);
  * Starts the proxy server running, bound to the requested host and port.
  *
  * This method will not return until the proxy server exits, typically by
- * invoking @see proxy_stop in another thread.
+ * invoking @see proxy_stop in another thread. When configured with multiple
+ * workers, the calling thread runs the first worker and additional threads
+ * are started (and joined before returning) for the remainder. In handoff
+ * mode the calling thread runs the acceptor and every worker gets a thread.
  *
  * @param handle the pproxy handle
  * @return -1 on error
  */
 int pproxy_start(struct pproxy *handle);
 
-/** Immediately stop the pproxy server, unbinding network resources. */
+/** Immediately stop the pproxy server and all of its workers. */
 void pproxy_stop(struct pproxy *handle);
 
 /**
@@ -82,6 +289,65 @@ int pproxy_get_port(struct pproxy *handle, int16_t *port);
 /** @return non-zero if the pproxy server is running. */
 int pproxy_running(struct pproxy *handle);
 
+/**
+ * Gets the object recycling counters. They are updated by the workers
+ * without synchronization, so they are approximate while the server runs.
+ *
+ * @param handle the pproxy handle
+ * @param stats the counters
+ * @return 0 on success, -1 on error
+ */
+int pproxy_get_pool_stats(struct pproxy *handle,
+    struct pproxy_pool_stats *stats);
+
+/** Flags for @see pproxy_install_allocator. */
+enum pproxy_allocator_flags {
+    /* Back the arenas with huge pages where the system provides them. */
+    PPROXY_ALLOCATOR_HUGEPAGES = 1,
+};
+
+/** Counters for one allocator arena; see @see pproxy_get_allocator_stats. */
+struct pproxy_allocator_stats {
+    /* bytes allocated from the arena and not yet freed, counting each
+     * allocation at the size of its size class */
+    long long bytes_outstanding;
+    /* address space mapped for the arena */
+    long long bytes_reserved;
+    /* non-zero while a thread owns the arena */
+    int in_use;
+};
+
+/**
+ * Routes libevent's memory allocation through per-thread arenas.
+ *
+ * Each thread allocates from its own arena of size-classed free lists,
+ * without locking; memory freed by another thread is handed back to the
+ * owning arena. An exiting thread's arena is taken over by the next thread
+ * to allocate. This must precede any other use of libevent in the process,
+ * including by the other pproxy functions, and cannot be undone.
+ *
+ * @param flags a combination of pproxy_allocator_flags
+ * @return 0 on success, -1 if an allocator was already installed or the
+ *         library was built without PPROXY_ARENA_ALLOCATOR
+ */
+int pproxy_install_allocator(int flags);
+
+/**
+ * Gets the counters of each arena, in the order the arenas were created.
+ * They are read without synchronization, so they are approximate while
+ * other threads allocate.
+ *
+ * @param stats receives up to max_arenas entries
+ * @param max_arenas the capacity of stats
+ * @return the number of arenas, which may exceed max_arenas, or -1 if the
+ *         allocator is not installed
+ */
+int pproxy_get_allocator_stats(struct pproxy_allocator_stats *stats,
+    int max_arenas);
+
+/** @return the bytes outstanding in the calling thread's arena, or 0 */
+long long pproxy_allocator_thread_bytes(void);
+
 #ifdef __cplusplus
 }
 #endif
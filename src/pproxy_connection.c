@@ -20,7 +20,16 @@
  * SOFTWARE.
  */
 
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -30,6 +39,7 @@
 #include "pproxy-internal.h"
 
 static void connect_event_cb(struct bufferevent *bev, int16_t what, void *ctx);
+static void resolve_cb(int result, struct evutil_addrinfo *addrs, void *arg);
 static void target_event_cb(struct bufferevent *bev, int16_t what, void *ctx);
 static void source_event_cb(struct bufferevent *bev, int16_t what, void *ctx);
 
@@ -40,24 +50,44 @@ static void direct_source_event_cb(struct bufferevent *, int16_t, void *);
 static void direct_source_read_cb(struct bufferevent *, void *);
 static void direct_target_event_cb(struct bufferevent *, int16_t, void *);
 static void direct_target_read_cb(struct bufferevent *bev, void *ctx);
-
-static int url_cb(struct http_parser *parser, const char *data, size_t len);
-static int source_message_complete(struct http_parser *parser);
-static int target_message_complete(struct http_parser *parser);
+static void direct_write_cb(struct bufferevent *bev, void *ctx);
+
+static int url_cb(struct pproxy_parser *parser, const char *data, size_t len);
+static int source_body_cb(struct pproxy_parser *parser, const char *data,
+    size_t len);
+static int target_body_cb(struct pproxy_parser *parser, const char *data,
+    size_t len);
+static int source_headers_complete(struct pproxy_parser *parser);
+static int start_request(struct pproxy_connection *conn,
+    struct pproxy_parser *parser);
+static int source_message_complete(struct pproxy_parser *parser);
+static int target_headers_complete(struct pproxy_parser *parser);
+static int target_message_complete(struct pproxy_parser *parser);
 
 static void drive_request(struct pproxy_connection *conn);
+static void finish_response(struct pproxy_connection *conn);
+static void refuse_request(struct pproxy_connection *conn, int status,
+    const char *reason);
+static void send_error_response(struct pproxy_connection *conn, int status,
+    const char *reason);
 
 static int set_connection_state_recv(struct pproxy_connection *conn);
+static int set_connection_state_recv_forward(struct pproxy_connection *conn,
+    struct bufferevent *bev);
 static int set_connection_state_forward(struct pproxy_connection *conn);
 static int set_connection_state_forward_after_delay(
     struct pproxy_connection *conn);
+static int set_connection_state_direct_parsing(struct pproxy_connection *conn,
+    struct bufferevent *bev);
 static int set_connection_state_direct(struct pproxy_connection *conn);
+static int set_connection_state_complete(struct pproxy_connection *conn);
 
-static void delayed_transition_cb(int sock, short which, void *arg) {
+static void delayed_transition_cb(struct pproxy_timer *timer) {
     struct pproxy_connection_handle *handle =
-        (struct pproxy_connection_handle*) arg;
+        (struct pproxy_connection_handle*) (((char *) timer)
+            - offsetof(struct pproxy_connection_handle, timer));
+    /* The transition may free the connection */
     (*handle->transition)(pproxy_cb_handle_connection(handle));
-    pproxy_connection_handle_free(handle);
 }
 
 static void set_connection_state_after_delay(
@@ -75,56 +105,173 @@ static void set_connection_state_after_delay(
         break;
     case CONN_FORWARD:
         /* Need to disable source processing or this won't block the request
-         * from completing. This does mean that we need to buffer the entire
-         * response received from the target; and alternative approach might
-         * be to clobber the target's events but that would race with completion
-         * of the response. */
+         * from completing. The response is held back by not reading from the
+         * target, so the target's receive window fills rather than our
+         * buffers; at most what was read before the pause is held. The
+         * request can still be written to the target. */
         bufferevent_disable(conn->source_state.bev, EV_READ | EV_WRITE);
+        bufferevent_disable(conn->target_state.bev, EV_READ);
         cb_handle->transition = set_connection_state_forward_after_delay;
         break;
     default:
         assert(0 && "Not supported");
     }
 
-    assert(!cb_handle->timer); /* sanity */
+    assert(!pproxy_timer_pending(&cb_handle->timer)); /* sanity */
+
+    /* The connection's timeouts don't run while it is paused */
+    pproxy_timer_cancel(&conn->worker->timer_wheel, &conn->timeout);
+
+    long long ms = (long long) cb_handle->delay.tv_sec * 1000 +
+        (cb_handle->delay.tv_usec + 999) / 1000;
+    pproxy_timer_init(&cb_handle->timer, delayed_transition_cb);
+    pproxy_timer_schedule(&conn->worker->timer_wheel, &cb_handle->timer,
+        ms > INT_MAX ? INT_MAX : (int) ms);
+
+    /* The pause is consumed; a persistent connection needs a fresh one */
+    evutil_timerclear(&cb_handle->delay);
+}
+
+/*
+ * Injected latency. A phase's delay holds the connection where it is, and
+ * its continuation picks up from there once the delay expires.
+ */
+
+static void latency_cb(struct pproxy_timer *timer) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) (((char *)
+        timer) - offsetof(struct pproxy_connection, latency.timer));
+    /* The continuation may free the connection */
+    (*conn->latency.resume)(conn);
+}
 
-    cb_handle->timer = evtimer_new(conn->handle->base,
-        delayed_transition_cb, cb_handle);
-    evtimer_add(cb_handle->timer, &cb_handle->delay);
+/* @return 1 if resume continues the connection after the phase's delay, or
+ * 0 if it has none */
+static int delay_phase(struct pproxy_connection *conn, int phase,
+        void (*resume)(struct pproxy_connection*)) {
+    int ms = pproxy_latency_sample(&conn->latency, phase);
+    if (ms == 0) {
+        return 0;
+    }
+    conn->latency.resume = resume;
+    pproxy_timer_schedule(&conn->worker->timer_wheel, &conn->latency.timer,
+        ms);
+    return 1;
 }
 
-static void free_source_state(struct pproxy_source_state *source) {
-    if (source->buffer) {
-        evbuffer_free(source->buffer);
-        source->buffer = 0;
+static void free_source_state(struct pproxy_source_state *source,
+        struct pproxy_object_pool *pool) {
+    if (source->parser) {
+        pproxy_object_pool_put_parser(pool, source->parser);
+        source->parser = 0;
     }
     if (source->bev) {
-        bufferevent_free(source->bev);
+        pproxy_object_pool_put_bufferevent(pool, source->bev);
         source->bev = 0;
     }
+    free(source->url);
+    source->url = 0;
+    source->url_len = 0;
+    source->url_size = 0;
 }
 
-static void free_target_state(struct pproxy_target_state *target) {
+static void free_target_state(struct pproxy_target_state *target,
+        struct pproxy_object_pool *pool) {
+    if (target->parser) {
+        pproxy_object_pool_put_parser(pool, target->parser);
+        target->parser = 0;
+    }
+    target->read_paused = 0;
     if (target->bev) {
-        bufferevent_free(target->bev);
+        pproxy_object_pool_put_bufferevent(pool, target->bev);
         target->bev = 0;
     }
+    if (target->host) {
+        free(target->host);
+        target->host = 0;
+    }
+}
+
+static void pipeline_push(struct pproxy_pipeline *pipeline, int method) {
+    assert(pipeline->count < PPROXY_MAX_PIPELINE_DEPTH);
+    int tail = (pipeline->head + pipeline->count) % PPROXY_MAX_PIPELINE_DEPTH;
+    pipeline->methods[tail] = (unsigned char) method;
+    pipeline->keep_alive[tail] = 0;
+    ++pipeline->count;
+}
+
+/* Records whether the most recently pushed request allows persistence */
+static void pipeline_set_keep_alive(struct pproxy_pipeline *pipeline,
+        int keep_alive) {
+    assert(pipeline->count > 0);
+    int tail = (pipeline->head + pipeline->count - 1) %
+        PPROXY_MAX_PIPELINE_DEPTH;
+    pipeline->keep_alive[tail] = (unsigned char) keep_alive;
+}
+
+static int pipeline_head_method(struct pproxy_pipeline *pipeline) {
+    assert(pipeline->count > 0);
+    return pipeline->methods[pipeline->head];
 }
 
-static const struct http_parser_settings source_parser_settings = {
-    0, /* on_message_begin */
+/* Removes the oldest request, returning whether it allowed persistence */
+static int pipeline_pop(struct pproxy_pipeline *pipeline) {
+    assert(pipeline->count > 0);
+    int keep_alive = pipeline->keep_alive[pipeline->head];
+    pipeline->head = (pipeline->head + 1) % PPROXY_MAX_PIPELINE_DEPTH;
+    --pipeline->count;
+    return keep_alive;
+}
+
+static const struct pproxy_parser_callbacks source_parser_callbacks = {
     url_cb,
-    0, /* on_status_complete */
-    0, /* on_header_field */
-    0, /* on_header_value */
-    0, /* receive_headers_complete */
-    0, /* receive_body */
+    source_headers_complete,
+    source_body_cb,
     source_message_complete
 };
 
 static void reset_source_state(struct pproxy_source_state *source) {
-    http_parser_init(&source->parser, HTTP_REQUEST);
-    source->parser_settings = source_parser_settings;
+    if (source->parser) {
+        pproxy_parser_reset(source->parser);
+    }
+    source->peek_offset = 0;
+    memset(&source->body, 0, sizeof(source->body));
+    source->head_size = 0;
+    evutil_timerclear(&source->head_deadline);
+    source->head_complete = 0;
+    source->url_len = 0;
+}
+
+/*
+ * An idle connection holds no parser. One is attached when request bytes
+ * arrive, and returned to the worker's pool when the connection goes back
+ * to waiting for a request, or once a tunnel no longer parses. It must not
+ * be released while it is executing.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int acquire_source_parser(struct pproxy_connection *conn) {
+    struct pproxy_source_state *source = &conn->source_state;
+    if (source->parser) {
+        return 0;
+    }
+
+    source->parser = pproxy_object_pool_get_parser(
+        &conn->worker->object_pool);
+    if (!source->parser) {
+        return -1;
+    }
+    pproxy_parser_init(source->parser, HTTP_REQUEST,
+        conn->handle->options.parser_backend, &source_parser_callbacks, conn);
+    return 0;
+}
+
+static void release_source_parser(struct pproxy_connection *conn) {
+    struct pproxy_source_state *source = &conn->source_state;
+    if (source->parser) {
+        pproxy_object_pool_put_parser(&conn->worker->object_pool,
+            source->parser);
+        source->parser = 0;
+    }
 }
 
 static int init_source_state(struct pproxy_source_state *source,
@@ -136,58 +283,184 @@ static int init_source_state(struct pproxy_source_state *source,
         return -1;
     }
 
-    reset_source_state(source);
-    source->parser.data = conn;
+    source->bev = pproxy_object_pool_get_bufferevent(
+        &conn->worker->object_pool, fd);
+    if (!source->bev) {
+        return -1;
+    }
 
-    for (;;) {
-        source->bev = bufferevent_socket_new(conn->handle->base, fd,
-            BEV_OPT_CLOSE_ON_FREE);
-        if (!source->bev) {
-            break;
-        }
+    return 0;
+}
 
-        source->buffer = evbuffer_new();
-        if (!source->buffer) {
-            break;
-        }
+static const struct pproxy_parser_callbacks target_parser_callbacks = {
+    0, /* on_url */
+    target_headers_complete,
+    target_body_cb,
+    target_message_complete
+};
+
+/* The target state owns the bufferevent even if this fails */
+static int init_target_state(struct pproxy_target_state *target,
+        struct pproxy_connection *conn, struct bufferevent *bev) {
+    if (target->parser) {
+        pproxy_object_pool_put_parser(&conn->worker->object_pool,
+            target->parser);
+    }
+    memset(target, 0, sizeof(*target));
+    target->bev = bev;
+
+    target->parser = pproxy_object_pool_get_parser(
+        &conn->worker->object_pool);
+    if (!target->parser) {
+        return -1;
+    }
+    pproxy_parser_init(target->parser, HTTP_RESPONSE,
+        PPROXY_PARSER_HTTP_PARSER, &target_parser_callbacks, conn);
+
+    return 0;
+}
+
+/*
+ * Timeouts. A connection has a single timer, whose meaning depends on its
+ * state: idle while no request is in progress, read while the request is
+ * incomplete, and response once it has been forwarded. It is
+ * rescheduled whenever the connection makes progress, and cancelled while
+ * connecting, which has its own timeout, and for tunnels. A request head
+ * also has a deadline, counted from its first byte, which the timer never
+ * overshoots.
+ */
+static int state_timeout(struct pproxy_connection *conn) {
+    const struct pproxy_options *options = &conn->handle->options;
 
+    switch (conn->state) {
+    case CONN_RECV:
+        if (conn->source_state.peek_offset == 0 && evbuffer_get_length(
+                bufferevent_get_input(conn->source_state.bev)) == 0) {
+            return options->idle_timeout_ms;
+        }
+        return options->read_timeout_ms;
+    case CONN_RECV_FORWARD:
+        /* The rest of the request is still to come */
+        return options->read_timeout_ms;
+    case CONN_FORWARD:
+    case CONN_PIPELINED_RECV:
+        return options->response_timeout_ms;
+    case CONN_COMPLETE:
+    case CONN_CLOSING:
+        /* Waiting for the client to take the last response */
+        return options->idle_timeout_ms;
+    default:
         return 0;
     }
+}
 
-    /* Error path cleanup */
-    if (source->bev) {
-        bufferevent_free(source->bev);
-        source->bev = 0;
+/*
+ * The deadline is suspended while the parser waits on the target: during
+ * the connection, or while the target holds the request back.
+ *
+ * @return milliseconds until the request head is due, 0 if it is overdue,
+ * or -1 if no deadline applies
+ */
+static int head_ms_left(struct pproxy_connection *conn) {
+    struct pproxy_source_state *source = &conn->source_state;
+    if (!evutil_timerisset(&source->head_deadline) || source->head_complete ||
+            source->read_paused) {
+        return -1;
+    }
+    switch (conn->state) {
+    case CONN_RECV:
+    case CONN_RECV_FORWARD:
+    case CONN_PIPELINED_RECV:
+    case CONN_DIRECT_PARSING:
+        break;
+    default:
+        return -1;
     }
 
-    if (source->buffer) {
-        evbuffer_free(source->buffer);
+    struct timeval now, left;
+    event_base_gettimeofday_cached(conn->worker->base, &now);
+    if (!evutil_timercmp(&now, &source->head_deadline, <)) {
+        return 0;
     }
+    evutil_timersub(&source->head_deadline, &now, &left);
+    return left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+}
 
-    return -1;
+static int timeout_for_state(struct pproxy_connection *conn) {
+    int ms = state_timeout(conn);
+    int head_ms = head_ms_left(conn);
+    if (head_ms < 0) {
+        return ms;
+    }
+    if (head_ms == 0) {
+        /* Due now; a zero delay would cancel the timer */
+        head_ms = 1;
+    }
+    return ms > 0 && ms < head_ms ? ms : head_ms;
 }
 
-static const struct http_parser_settings target_parser_settings = {
-    0, /* on_message_begin */
-    0, /* on_url */
-    0, /* on_status_complete */
-    0, /* on_header_field */
-    0, /* on_header_value */
-    0, /* receive_headers_complete */
-    0, /* receive_body */
-    target_message_complete
-};
+static void update_timeout(struct pproxy_connection *conn) {
+    int ms = timeout_for_state(conn);
+    if (ms > 0 && !pproxy_timer_pending(&conn->cb_handle.timer)) {
+        pproxy_timer_schedule(&conn->worker->timer_wheel, &conn->timeout, ms);
+    } else {
+        pproxy_timer_cancel(&conn->worker->timer_wheel, &conn->timeout);
+    }
+}
 
-static int init_target_state(struct pproxy_target_state *target,
-        struct pproxy_connection *conn, struct bufferevent *bev) {
-    memset(target, 0, sizeof(*target));
+static void timeout_cb(struct pproxy_timer *timer) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) (((char *)
+        timer) - offsetof(struct pproxy_connection, timeout));
 
-    http_parser_init(&target->parser, HTTP_RESPONSE);
-    target->parser.data = conn;
-    target->parser_settings = target_parser_settings;
-    target->bev = bev;
+    if (head_ms_left(conn) == 0) {
+        log_debug("Timed out waiting for the request head\n");
+        refuse_request(conn, 408, "Request Timeout");
+        return;
+    }
 
-    return 0;
+    switch (conn->state) {
+    case CONN_RECV_FORWARD:
+        if (conn->source_state.read_paused) {
+            /* The target is holding the request back */
+            update_timeout(conn);
+            return;
+        }
+        log_debug("Client connection timed out\n");
+        break;
+    case CONN_FORWARD:
+    case CONN_PIPELINED_RECV:
+        if (conn->target_state.read_paused) {
+            /* The client is holding the response back */
+            update_timeout(conn);
+            return;
+        }
+        log_debug("Timed out waiting for the response\n");
+        if (!conn->target_state.responding && conn->pipeline.count <= 1) {
+            bufferevent_disable(conn->target_state.bev, EV_READ | EV_WRITE);
+            send_error_response(conn, 504, "Gateway Timeout");
+            return;
+        }
+        break;
+    default:
+        log_debug("Client connection timed out\n");
+        break;
+    }
+
+    pproxy_connection_free(conn);
+}
+
+static void free_offload(struct pproxy_connection *conn) {
+    switch (conn->tunnel_engine) {
+    case PPROXY_TUNNEL_SPLICE:
+        pproxy_splice_free(&conn->offload.splice);
+        break;
+    case PPROXY_TUNNEL_SOCKMAP:
+        pproxy_sockmap_link_free(&conn->offload.sockmap_link);
+        break;
+    default:
+        break;
+    }
+    conn->tunnel_engine = PPROXY_TUNNEL_BUFFERED;
 }
 
 void pproxy_connection_free(struct pproxy_connection *conn) {
@@ -195,29 +468,54 @@ void pproxy_connection_free(struct pproxy_connection *conn) {
         return;
     }
 
-    free_source_state(&conn->source_state);
-    free_target_state(&conn->target_state);
+    if (conn->state == CONN_DIRECT) {
+        pproxy_migration_remove_tunnel(conn->worker, conn);
+    }
+
+    pproxy_resolver_cancel(&conn->resolve);
+    pproxy_timer_cancel(&conn->worker->timer_wheel, &conn->timeout);
+    pproxy_timer_cancel(&conn->worker->timer_wheel, &conn->latency.timer);
+    if (conn->connector) {
+        pproxy_connector_cancel(conn->connector);
+        free(conn->connector);
+        conn->connector = 0;
+    }
+    /* before the sockets are closed with their bufferevents */
+    free_offload(conn);
+
+    free_source_state(&conn->source_state, &conn->worker->object_pool);
+    free_target_state(&conn->target_state, &conn->worker->object_pool);
 
     pproxy_connection_handle_free(&conn->cb_handle);
 
-    free(conn);
+    ATOMIC_ADD(&conn->worker->active_connections, -1);
+    ATOMIC_ADD(&conn->handle->num_connections, -1);
+    if (conn->client_counted) {
+        pproxy_client_disconnect(&conn->handle->clients, &conn->client);
+    }
+
+    pproxy_object_pool_put_connection(&conn->worker->object_pool, conn);
 }
 
 /*
  * Initializes or resets the connection structures to begin handling
  * a new request.
  *
- *  - request_state.buffer allocated or reset
  *  - request_state.peek_offset = 0
- *  - request_state.parser reset
- *  - request_state.settings = receive_settings
+ *  - request_state.parser released until the next request arrives
  *
  * The bufferevent callbacks are set to the receive-handling callbacks.
  */
 static int set_connection_state_recv(struct pproxy_connection *conn) {
     reset_source_state(&conn->source_state);
+    release_source_parser(conn);
+    /* Reads are enabled below, whatever backpressure was in force */
+    conn->source_state.read_paused = 0;
 
     conn->state = CONN_RECV;
+    conn->keep_alive = 0;
+    conn->response_complete = 0;
+    memset(&conn->pipeline, 0, sizeof(conn->pipeline));
 
     bufferevent_setcb(conn->source_state.bev, source_read_cb, /*write_cb=*/ 0,
         source_event_cb, conn);
@@ -225,9 +523,116 @@ static int set_connection_state_recv(struct pproxy_connection *conn) {
     /* enable read and write callbacks on the source bufferevent */
     bufferevent_enable(conn->source_state.bev, EV_READ | EV_WRITE);
 
+    update_timeout(conn);
+
+    return 0;
+}
+
+/* Takes up the request on the connected target */
+static void finish_connecting(struct pproxy_connection *conn) {
+    struct bufferevent *bev = conn->target_state.bev;
+
+    switch (pproxy_parser_method(conn->source_state.parser)) {
+    case HTTP_CONNECT:
+        set_connection_state_direct_parsing(conn, bev);
+        break;
+    default:
+        if (set_connection_state_recv_forward(conn, bev)) {
+            send_error_response(conn, 502, "Bad Gateway");
+            return;
+        }
+    }
+
+    /* Run an iteration of the driver for anything buffered */
+    drive_request(conn);
+}
+
+/* Takes over the winning connection to the target */
+static void target_connected_cb(struct bufferevent *bev, int error,
+        void *arg) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) arg;
+
+    /* The connector doesn't touch itself after invoking its callback */
+    free(conn->connector);
+    conn->connector = 0;
+
+    if (!bev) {
+        log_debug("While connecting to remote host: %s\n",
+            evutil_socket_error_to_string(error));
+        if (error == PPROXY_ETIMEDOUT) {
+            send_error_response(conn, 504, "Gateway Timeout");
+        } else {
+            send_error_response(conn, 502, "Bad Gateway");
+        }
+        return;
+    }
+
+    conn->target_state.bev = bev;
+    bufferevent_setcb(bev, /*read_cb=*/ 0, /*write_cb=*/ 0, connect_event_cb,
+        conn);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+    if (!delay_phase(conn, PPROXY_LATENCY_CONNECT, finish_connecting)) {
+        finish_connecting(conn);
+    }
+}
+
+static int connect_target(struct pproxy_connection *conn,
+        struct evutil_addrinfo *addrs, uint16_t port) {
+    assert(!conn->connector);
+    conn->connector = (struct pproxy_connector*) malloc(
+        sizeof(struct pproxy_connector));
+    if (!conn->connector) {
+        return -1;
+    }
+
+    if (pproxy_connector_start(conn->connector, conn->worker, addrs,
+            port, target_connected_cb, conn)) {
+        free(conn->connector);
+        conn->connector = 0;
+        return -1;
+    }
     return 0;
 }
 
+static void resolve_cb(int result, struct evutil_addrinfo *addrs, void *arg) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) arg;
+
+    if (result != 0) {
+        log_debug("DNS error %s\n", evutil_gai_strerror(result));
+        if (result == EVUTIL_EAI_AGAIN) {
+            send_error_response(conn, 504, "Gateway Timeout");
+        } else {
+            send_error_response(conn, 502, "Bad Gateway");
+        }
+    } else if (connect_target(conn, addrs, conn->target_state.port)) {
+        log_debug("Failed to start connection\n");
+        send_error_response(conn, 502, "Bad Gateway");
+    }
+}
+
+/* Looks up the recorded target address and connects to it */
+static int resolve_target(struct pproxy_connection *conn) {
+    struct evutil_addrinfo *addrs = NULL;
+    switch (pproxy_resolver_resolve(&conn->worker->resolver,
+            conn->target_state.host, &conn->resolve, &addrs)) {
+    case 0:
+        return connect_target(conn, addrs, conn->target_state.port);
+    case 1:
+        /* resolve_cb continues once the lookup completes */
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void resolve_after_delay(struct pproxy_connection *conn) {
+    if (resolve_target(conn)) {
+        log_debug("Failed to start connection\n");
+        send_error_response(conn, 502, "Bad Gateway");
+    }
+}
+
 static int set_connection_state_connecting(struct pproxy_connection *conn,
         const char *host, uint16_t port) {
     assert(conn->state == CONN_RECV);
@@ -236,18 +641,21 @@ static int set_connection_state_connecting(struct pproxy_connection *conn,
     /* disable callbacks on the source bufferevent */
     bufferevent_disable(conn->source_state.bev, EV_READ);
 
-    struct bufferevent *bev = bufferevent_socket_new(conn->handle->base, -1,
-        BEV_OPT_CLOSE_ON_FREE);
-    if (!bev) {
-        return -1;
+    /* Tunnels take over the connection, so only plain requests reuse one */
+    if (pproxy_parser_method(conn->source_state.parser) != HTTP_CONNECT) {
+        struct bufferevent *pooled = pproxy_upstream_pool_get(
+            &conn->worker->upstream_pool, host, port);
+        if (pooled) {
+            log_debug("Reusing connection to %s:%hu\n", host, port);
+            bufferevent_enable(pooled, EV_READ | EV_WRITE);
+            return set_connection_state_recv_forward(conn, pooled);
+        }
     }
-    bufferevent_setcb(bev, /*read_cb=*/ 0, /*write_cb=*/ 0, connect_event_cb,
-        conn);
-    bufferevent_enable(bev, EV_READ | EV_WRITE);
 
-    /* Start connecting */
-    return bufferevent_socket_connect_hostname(bev, conn->handle->dns_base,
-        AF_UNSPEC, host, port);
+    if (delay_phase(conn, PPROXY_LATENCY_DNS, resolve_after_delay)) {
+        return 0;
+    }
+    return resolve_target(conn);
 }
 
 /*
@@ -263,13 +671,22 @@ static int set_connection_state_recv_forward(struct pproxy_connection *conn,
     assert(conn->state == CONN_CONNECTING);
 
     if (conn->target_state.bev && conn->target_state.bev != bev) {
-        bufferevent_free(conn->target_state.bev);
+        pproxy_object_pool_put_bufferevent(&conn->worker->object_pool,
+            conn->target_state.bev);
     }
 
-    init_target_state(&conn->target_state, conn, bev);
+    /* The target address was recorded when connecting began */
+    char *host = conn->target_state.host;
+    uint16_t port = conn->target_state.port;
+    int rc = init_target_state(&conn->target_state, conn, bev);
+    conn->target_state.host = host;
+    conn->target_state.port = port;
+    if (rc) {
+        return -1;
+    }
     conn->state = CONN_RECV_FORWARD;
 
-    http_parser_pause(&conn->source_state.parser, 0);
+    pproxy_parser_pause(conn->source_state.parser, 0);
 
     /* turn on the read callback on the target bufferevent */
     bufferevent_setcb(bev, target_read_cb, /*write_cb=*/ 0, target_event_cb,
@@ -290,6 +707,11 @@ static int set_connection_state_forward(struct pproxy_connection *conn) {
     assert(conn->state == CONN_RECV_FORWARD);
     conn->state = CONN_FORWARD;
 
+    /* The response may have beaten us here */
+    if (conn->response_complete) {
+        set_connection_state_complete(conn);
+    }
+
     return 0;
 }
 
@@ -298,14 +720,56 @@ static int set_connection_state_forward_after_delay(
     assert(conn->state == CONN_RECV_FORWARD);
     conn->state = CONN_FORWARD;
 
-    /* In the delay case, we've shut down processing of the source bev. */
+    /* In the delay case, we've shut down processing of the source bev, and
+     * reading of the response. */
     bufferevent_enable(conn->source_state.bev, EV_READ | EV_WRITE);
+    if (!conn->response_complete &&
+            !pproxy_timer_pending(&conn->latency.timer)) {
+        bufferevent_enable(conn->target_state.bev, EV_READ);
+    }
+    update_timeout(conn);
+
+    if (conn->response_complete) {
+        set_connection_state_complete(conn);
+        finish_response(conn);
+    } else if (evbuffer_get_length(
+            bufferevent_get_input(conn->source_state.bev)) > 0) {
+        /* Pick up any pipelined requests that arrived in the meantime */
+        drive_request(conn);
+    }
 
     return 0;
 }
 
-static int set_connection_state_complete(struct pproxy_connection *conn) {
+/*
+ * Starts parsing the next request on a persistent connection while the
+ * current request's response is outstanding.
+ *
+ * @return 0 if pipelining is possible, -1 otherwise
+ */
+static int set_connection_state_pipelined_recv(
+        struct pproxy_connection *conn) {
     assert(conn->state == CONN_FORWARD);
+
+    struct pproxy_pipeline *pipeline = &conn->pipeline;
+    if (pipeline->count == 0 ||
+            pipeline->count >= conn->handle->options.max_pipeline_depth ||
+            pipeline->blocked ||
+            !pipeline->keep_alive[(pipeline->head + pipeline->count - 1) %
+                PPROXY_MAX_PIPELINE_DEPTH] ||
+            pproxy_timer_pending(&conn->cb_handle.timer)) {
+        return -1;
+    }
+
+    reset_source_state(&conn->source_state);
+    conn->state = CONN_PIPELINED_RECV;
+
+    return 0;
+}
+
+static int set_connection_state_complete(struct pproxy_connection *conn) {
+    assert(conn->state == CONN_FORWARD ||
+        conn->state == CONN_PIPELINED_RECV);
     conn->state = CONN_COMPLETE;
 
     bufferevent_disable(conn->target_state.bev, EV_READ | EV_WRITE);
@@ -313,15 +777,36 @@ static int set_connection_state_complete(struct pproxy_connection *conn) {
     return 0;
 }
 
+/*
+ * Transition from a completed response back to receiving the next request
+ * on a persistent client connection. The response may still be draining to
+ * the client; the bufferevent preserves ordering with anything written for
+ * the next request.
+ */
+static int set_connection_state_recv_next(struct pproxy_connection *conn) {
+    assert(conn->state == CONN_COMPLETE);
+
+    free_target_state(&conn->target_state, &conn->worker->object_pool);
+    set_connection_state_recv(conn);
+
+    /* Process anything the client sent after the completed request */
+    if (evbuffer_get_length(bufferevent_get_input(conn->source_state.bev))
+            > 0) {
+        drive_request(conn);
+    }
+
+    return 0;
+}
+
 static int set_connection_state_direct_parsing(struct pproxy_connection *conn,
         struct bufferevent *bev) {
     assert(conn->state == CONN_CONNECTING);
-    assert(conn->target_state.bev == 0);
+    assert(conn->target_state.bev == bev);
 
     conn->state = CONN_DIRECT_PARSING;
     conn->target_state.bev = bev;
 
-    http_parser_pause(&conn->source_state.parser, 0);
+    pproxy_parser_pause(conn->source_state.parser, 0);
 
     return 0;
 }
@@ -332,53 +817,176 @@ static int set_connection_state_direct(struct pproxy_connection *conn) {
 
     conn->state = CONN_DIRECT;
 
+    /* After a pause, the parsed CONNECT request is still at the front of
+     * the input; it must not reach the target */
+    evbuffer_drain(bufferevent_get_input(conn->source_state.bev),
+        conn->source_state.peek_offset);
+    conn->source_state.peek_offset = 0;
+
+    /* With kernel forwarding, the drained write callbacks hand the tunnel over
+     * once the 200 response and any residual request data are sent */
+    bufferevent_data_cb write_cb = 0;
+    if (conn->handle->options.tunnel_engine != PPROXY_TUNNEL_BUFFERED &&
+            !pproxy_connection_handle_is_shaped(&conn->cb_handle)) {
+        write_cb = direct_write_cb;
+    }
+
     bufferevent_setcb(conn->source_state.bev, direct_source_read_cb,
-        /*write_cb=*/ 0, direct_source_event_cb, conn);
+        write_cb, direct_source_event_cb, conn);
     bufferevent_enable(conn->source_state.bev, EV_READ | EV_WRITE);
     bufferevent_setcb(conn->target_state.bev, direct_target_read_cb,
-        /*write_cb=*/ 0, direct_target_event_cb, conn);
+        write_cb, direct_target_event_cb, conn);
     bufferevent_enable(conn->target_state.bev, EV_READ | EV_WRITE);
 
+    pproxy_migration_add_tunnel(conn->worker, conn);
+    update_timeout(conn);
+
     return 0;
 }
 
+/* @return non-zero if host:port is the current target */
+static int is_connection_target(struct pproxy_connection *conn,
+        const char *host, size_t host_len, uint16_t port) {
+    struct pproxy_target_state *target = &conn->target_state;
+    return target->host && target->port == port &&
+        strlen(target->host) == host_len &&
+        strncmp(target->host, host, host_len) == 0;
+}
+
 /* Connects to the target host and initializes transfer structures. */
 static int set_connection_target(struct pproxy_connection *conn,
         const char *host, size_t host_len, uint16_t port) {
-    /* Oof, stomping this memory temporarily. We know that this is safe to
-     * do because the format of the request line requires that there be
-     * additional data following the host portion of the url. */
-    char *tmphost = (char *) host;
-    char save = tmphost[host_len];
-    tmphost[host_len] = '\0';
-    int rc = set_connection_state_connecting(conn, tmphost, port);
-    tmphost[host_len] = save;
+    /* Remembered to match pipelined requests against */
+    conn->target_state.host = (char*) malloc(host_len + 1);
+    if (!conn->target_state.host) {
+        return -1;
+    }
+    memcpy(conn->target_state.host, host, host_len);
+    conn->target_state.host[host_len] = '\0';
+    conn->target_state.port = port;
+    return set_connection_state_connecting(conn, conn->target_state.host,
+        port);
+}
+
+/*
+ * Body bypass. The parser counts the bytes left in a body of known length,
+ * or in the current chunk of a chunked body. When a parse ends inside such
+ * a range, all but its last byte are forwarded in bulk without being
+ * parsed, and the parser skips them; it then consumes the last byte and
+ * whatever framing follows.
+ */
+
+static int source_body_cb(struct pproxy_parser *parser, const char *data,
+        size_t len) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
+    conn->source_state.body.data_end = data + len;
+    return 0;
+}
+
+static int target_body_cb(struct pproxy_parser *parser, const char *data,
+        size_t len) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
+    conn->target_state.body.data_end = data + len;
+    return 0;
+}
+
+/* Records whether a parse that consumed up to parsed_end stopped inside
+ * body data; that is the case if the data seen by on_body ended there */
+static void update_body_bypass(struct pproxy_connection *conn,
+        struct pproxy_body_bypass *body, struct pproxy_parser *parser,
+        const char *parsed_end) {
+    body->in_body = conn->handle->options.bypass_body_parsing &&
+        body->data_end == parsed_end &&
+        pproxy_parser_errno(parser) == HPE_OK &&
+        pproxy_parser_body_remaining(parser) > 1;
+    body->data_end = 0;
+}
+
+/* Moves body bytes from src to dst without parsing them */
+static void bypass_body(struct pproxy_body_bypass *body,
+        struct pproxy_parser *parser, struct evbuffer *src,
+        struct evbuffer *dst) {
+    assert(body->in_body);
+
+    size_t len = evbuffer_get_length(src);
+    uint64_t remaining = pproxy_parser_body_remaining(parser);
+    if (len > remaining - 1) {
+        len = (size_t) (remaining - 1);
+    }
+    int moved = evbuffer_remove_buffer(src, dst, len);
+    assert(moved >= 0 && (size_t) moved == len);
+    (void) moved;
 
-    return rc;
+    pproxy_parser_skip_body(parser, len);
+    body->in_body = pproxy_parser_body_remaining(parser) > 1;
 }
 
-static int target_message_complete(struct http_parser *parser) {
+static int source_headers_complete(struct pproxy_parser *parser) {
     struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
+    conn->source_state.head_complete = 1;
+    return start_request(conn, parser);
+}
+
+static int target_headers_complete(struct pproxy_parser *parser) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
+
+    /* Responses to HEAD carry no body, whatever their headers say; the
+     * parser has to be told so it doesn't wait for one. */
+    return pipeline_head_method(&conn->pipeline) == HTTP_HEAD ? 1 : 0;
+}
 
-    /* TODO: handle keep-alive? */
+static int target_message_complete(struct pproxy_parser *parser) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
 
-    if (conn->state == CONN_FORWARD) {
+    if (pproxy_parser_status_code(parser) / 100 == 1) {
+        /* Interim response, e.g. to Expect: 100-continue */
+        return 0;
+    }
+    conn->latency.responding = 0;
+
+    int request_keep_alive;
+    if (conn->pipeline.count > 1) {
+        /* Response to a request that has been followed by pipelined ones.
+         * If the target won't send any more responses, the rest of the
+         * pipeline is abandoned; the client retries it when we close. */
+        if (pipeline_pop(&conn->pipeline) && pproxy_parser_should_keep_alive(parser)) {
+            return 0;
+        }
+        conn->pipeline.count = 1;
+        request_keep_alive = 0;
+    } else {
+        request_keep_alive = conn->pipeline.keep_alive[conn->pipeline.head];
+    }
+
+    /* The client and target connections can be reused for another request
+     * if both the request and the response allow it. A target that responds
+     * before reading the whole request may not expect more requests. */
+    conn->keep_alive = request_keep_alive && pproxy_parser_should_keep_alive(parser);
+    conn->target_state.reusable = conn->keep_alive &&
+        conn->state != CONN_RECV_FORWARD;
+    conn->response_complete = 1;
+
+    if (conn->state == CONN_FORWARD || conn->state == CONN_PIPELINED_RECV) {
         /* Source is done */
         set_connection_state_complete(conn);
-        http_parser_pause(parser, 1);
+        pproxy_parser_pause(parser, 1);
     } else {
-        /* Otherwise this is a PUT w/ Expect: 100-continue, probably */
+        /* Otherwise the target responded before receiving the whole
+         * request; we complete once the request has been forwarded */
         assert(conn->state == CONN_RECV_FORWARD);
     }
 
     return 0;
 }
 
-static int source_message_complete(struct http_parser *parser) {
+static int source_message_complete(struct pproxy_parser *parser) {
     struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
 
     switch (conn->state) {
     case CONN_RECV_FORWARD:
+        pipeline_set_keep_alive(&conn->pipeline,
+            pproxy_parser_should_keep_alive(parser));
+
         if (conn->handle->callbacks.on_request_complete) {
             (*conn->handle->callbacks.on_request_complete)(&conn->cb_handle);
         }
@@ -406,23 +1014,56 @@ static int source_message_complete(struct http_parser *parser) {
 
     /* We're at the end of the message. Pause the parser so that we
      * get control back in the driver loop. TODO: just return HPE_PAUSED? */
-    http_parser_pause(parser, 1);
+    pproxy_parser_pause(parser, 1);
     return 0;
 }
 
-static int url_cb(struct http_parser *parser, const char *data, size_t len) {
+/* @return whether the client's request rate allows another request */
+static int admit_request(struct pproxy_connection *conn) {
+    struct timeval now;
+    event_base_gettimeofday_cached(conn->worker->base, &now);
+    uint64_t now_ms = (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+    return pproxy_client_request(&conn->handle->clients, &conn->client,
+        now_ms) == 0;
+}
+
+/*
+ * The url may be reported in as many pieces as it arrives in, so it is
+ * gathered here and acted on once the request head is complete.
+ */
+static int url_cb(struct pproxy_parser *parser, const char *data, size_t len) {
     struct pproxy_connection *conn = (struct pproxy_connection*) parser->data;
+    struct pproxy_source_state *source = &conn->source_state;
+
+    if (source->url_len + len > source->url_size) {
+        size_t size = source->url_size ? source->url_size : 64;
+        while (size < source->url_len + len) {
+            size *= 2;
+        }
+        char *url = (char*) realloc(source->url, size);
+        if (!url) {
+            return -1;
+        }
+        source->url = url;
+        source->url_size = size;
+    }
+    memcpy(source->url + source->url_len, data, len);
+    source->url_len += len;
+    return 0;
+}
+
+/* Routes the request to the target named by its url */
+static int start_request(struct pproxy_connection *conn,
+        struct pproxy_parser *parser) {
+    const char *data = conn->source_state.url;
+    size_t len = conn->source_state.url_len;
 
-    /* TODO: the http_parser implementation only invokes on_url once, but
-     * this does not appear to be required from the callback documentation
-     * example. Figure out whether we can depend on this. */
+    int method = pproxy_parser_method(parser);
     struct http_parser_url url;
-    int rc = http_parser_parse_url(data, len, parser->method == HTTP_CONNECT,
-        &url);
-    if (rc != 0) {
-        log_debug("While parsing url %.*s: %s\n", (int) len, data,
-            http_errno_description((enum http_errno) parser->http_errno));
-        return rc;
+    if (!data || http_parser_parse_url(data, len, method == HTTP_CONNECT,
+            &url) != 0) {
+        log_debug("Invalid url %.*s\n", (int) len, data ? data : "");
+        return -1;
     }
 
     if (!(url.field_set & (1 << UF_HOST))) {
@@ -432,57 +1073,90 @@ static int url_cb(struct http_parser *parser, const char *data, size_t len) {
 
     uint16_t port = 80;
     if (url.field_set & (1 << UF_PORT)) {
-        /* http_parser checks that this is numeric */
-        port = atoi(&data[url.field_data[UF_PORT].off]);
+        /* http_parser checks that this is numeric. The gathered url isn't
+         * terminated, so only the port's own digits are read. */
+        const char *digits = &data[url.field_data[UF_PORT].off];
+        unsigned long value = 0;
+        uint16_t i;
+        for (i = 0; i < url.field_data[UF_PORT].len && value <= 65535; ++i) {
+            value = value * 10 + (unsigned long) (digits[i] - '0');
+        }
+        if (value == 0 || value > 65535) {
+            log_debug("Invalid port in url %.*s\n", (int) len, data);
+            return -1;
+        }
+        port = (uint16_t) value;
     }
 
     log_debug("%s %.*s:%hu\n",
-        http_method_str((enum http_method) parser->method),
+        http_method_str((enum http_method) method),
         url.field_data[UF_HOST].len, &data[url.field_data[UF_HOST].off], port);
 
+    if (conn->client_counted && !conn->request_charged) {
+        if (!admit_request(conn)) {
+            if (conn->state == CONN_PIPELINED_RECV) {
+                /* Ask again once the outstanding responses are written */
+                conn->pipeline.blocked = 1;
+                pproxy_parser_pause(parser, 1);
+                return 0;
+            }
+            log_debug("Request rate exceeded by client\n");
+            send_error_response(conn, 429, "Too Many Requests");
+            return -1;
+        }
+        conn->request_charged = 1;
+    }
+
+    if (conn->state == CONN_PIPELINED_RECV) {
+        if (method != HTTP_CONNECT &&
+                is_connection_target(conn, &data[url.field_data[UF_HOST].off],
+                    url.field_data[UF_HOST].len, port)) {
+            /* Same target; forward it behind the outstanding requests */
+            pipeline_push(&conn->pipeline, method);
+            conn->request_charged = 0;
+            conn->state = CONN_RECV_FORWARD;
+        } else {
+            /* Parse this request again once the pipeline drains */
+            conn->pipeline.blocked = 1;
+            pproxy_parser_pause(parser, 1);
+        }
+        return 0;
+    }
+
+    pipeline_push(&conn->pipeline, method);
+    conn->request_charged = 0;
+
     /* Set the connection target and maybe start connecting to it */
-    rc = set_connection_target(conn, &data[url.field_data[UF_HOST].off],
-        url.field_data[UF_HOST].len, port);
-    if (rc != 0) {
+    if (set_connection_target(conn, &data[url.field_data[UF_HOST].off],
+            url.field_data[UF_HOST].len, port)) {
         log_debug("Failed to start connection\n");
-        return rc;
+        send_error_response(conn, 502, "Bad Gateway");
+        return -1;
     }
 
-    /* pause parser execution */
-    http_parser_pause(parser, 1);
+    /* pause parser execution until connected; a pooled connection can be
+     * used right away */
+    if (conn->state == CONN_CONNECTING) {
+        pproxy_parser_pause(parser, 1);
+    }
 
     return 0;
 }
 
+/* Handles the target closing before a tunnel is established */
 static void connect_event_cb(struct bufferevent *bev, int16_t what, void *ctx) {
     struct pproxy_connection *conn = (struct pproxy_connection*) ctx;
 
-    if (what & BEV_EVENT_CONNECTED) {
-        switch (conn->source_state.parser.method) {
-        case HTTP_CONNECT:
-            set_connection_state_direct_parsing(conn, bev);
-            break;
-        default:
-            set_connection_state_recv_forward(conn, bev);
-        }
-
-        /* Run an iteration of the driver for anything buffered */
-        drive_request(conn);
-    } else if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
         log_debug("While connecting to remote host: ");
         if (what & BEV_EVENT_ERROR) {
-            int dnserr = bufferevent_socket_get_dns_error(bev);
-            if (dnserr) {
-                log_debug("DNS error %s\n", evutil_gai_strerror(dnserr));
-            } else {
-                log_debug("unknown error\n");
-            }
+            log_debug("%s\n", evutil_socket_error_to_string(
+                EVUTIL_SOCKET_ERROR()));
         } else {
             log_debug("connection closed\n");
         }
-        /* An error during connect means we have to free the bufferevent */
-        assert(conn->target_state.bev != 0);
-        bufferevent_free(bev);
+        /* The connected bufferevent is freed with the target state */
+        assert(conn->target_state.bev == bev);
         pproxy_connection_free(conn);
     }
 }
@@ -491,6 +1165,84 @@ static int move_buffers(struct bufferevent *src, struct bufferevent *dst) {
     return bufferevent_write_buffer(dst, bufferevent_get_input(src));
 }
 
+/*
+ * Backpressure. Each forwarding path moves what it reads into the other
+ * side's output. Once that output holds output_high_watermark bytes,
+ * reading from the side that fills it stops, and the other side's write
+ * low watermark is set so that its write callback runs when the output has
+ * drained to output_low_watermark; reading then resumes. Transitions that
+ * enable reads for their own reasons may resume a side early, in which case
+ * its next forwarded read stops it again.
+ */
+static void output_drained_cb(struct bufferevent *bev, void *ctx);
+
+static void pause_reads_if_full(struct pproxy_connection *conn,
+        struct bufferevent *from, int *paused, struct bufferevent *to) {
+    const struct pproxy_options *options = &conn->handle->options;
+    if (options->output_high_watermark == 0 ||
+            evbuffer_get_length(bufferevent_get_output(to)) <
+                (size_t) options->output_high_watermark) {
+        return;
+    }
+
+    bufferevent_disable(from, EV_READ);
+    *paused = 1;
+    bufferevent_setwatermark(to, EV_WRITE, options->output_low_watermark, 0);
+
+    /* A tunnel's write callback, awaiting kernel forwarding, resumes reads
+     * itself; otherwise there is none while forwarding */
+    bufferevent_data_cb read_cb, write_cb;
+    bufferevent_event_cb event_cb;
+    void *arg;
+    bufferevent_getcb(to, &read_cb, &write_cb, &event_cb, &arg);
+    if (!write_cb) {
+        bufferevent_setcb(to, read_cb, output_drained_cb, event_cb, arg);
+    }
+}
+
+/* Resumes reading from the side that was filling the drained output */
+static void resume_reads(struct pproxy_connection *conn,
+        struct bufferevent *drained) {
+    bufferevent_setwatermark(drained, EV_WRITE, 0, 0);
+
+    if (drained == conn->source_state.bev) {
+        struct pproxy_target_state *target = &conn->target_state;
+        if (target->read_paused && target->bev) {
+            target->read_paused = 0;
+            /* A completed response's target is done reading, and a pending
+             * delay re-enables reading when it expires */
+            if (!pproxy_timer_pending(&conn->cb_handle.timer) &&
+                    !pproxy_timer_pending(&conn->latency.timer) &&
+                    conn->state != CONN_COMPLETE &&
+                    conn->state != CONN_CLOSING) {
+                bufferevent_enable(target->bev, EV_READ);
+            }
+        }
+    } else {
+        struct pproxy_source_state *source = &conn->source_state;
+        if (source->read_paused) {
+            source->read_paused = 0;
+            /* A pending delay re-enables reading when it expires */
+            if (!pproxy_timer_pending(&conn->cb_handle.timer) &&
+                    conn->state != CONN_CLOSING) {
+                bufferevent_enable(source->bev, EV_READ);
+            }
+        }
+    }
+}
+
+static void output_drained_cb(struct bufferevent *bev, void *ctx) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) ctx;
+
+    bufferevent_data_cb read_cb;
+    bufferevent_event_cb event_cb;
+    void *arg;
+    bufferevent_getcb(bev, &read_cb, NULL, &event_cb, &arg);
+    bufferevent_setcb(bev, read_cb, /*write_cb=*/ 0, event_cb, arg);
+
+    resume_reads(conn, bev);
+}
+
 static void target_event_cb(struct bufferevent *bev, int16_t what, void *ctx) {
     (void) bev;
 
@@ -510,86 +1262,118 @@ static void source_last_write_cb(struct bufferevent *bev, void *ctx) {
     pproxy_connection_free(conn);
 }
 
-static int is_http_error(struct http_parser *parser) {
-    switch (parser->http_errno) {
+static int is_http_error(struct pproxy_parser *parser) {
+    enum http_errno error = pproxy_parser_errno(parser);
+    switch (error) {
     case HPE_OK:
     case HPE_PAUSED:
         return 0;
     default:
-        log_debug("HTTP parsing error %s: %s\n",
-            http_errno_name((enum http_errno) parser->http_errno),
-            http_errno_description((enum http_errno) parser->http_errno));
+        log_debug("HTTP parsing error %s: %s\n", http_errno_name(error),
+            http_errno_description(error));
         return 1;
     }
 }
 
+static void release_response(struct pproxy_connection *conn) {
+    struct pproxy_target_state *target = &conn->target_state;
+    if (conn->state == CONN_CLOSING) {
+        return;
+    }
+
+    /* A pending pause or backpressure re-enables reading itself */
+    if (!target->read_paused &&
+            !pproxy_timer_pending(&conn->cb_handle.timer)) {
+        bufferevent_enable(target->bev, EV_READ);
+    }
+    conn->latency.released = 1;
+    target_read_cb(target->bev, conn);
+}
+
+/*
+ * Holds back what was read from the target for the first-byte or per-chunk
+ * delay. Reading stops meanwhile, so the target's receive window fills
+ * rather than our buffers.
+ *
+ * @return 1 if the read is held
+ */
+static int hold_response(struct pproxy_connection *conn,
+        struct bufferevent *bev) {
+    struct pproxy_latency *latency = &conn->latency;
+    if (latency->released) {
+        latency->released = 0;
+        return 0;
+    }
+
+    int phase = latency->responding ? PPROXY_LATENCY_CHUNK :
+        PPROXY_LATENCY_FIRST_BYTE;
+    latency->responding = 1;
+    if (!delay_phase(conn, phase, release_response)) {
+        return 0;
+    }
+    bufferevent_disable(bev, EV_READ);
+    return 1;
+}
+
 static void target_read_cb(struct bufferevent *be, void *ctx) {
     struct pproxy_connection *conn = (struct pproxy_connection*) ctx;
+    struct pproxy_target_state *target = &conn->target_state;
     struct evbuffer *buffer = bufferevent_get_input(be);
+    struct evbuffer *output = bufferevent_get_output(conn->source_state.bev);
 
-    struct evbuffer_iovec extents[1];
-    struct evbuffer_ptr peek;
-    evbuffer_ptr_set(buffer, &peek, 0, EVBUFFER_PTR_SET);
-
-    int eavail = evbuffer_peek(buffer, -1, &peek, extents, 1);
-    if (!eavail) {
-        assert(0 && "event read callback with empty buffer");
+    if (hold_response(conn, be)) {
         return;
     }
+    target->responding = 1;
+
+    /* The response is parsed one extent at a time, and parsed bytes are
+     * moved to the client */
+    while (conn->state != CONN_COMPLETE) {
+        if (target->body.in_body) {
+            if (evbuffer_get_length(buffer) == 0) {
+                break;
+            }
+            bypass_body(&target->body, target->parser, buffer, output);
+            continue;
+        }
 
-    do {
-        size_t parsed = http_parser_execute(&conn->target_state.parser,
-            &conn->target_state.parser_settings, (char *) extents[0].iov_base,
-            extents[0].iov_len);
+        struct evbuffer_iovec extents[1];
+        if (evbuffer_peek(buffer, -1, NULL, extents, 1) == 0) {
+            break;
+        }
 
-        if (is_http_error(&conn->source_state.parser)) {
+        size_t parsed = pproxy_parser_execute(target->parser,
+            (char *) extents[0].iov_base, extents[0].iov_len);
+
+        if (is_http_error(target->parser)) {
             pproxy_connection_free(conn);
             return;
         }
 
-        if (parsed < extents[0].iov_len) {
-            if (conn->state != CONN_COMPLETE) {
-                pproxy_connection_free(conn);
-                return;
-            } else {
-                /* XXX This is an exception condition in the current
-                 * implementation; should not see extraneous data from the
-                 * server. */
-            }
+        if (parsed < extents[0].iov_len && conn->state != CONN_COMPLETE) {
+            pproxy_connection_free(conn);
+            return;
         }
+        /* XXX Extraneous data from the server after a complete response
+         * is an exception condition in the current implementation; it
+         * is left in the buffer. */
 
-        /* Advance to determine if this was a single extent. XXX Is this cheaper
-         * than checking the length of the evbuffer beforehand? */
-        struct evbuffer_iovec cur = extents[0];
-        int rc = evbuffer_ptr_set(buffer, &peek, parsed, EVBUFFER_PTR_ADD);
-        if (!rc) {
-            eavail = evbuffer_peek(buffer, -1, &peek, extents, 1);
-        } else {
-            eavail = 0;
-        }
-        if (!eavail && parsed == cur.iov_len) {
-            /* Common case: only a single extent and totally consumed */
-            rc = bufferevent_write_buffer(conn->source_state.bev, buffer);
-        } else {
-            rc = bufferevent_write(conn->source_state.bev, cur.iov_base,
-                parsed);
-            evbuffer_drain(buffer, parsed);
-        }
+        update_body_bypass(conn, &target->body, target->parser,
+            (char *) extents[0].iov_base + parsed);
 
-        if (rc) {
+        int moved = evbuffer_remove_buffer(buffer, output, parsed);
+        if (moved < 0 || (size_t) moved != parsed) {
             log_debug("Error forwarding to proxy client\n");
             break;
         }
-
-        if (conn->state == CONN_COMPLETE) {
-            break;
-        }
-    } while (eavail);
+    }
 
     if (conn->state == CONN_COMPLETE) {
-        /* Register for state transitions post-write */
-        bufferevent_setcb(conn->source_state.bev, 0, source_last_write_cb,
-            source_event_cb, conn);
+        finish_response(conn);
+    } else {
+        pause_reads_if_full(conn, be, &target->read_paused,
+            conn->source_state.bev);
+        update_timeout(conn);
     }
 }
 
@@ -613,15 +1397,31 @@ static void direct_source_read_cb(struct bufferevent *bev, void *ctx) {
     if (move_buffers(conn->source_state.bev, conn->target_state.bev)) {
         log_debug("Error forwarding to direct proxy client\n");
         pproxy_connection_free(conn);
+        return;
     }
+    pause_reads_if_full(conn, conn->source_state.bev,
+        &conn->source_state.read_paused, conn->target_state.bev);
 }
 
 static void direct_target_event_cb(struct bufferevent *bev, int16_t what,
         void *ctx) {
     (void) bev;
 
-    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
-        struct pproxy_connection *conn = (struct pproxy_connection *) ctx;
+    struct pproxy_connection *conn = (struct pproxy_connection *) ctx;
+    if (what & BEV_EVENT_EOF && evbuffer_get_length(
+            bufferevent_get_output(conn->source_state.bev)) > 0) {
+        /* The client is still to receive what the target sent, e.g. over
+         * a rate limited link; close once it has */
+        bufferevent_disable(conn->target_state.bev, EV_READ | EV_WRITE);
+        pproxy_migration_remove_tunnel(conn->worker, conn);
+        conn->state = CONN_CLOSING;
+        bufferevent_setwatermark(conn->source_state.bev, EV_WRITE, 0, 0);
+        bufferevent_disable(conn->source_state.bev, EV_READ);
+        bufferevent_setcb(conn->source_state.bev, 0, source_last_write_cb,
+            direct_source_event_cb, conn);
+        bufferevent_enable(conn->source_state.bev, EV_WRITE);
+        update_timeout(conn);
+    } else if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
         pproxy_connection_free(conn);
     } else {
         /* no other events are expected */
@@ -635,6 +1435,62 @@ static void direct_target_read_cb(struct bufferevent *bev, void *ctx) {
     struct pproxy_connection *conn = (struct pproxy_connection*) ctx;
     if (move_buffers(conn->target_state.bev, conn->source_state.bev)) {
         pproxy_connection_free(conn);
+        return;
+    }
+    pause_reads_if_full(conn, conn->target_state.bev,
+        &conn->target_state.read_paused, conn->source_state.bev);
+}
+
+static void tunnel_closed_cb(void *arg) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) arg;
+    pproxy_connection_free(conn);
+}
+
+/* @return non-zero if the tunnel holds no bytes in user space */
+static int is_tunnel_drained(struct pproxy_connection *conn) {
+    struct bufferevent *source = conn->source_state.bev;
+    struct bufferevent *target = conn->target_state.bev;
+
+    return evbuffer_get_length(bufferevent_get_input(source)) == 0 &&
+        evbuffer_get_length(bufferevent_get_output(source)) == 0 &&
+        evbuffer_get_length(bufferevent_get_input(target)) == 0 &&
+        evbuffer_get_length(bufferevent_get_output(target)) == 0;
+}
+
+static void direct_write_cb(struct bufferevent *bev, void *ctx) {
+    struct pproxy_connection *conn = (struct pproxy_connection*) ctx;
+    resume_reads(conn, bev);
+
+    if (!is_tunnel_drained(conn)) {
+        /* Wait for the other direction's write callback */
+        return;
+    }
+
+    bufferevent_disable(conn->source_state.bev, EV_READ | EV_WRITE);
+    bufferevent_disable(conn->target_state.bev, EV_READ | EV_WRITE);
+
+    evutil_socket_t source_fd = bufferevent_getfd(conn->source_state.bev);
+    evutil_socket_t target_fd = bufferevent_getfd(conn->target_state.bev);
+
+    if (conn->handle->options.tunnel_engine == PPROXY_TUNNEL_SOCKMAP &&
+            !pproxy_sockmap_link_start(&conn->offload.sockmap_link,
+                &conn->handle->sockmap, conn->worker->base, source_fd,
+                target_fd, tunnel_closed_cb, conn)) {
+        conn->tunnel_engine = PPROXY_TUNNEL_SOCKMAP;
+        return;
+    }
+
+    if (!pproxy_splice_start(&conn->offload.splice, conn->worker->base,
+            source_fd, target_fd, tunnel_closed_cb, conn)) {
+        conn->tunnel_engine = PPROXY_TUNNEL_SPLICE;
+    } else {
+        log_debug("Splicing unavailable; tunnel remains buffered\n");
+        bufferevent_setcb(conn->source_state.bev, direct_source_read_cb,
+            /*write_cb=*/ 0, direct_source_event_cb, conn);
+        bufferevent_enable(conn->source_state.bev, EV_READ | EV_WRITE);
+        bufferevent_setcb(conn->target_state.bev, direct_target_read_cb,
+            /*write_cb=*/ 0, direct_target_event_cb, conn);
+        bufferevent_enable(conn->target_state.bev, EV_READ | EV_WRITE);
     }
 }
 
@@ -643,6 +1499,45 @@ static void send_direct_ok_response(struct pproxy_connection *conn) {
     bufferevent_write(conn->source_state.bev, kOk, sizeof(kOk) - 1);
 }
 
+/* Reports a failure to the client, closing the connection once written */
+static void send_error_response(struct pproxy_connection *conn, int status,
+        const char *reason) {
+    conn->state = CONN_CLOSING;
+
+    evbuffer_add_printf(bufferevent_get_output(conn->source_state.bev),
+        "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+        status, reason);
+
+    /* The last write callback must wait for the output to drain fully */
+    bufferevent_setwatermark(conn->source_state.bev, EV_WRITE, 0, 0);
+    bufferevent_disable(conn->source_state.bev, EV_READ);
+    bufferevent_setcb(conn->source_state.bev, 0, source_last_write_cb,
+        source_event_cb, conn);
+    bufferevent_enable(conn->source_state.bev, EV_WRITE);
+    update_timeout(conn);
+}
+
+/*
+ * Refuses the request being received: with an error response if the client
+ * has yet to see any of one, otherwise by closing the connection.
+ */
+static void refuse_request(struct pproxy_connection *conn, int status,
+        const char *reason) {
+    int answerable = conn->state == CONN_RECV ||
+        conn->state == CONN_DIRECT_PARSING ||
+        (conn->state == CONN_RECV_FORWARD && conn->pipeline.count <= 1 &&
+            !conn->target_state.responding);
+    if (!answerable) {
+        pproxy_connection_free(conn);
+        return;
+    }
+
+    if (conn->target_state.bev) {
+        bufferevent_disable(conn->target_state.bev, EV_READ | EV_WRITE);
+    }
+    send_error_response(conn, status, reason);
+}
+
 static void source_event_cb(struct bufferevent *bev, int16_t what, void *ctx) {
     (void) bev;
 
@@ -659,47 +1554,120 @@ static int is_direct_state(enum pproxy_connection_state state) {
     return state == CONN_DIRECT_PARSING || state == CONN_DIRECT;
 }
 
-static size_t xplat_min(size_t x, size_t y) {
-    return x > y ? y : x;
+/* Moves the first len bytes of the buffer to the bufferevent's output.
+ * Whole chains are transferred; only a partial final chain is copied. */
+static void forward_bytes(struct evbuffer *buffer, size_t len,
+        struct bufferevent *bev) {
+    int moved = evbuffer_remove_buffer(buffer, bufferevent_get_output(bev),
+        len);
+    assert(moved >= 0 && (size_t) moved == len);
+    (void) moved;
 }
 
-static size_t write_atmost(struct evbuffer *buffer, size_t len,
-        struct bufferevent *bev) {
-    size_t remain = len;
-    while (remain > 0) {
-        struct evbuffer_iovec extents[2];
-        size_t cnt = evbuffer_peek(buffer, -1, 0, extents, 2);
-        if (!cnt) {
-            break;
-        } else if (cnt == 1 && extents[0].iov_len <= remain) {
-            /* Write without copying in the common case of a single extent */
-            bufferevent_write_buffer(bev, buffer);
-            remain -= extents[0].iov_len;
-            break;
-        }
+static int is_receiving_state(enum pproxy_connection_state state) {
+    return state == CONN_RECV || state == CONN_PIPELINED_RECV;
+}
 
-        size_t orig = remain;
-        int i = 0;
-        for (; i < 2 && remain > 0; ++i) {
-            size_t w = xplat_min(extents[i].iov_len, remain);
-            bufferevent_write(bev, extents[0].iov_base, w);
-            remain -= w;
-        }
-        evbuffer_drain(buffer, orig - remain);
+/*
+ * Completes the exchange once both the request and the response are done:
+ * either wait for the next request, or close after the response is written.
+ */
+static void finish_response(struct pproxy_connection *conn) {
+    assert(conn->state == CONN_COMPLETE);
+
+    /* Offer a reusable target connection to the pool */
+    struct pproxy_target_state *target = &conn->target_state;
+    if (target->reusable && target->bev && target->host &&
+            evbuffer_get_length(bufferevent_get_input(target->bev)) == 0 &&
+            evbuffer_get_length(bufferevent_get_output(target->bev)) == 0 &&
+            pproxy_upstream_pool_put(&conn->worker->upstream_pool,
+                target->bev, target->host, target->port) == 0) {
+        target->bev = 0;
+    }
+
+    /* Backpressure on the response is over; in particular, the last write
+     * callback must wait for the output to drain fully */
+    bufferevent_setwatermark(conn->source_state.bev, EV_WRITE, 0, 0);
+
+    if (conn->keep_alive) {
+        set_connection_state_recv_next(conn);
+    } else if (evbuffer_get_length(
+            bufferevent_get_output(conn->source_state.bev)) == 0) {
+        pproxy_connection_free(conn);
+    } else {
+        /* Register for state transitions post-write */
+        bufferevent_disable(conn->source_state.bev, EV_READ);
+        bufferevent_setcb(conn->source_state.bev, 0, source_last_write_cb,
+            source_event_cb, conn);
+        update_timeout(conn);
+    }
+}
+
+/*
+ * While a request head is incomplete, the parser is given at most one byte
+ * more than the size limit leaves, so that an oversized head is caught
+ * before it completes.
+ *
+ * @return how many of the len bytes available to parse may be parsed
+ */
+static size_t limit_head_bytes(struct pproxy_connection *conn, size_t len) {
+    const struct pproxy_options *options = &conn->handle->options;
+    struct pproxy_source_state *source = &conn->source_state;
+    if (source->head_complete || options->max_header_size == 0 ||
+            source->head_size > (size_t) options->max_header_size) {
+        return len;
+    }
+
+    size_t allowed = (size_t) options->max_header_size - source->head_size + 1;
+    return len < allowed ? len : allowed;
+}
+
+/*
+ * Counts bytes parsed while a request head is incomplete, starting its
+ * deadline with the first of them.
+ *
+ * @return 0, or -1 if the head has outgrown the limit
+ */
+static int account_head_bytes(struct pproxy_connection *conn, size_t parsed) {
+    const struct pproxy_options *options = &conn->handle->options;
+    struct pproxy_source_state *source = &conn->source_state;
+    if (source->head_complete || parsed == 0) {
+        return 0;
+    }
+
+    if (source->head_size == 0 && options->header_timeout_ms > 0) {
+        struct timeval now, timeout = { options->header_timeout_ms / 1000,
+            (options->header_timeout_ms % 1000) * 1000 };
+        event_base_gettimeofday_cached(conn->worker->base, &now);
+        evutil_timeradd(&now, &timeout, &source->head_deadline);
+    }
+    source->head_size += parsed;
+
+    if (options->max_header_size > 0 &&
+            source->head_size > (size_t) options->max_header_size) {
+        log_debug("Request head exceeds %d bytes\n",
+            options->max_header_size);
+        return -1;
     }
-    return len - remain;
+    return 0;
 }
 
 /* Drives the request. Invoked by the source read callback and after
- * connection, to push through data buffered during connection. */
+ * connection, to push through data buffered during connection. The request
+ * is parsed in place in the source bufferevent's input, and parsed ranges
+ * are moved to the target without copying. */
 static void drive_request(struct pproxy_connection *conn) {
-    struct evbuffer *buffer = conn->source_state.buffer;
+    struct evbuffer *buffer = bufferevent_get_input(conn->source_state.bev);
 
+    size_t skip = 0;
     if (conn->source_state.peek_offset > 0) {
-        if (!is_direct_state(conn->state)) {
-            size_t written = write_atmost(buffer,
-                conn->source_state.peek_offset, conn->target_state.bev);
-            assert(written == conn->source_state.peek_offset);
+        if (is_receiving_state(conn->state)) {
+            /* Still receiving the request head; resume parsing where the
+             * last invocation left off */
+            skip = conn->source_state.peek_offset;
+        } else if (!is_direct_state(conn->state)) {
+            forward_bytes(buffer, conn->source_state.peek_offset,
+                conn->target_state.bev);
         } else {
             /* Just skip */
             evbuffer_drain(buffer, conn->source_state.peek_offset);
@@ -708,13 +1676,22 @@ static void drive_request(struct pproxy_connection *conn) {
     }
 
     struct evbuffer_ptr peek;
-    evbuffer_ptr_set(buffer, &peek, conn->source_state.peek_offset,
-        EVBUFFER_PTR_SET);
+    evbuffer_ptr_set(buffer, &peek, skip, EVBUFFER_PTR_SET);
 
     /* We process the buffer contents one extent at a time */
     int loop = 1;
-    int skip = 0;
     do {
+        if (conn->source_state.body.in_body &&
+                conn->state == CONN_RECV_FORWARD && skip == 0) {
+            if (evbuffer_get_length(buffer) == 0) {
+                break;
+            }
+            bypass_body(&conn->source_state.body, conn->source_state.parser,
+                buffer, bufferevent_get_output(conn->target_state.bev));
+            evbuffer_ptr_set(buffer, &peek, 0, EVBUFFER_PTR_SET);
+            continue;
+        }
+
         struct evbuffer_iovec extents[1];
         int eavail = evbuffer_peek(buffer, -1, &peek, extents, 1);
         if (!eavail) {
@@ -723,15 +1700,31 @@ static void drive_request(struct pproxy_connection *conn) {
 
         size_t parsed;
         if (conn->state != CONN_DIRECT) {
-            parsed = http_parser_execute(&conn->source_state.parser,
-                &conn->source_state.parser_settings,
+            if (acquire_source_parser(conn)) {
+                pproxy_connection_free(conn);
+                return;
+            }
+            extents[0].iov_len = limit_head_bytes(conn, extents[0].iov_len);
+            parsed = pproxy_parser_execute(conn->source_state.parser,
                 (char *) extents[0].iov_base, extents[0].iov_len);
 
-            if (is_http_error(&conn->source_state.parser)) {
-                pproxy_connection_free(conn);
+            if (is_http_error(conn->source_state.parser)) {
+                /* Unless the error has been reported to the client */
+                if (conn->state != CONN_CLOSING) {
+                    pproxy_connection_free(conn);
+                }
+                return;
+            }
+
+            if (account_head_bytes(conn, parsed)) {
+                refuse_request(conn, 431, "Request Header Fields Too Large");
                 return;
             }
 
+            update_body_bypass(conn, &conn->source_state.body,
+                conn->source_state.parser,
+                (char *) extents[0].iov_base + parsed);
+
             /* If we just transitioned to direct on message complete, we need
              * to skip over the residual from the HTTP request */
             if (conn->state == CONN_DIRECT) {
@@ -750,23 +1743,33 @@ static void drive_request(struct pproxy_connection *conn) {
 
         switch (conn->state) {
         case CONN_RECV:
-            /* No url yet, so we continue to buffer. If we broke out of the
-             * parser w/o finishing the current extent, this must have been
-             * a parsing error */
+            /* No complete head yet, so we continue to buffer. If we broke
+             * out of the parser w/o finishing the current extent, this must
+             * have been a parsing error */
             break;
         case CONN_CONNECTING:
             /* In progress connecting; we should not continue. The post-
              * connection callback will drain the rest of the buffer. */
             loop = 0;
             break;
+        case CONN_CLOSING:
+            /* Nothing more is read */
+            loop = 0;
+            break;
         case CONN_RECV_FORWARD:
             write_data = 1;
             break;
         case CONN_FORWARD:
             /* We've hit message end, and need to forward anything left
-             * in the buffer. The callback has been disabled. */
+             * in the buffer. Keep going if the next request can be
+             * pipelined behind this one. */
             write_data = 1;
-            loop = 0;
+            loop = set_connection_state_pipelined_recv(conn) == 0;
+            break;
+        case CONN_PIPELINED_RECV:
+            /* As in CONN_RECV, but stop if the request has to wait for
+             * the outstanding responses */
+            loop = !conn->pipeline.blocked;
             break;
         case CONN_DIRECT_PARSING:
             /* Still parsing a direct connection setup */
@@ -777,15 +1780,16 @@ static void drive_request(struct pproxy_connection *conn) {
             write_data = 1;
             break;
         case CONN_COMPLETE:
-            assert(0 && "Invalid state in request driver");
+            /* The request completed after its response; forward the
+             * remainder of the request and wrap up */
+            write_data = 1;
+            loop = 0;
+            break;
         }
 
         if (write_data) {
-            // TODO: avoid this copying write when the buffer is a single extent
-            bufferevent_write(conn->target_state.bev,
-                extents[0].iov_base, parsed);
-            /* Drain the buffer */
-            evbuffer_drain(buffer, skip + parsed);
+            /* A pipelined request's head may span earlier extents */
+            forward_bytes(buffer, skip + parsed, conn->target_state.bev);
             int rc = evbuffer_ptr_set(buffer, &peek, 0, EVBUFFER_PTR_SET);
             if (rc) {
                 /* buffer is empty */
@@ -807,38 +1811,62 @@ static void drive_request(struct pproxy_connection *conn) {
     /* Advance the peek offset as far as we've processed */
     conn->source_state.peek_offset = skip;
 
+    if (conn->target_state.bev && (conn->state == CONN_RECV_FORWARD ||
+            conn->state == CONN_FORWARD || conn->state == CONN_PIPELINED_RECV ||
+            conn->state == CONN_DIRECT)) {
+        pause_reads_if_full(conn, conn->source_state.bev,
+            &conn->source_state.read_paused, conn->target_state.bev);
+    }
+    update_timeout(conn);
+
     /* If this was a connect, return a 200 response */
     if (conn->state == CONN_DIRECT) {
+        release_source_parser(conn);
         send_direct_ok_response(conn);
+    } else if (conn->state == CONN_COMPLETE) {
+        finish_response(conn);
     }
 }
 
 static void source_read_cb(struct bufferevent *be, void *ptr) {
-    struct pproxy_connection *conn = (struct pproxy_connection*) ptr;
-    struct evbuffer *buffer = conn->source_state.buffer;
+    (void) be;
 
-    if (bufferevent_read_buffer(be, buffer)) {
-        log_debug("Error reading from proxy client\n");
-        return;
+    struct pproxy_connection *conn = (struct pproxy_connection*) ptr;
+    if (evutil_timerisset(&conn->accepted)) {
+        struct timeval now;
+        event_base_gettimeofday_cached(conn->worker->base, &now);
+        pproxy_codel_sample(&conn->worker->codel, &conn->handle->options,
+            &now, &conn->accepted);
+        evutil_timerclear(&conn->accepted);
     }
-
     drive_request(conn);
 }
 
-int pproxy_connection_init(struct pproxy *handle, int fd,
+int pproxy_connection_init(struct pproxy_worker *worker, int fd,
         struct pproxy_connection **conn) {
+    struct pproxy *handle = worker->handle;
+
     if (!conn) {
         return -1;
     }
 
-    struct pproxy_connection *ret = (struct pproxy_connection*) malloc(
-        sizeof(struct pproxy_connection));
+    struct pproxy_connection *ret = pproxy_object_pool_get_connection(
+        &worker->object_pool);
     if (!ret) {
         return -1;
     }
     memset(ret, 0, sizeof(*ret));
 
     ret->handle = handle;
+    ret->worker = worker;
+    ret->resolve.cb = resolve_cb;
+    ret->resolve.arg = ret;
+    pproxy_timer_init(&ret->timeout, timeout_cb);
+    pproxy_timer_init(&ret->latency.timer, latency_cb);
+    ret->latency.stream = (uint64_t) (worker - handle->workers) << 48 |
+        worker->latency_sequence++;
+    pproxy_latency_seed(&ret->latency, handle->latency_profile == -1 ? NULL :
+        &handle->latency_profiles[handle->latency_profile].profile);
 
     for (;;) {
         if (pproxy_connection_handle_init(&ret->cb_handle)) {
@@ -848,6 +1876,8 @@ int pproxy_connection_init(struct pproxy *handle, int fd,
         if (init_source_state(&ret->source_state, ret, fd)) {
             break;
         }
+        ATOMIC_ADD(&worker->active_connections, 1);
+        ATOMIC_ADD(&handle->num_connections, 1);
 
         if (handle->callbacks.on_connect) {
             (*handle->callbacks.on_connect)(&ret->cb_handle);
@@ -864,10 +1894,70 @@ int pproxy_connection_init(struct pproxy *handle, int fd,
 
     /* cleanup */
 
-    free(ret);
+    pproxy_object_pool_put_connection(&worker->object_pool, ret);
     return -1;
 }
 
+int pproxy_connection_can_migrate(struct pproxy_connection *conn) {
+    /* Tunnels are just a pair of bufferevents, or of sockets forwarded in
+     * the kernel; anything else, including rate limiting, is bound to its
+     * worker's event base */
+    return conn->state == CONN_DIRECT &&
+        !pproxy_connection_handle_is_shaped(&conn->cb_handle) &&
+        !pproxy_timer_pending(&conn->cb_handle.timer) &&
+        !pproxy_timer_pending(&conn->timeout);
+}
+
+void pproxy_connection_detach(struct pproxy_connection *conn,
+        struct pproxy_worker *to) {
+    assert(pproxy_connection_can_migrate(conn));
+
+    /* Disabling the bufferevents removes their events from the base,
+     * which is required to re-home them. Buffered data is retained, and
+     * so are reads paused for backpressure, once attached. */
+    conn->source_events = bufferevent_get_enabled(conn->source_state.bev);
+    conn->target_events = bufferevent_get_enabled(conn->target_state.bev);
+    bufferevent_disable(conn->source_state.bev, EV_READ | EV_WRITE);
+    bufferevent_disable(conn->target_state.bev, EV_READ | EV_WRITE);
+
+    pproxy_migration_remove_tunnel(conn->worker, conn);
+    ATOMIC_ADD(&conn->worker->active_connections, -1);
+
+    bufferevent_base_set(to->base, conn->source_state.bev);
+    bufferevent_base_set(to->base, conn->target_state.bev);
+    switch (conn->tunnel_engine) {
+    case PPROXY_TUNNEL_SPLICE:
+        pproxy_splice_detach(&conn->offload.splice, to->base);
+        break;
+    case PPROXY_TUNNEL_SOCKMAP:
+        pproxy_sockmap_link_detach(&conn->offload.sockmap_link, to->base);
+        break;
+    default:
+        break;
+    }
+
+    conn->worker = to;
+    ATOMIC_ADD(&to->active_connections, 1);
+}
+
+void pproxy_connection_attach(struct pproxy_connection *conn) {
+    pproxy_migration_add_tunnel(conn->worker, conn);
+
+    switch (conn->tunnel_engine) {
+    case PPROXY_TUNNEL_SPLICE:
+        pproxy_splice_attach(&conn->offload.splice);
+        return;
+    case PPROXY_TUNNEL_SOCKMAP:
+        pproxy_sockmap_link_attach(&conn->offload.sockmap_link);
+        return;
+    default:
+        break;
+    }
+
+    bufferevent_enable(conn->source_state.bev, conn->source_events);
+    bufferevent_enable(conn->target_state.bev, conn->target_events);
+}
+
 struct pproxy_connection* pproxy_cb_handle_connection(
         struct pproxy_connection_handle *handle) {
     return (struct pproxy_connection*) (((char *)handle)
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Bandwidth limits on client connections, through libevent's rate
+ * limiting of the client bufferevent.
+ *
+ * A connection's own limit is a token bucket configuration owned by its
+ * handle, which must outlive the bufferevent's use of it. Groups are
+ * defined on the proxy, and each worker creates its own instance of a
+ * group on its event base the first time one of its connections joins,
+ * so that no bufferevent is refilled from another thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "pproxy/callbacks.h"
+#include "pproxy-internal.h"
+
+static void bucket_for_rate(size_t rate, int tick_ms, size_t *per_tick) {
+    if (rate == 0) {
+        *per_tick = EV_RATE_LIMIT_MAX;
+        return;
+    }
+    *per_tick = rate / 1000 * tick_ms + rate % 1000 * tick_ms / 1000;
+    if (*per_tick == 0) {
+        *per_tick = 1;
+    } else if (*per_tick > EV_RATE_LIMIT_MAX) {
+        *per_tick = EV_RATE_LIMIT_MAX;
+    }
+}
+
+struct ev_token_bucket_cfg *pproxy_rate_limit_cfg(
+        const struct pproxy_options *options, size_t read_rate,
+        size_t write_rate) {
+    size_t read_per_tick, write_per_tick;
+    bucket_for_rate(read_rate, options->timer_tick_ms, &read_per_tick);
+    bucket_for_rate(write_rate, options->timer_tick_ms, &write_per_tick);
+
+    /* A tick's worth can be sent at once, but no more is saved up */
+    struct timeval tick = { options->timer_tick_ms / 1000,
+        (options->timer_tick_ms % 1000) * 1000 };
+    return ev_token_bucket_cfg_new(read_per_tick, read_per_tick,
+        write_per_tick, write_per_tick, &tick);
+}
+
+static int find_group(struct pproxy *handle, const char *name) {
+    int i;
+    for (i = 0; i < handle->num_rate_groups; ++i) {
+        if (strcmp(handle->rate_groups[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* @return the worker's instance of the group, or NULL on error */
+static struct bufferevent_rate_limit_group *worker_group(
+        struct pproxy_worker *worker, int index) {
+    struct pproxy *handle = worker->handle;
+    if (!worker->rate_groups) {
+        worker->rate_groups = (struct bufferevent_rate_limit_group**) calloc(
+            handle->num_rate_groups, sizeof(*worker->rate_groups));
+        if (!worker->rate_groups) {
+            return NULL;
+        }
+    }
+
+    if (!worker->rate_groups[index]) {
+        struct pproxy_rate_group *group = &handle->rate_groups[index];
+        struct ev_token_bucket_cfg *cfg = pproxy_rate_limit_cfg(
+            &handle->options, group->read_rate, group->write_rate);
+        if (!cfg) {
+            return NULL;
+        }
+        /* The group keeps a copy of the configuration */
+        worker->rate_groups[index] = bufferevent_rate_limit_group_new(
+            worker->base, cfg);
+        ev_token_bucket_cfg_free(cfg);
+    }
+
+    return worker->rate_groups[index];
+}
+
+void pproxy_worker_rate_groups_free(struct pproxy_worker *worker) {
+    if (!worker->rate_groups) {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < worker->handle->num_rate_groups; ++i) {
+        if (worker->rate_groups[i]) {
+            bufferevent_rate_limit_group_free(worker->rate_groups[i]);
+        }
+    }
+    free(worker->rate_groups);
+    worker->rate_groups = NULL;
+}
+
+void pproxy_rate_groups_free(struct pproxy *handle) {
+    int i;
+    for (i = 0; i < handle->num_rate_groups; ++i) {
+        free(handle->rate_groups[i].name);
+    }
+    free(handle->rate_groups);
+    handle->rate_groups = NULL;
+    handle->num_rate_groups = 0;
+}
+
+int pproxy_conn_set_rate_limit(struct pproxy_connection_handle *handle,
+        size_t read_rate, size_t write_rate) {
+    if (!handle) {
+        return -1;
+    }
+
+    struct pproxy_connection *conn = pproxy_cb_handle_connection(handle);
+    if (conn->tunnel_engine != PPROXY_TUNNEL_BUFFERED) {
+        /* Already forwarded by the kernel */
+        return -1;
+    }
+
+    struct ev_token_bucket_cfg *cfg = NULL;
+    if (read_rate != 0 || write_rate != 0) {
+        cfg = pproxy_rate_limit_cfg(&conn->handle->options, read_rate,
+            write_rate);
+        if (!cfg) {
+            return -1;
+        }
+    }
+
+    if (bufferevent_set_rate_limit(conn->source_state.bev, cfg)) {
+        if (cfg) {
+            ev_token_bucket_cfg_free(cfg);
+        }
+        return -1;
+    }
+
+    if (handle->rate_limit) {
+        ev_token_bucket_cfg_free(handle->rate_limit);
+    }
+    handle->rate_limit = cfg;
+    return 0;
+}
+
+int pproxy_define_rate_limit_group(struct pproxy *handle, const char *name,
+        size_t read_rate, size_t write_rate) {
+    if (!handle || !name) {
+        return -1;
+    }
+
+    FENCE();
+    if (handle->run_state != PROXY_INIT) {
+        return -1;
+    }
+
+    int index = find_group(handle, name);
+    if (index == -1) {
+        struct pproxy_rate_group *groups = (struct pproxy_rate_group*)
+            realloc(handle->rate_groups,
+                (handle->num_rate_groups + 1) * sizeof(*groups));
+        if (!groups) {
+            return -1;
+        }
+        handle->rate_groups = groups;
+
+        char *copy = strdup(name);
+        if (!copy) {
+            return -1;
+        }
+        index = handle->num_rate_groups++;
+        groups[index].name = copy;
+    }
+
+    handle->rate_groups[index].read_rate = read_rate;
+    handle->rate_groups[index].write_rate = write_rate;
+    return 0;
+}
+
+int pproxy_conn_join_rate_limit_group(struct pproxy_connection_handle *handle,
+        const char *name) {
+    if (!handle || !name) {
+        return -1;
+    }
+
+    struct pproxy_connection *conn = pproxy_cb_handle_connection(handle);
+    if (conn->tunnel_engine != PPROXY_TUNNEL_BUFFERED) {
+        return -1;
+    }
+
+    int index = find_group(conn->handle, name);
+    if (index == -1) {
+        return -1;
+    }
+
+    struct bufferevent_rate_limit_group *group = worker_group(conn->worker,
+        index);
+    if (!group ||
+            bufferevent_add_to_rate_limit_group(conn->source_state.bev,
+                group)) {
+        return -1;
+    }
+
+    handle->rate_limit_grouped = 1;
+    return 0;
+}
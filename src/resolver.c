@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Per-worker hostname cache in front of evdns.
+ *
+ * Entries hold the address list returned by evdns_getaddrinfo, or the error
+ * for names that do not exist, until they expire. evdns_getaddrinfo does not
+ * report record TTLs, so entries live for the configured positive or
+ * negative TTL. While a lookup is in flight its entry collects waiters, so
+ * that concurrent requests for one name share a single query. Each waiter
+ * gives up after the DNS deadline, though the query continues on behalf of
+ * the cache. The cache is bounded; the least recently used settled entry is
+ * evicted to make room.
+ */
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/dns.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "pproxy-internal.h"
+
+struct pproxy_dns_entry {
+    struct pproxy_resolver *resolver;
+    char *host;
+    unsigned long hash;
+    /* lookup in flight, or NULL once settled */
+    struct evdns_getaddrinfo_request *request;
+    struct pproxy_resolve_waiter *waiters;
+    /* settled result */
+    int error;
+    struct evutil_addrinfo *addrs;
+    struct timeval expires;
+    struct pproxy_dns_entry *bucket_next;
+    struct pproxy_dns_entry *lru_next;
+    struct pproxy_dns_entry *lru_prev;
+};
+
+/* FNV-1a */
+static unsigned long hash_host(const char *host) {
+    unsigned long hash = 2166136261UL;
+    for (; *host; ++host) {
+        hash ^= (unsigned char) *host;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static void lru_unlink(struct pproxy_resolver *resolver,
+        struct pproxy_dns_entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        resolver->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        resolver->lru_tail = entry->lru_prev;
+    }
+    entry->lru_next = entry->lru_prev = NULL;
+}
+
+static void lru_push(struct pproxy_resolver *resolver,
+        struct pproxy_dns_entry *entry) {
+    entry->lru_next = resolver->lru_head;
+    if (resolver->lru_head) {
+        resolver->lru_head->lru_prev = entry;
+    } else {
+        resolver->lru_tail = entry;
+    }
+    resolver->lru_head = entry;
+}
+
+static struct pproxy_dns_entry* find_entry(struct pproxy_resolver *resolver,
+        const char *host, unsigned long hash) {
+    struct pproxy_dns_entry *entry =
+        resolver->buckets[hash & (resolver->num_buckets - 1)];
+    for (; entry; entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Unlinks and releases a settled entry */
+static void remove_entry(struct pproxy_resolver *resolver,
+        struct pproxy_dns_entry *entry) {
+    assert(!entry->request);
+
+    struct pproxy_dns_entry **link =
+        &resolver->buckets[entry->hash & (resolver->num_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    lru_unlink(resolver, entry);
+    --resolver->size;
+
+    if (entry->addrs) {
+        evutil_freeaddrinfo(entry->addrs);
+    }
+    free(entry->host);
+    free(entry);
+}
+
+/* Evicts the least recently used settled entry, if there is one */
+static void evict_entry(struct pproxy_resolver *resolver) {
+    struct pproxy_dns_entry *entry = resolver->lru_tail;
+    while (entry && entry->request) {
+        entry = entry->lru_prev;
+    }
+    if (entry) {
+        remove_entry(resolver, entry);
+    }
+}
+
+static int is_expired(struct pproxy_dns_entry *entry) {
+    struct timeval now;
+    event_base_gettimeofday_cached(entry->resolver->worker->base, &now);
+    return evutil_timercmp(&now, &entry->expires, >=);
+}
+
+static void set_expiry(struct pproxy_dns_entry *entry, int ttl_ms) {
+    struct timeval ttl = { ttl_ms / 1000, (ttl_ms % 1000) * 1000 };
+    event_base_gettimeofday_cached(entry->resolver->worker->base,
+        &entry->expires);
+    evutil_timeradd(&entry->expires, &ttl, &entry->expires);
+}
+
+/* Only authoritative answers that the name does not exist are cached */
+static int is_negative_result(int result) {
+    switch (result) {
+    case EVUTIL_EAI_NONAME:
+#if defined(EVUTIL_EAI_NODATA)
+    case EVUTIL_EAI_NODATA:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void lookup_cb(int result, struct evutil_addrinfo *addrs, void *arg) {
+    struct pproxy_dns_entry *entry = (struct pproxy_dns_entry*) arg;
+    struct pproxy_resolver *resolver = entry->resolver;
+    const struct pproxy_options *options = &resolver->worker->handle->options;
+
+    if (result == EVUTIL_EAI_CANCEL) {
+        /* The resolver is being torn down; it frees the entry */
+        return;
+    }
+
+    entry->request = NULL;
+    entry->error = result;
+    entry->addrs = result == 0 ? addrs : NULL;
+    if (result == 0) {
+        set_expiry(entry, options->dns_cache_ttl_ms);
+    } else if (is_negative_result(result)) {
+        set_expiry(entry, options->dns_negative_ttl_ms);
+    }
+    /* Otherwise the failure may be transient, and the zeroed expiry makes
+     * the next lookup of the name retry */
+
+    /* Waiters may cancel one another (e.g. by freeing connections), so
+     * unlink each before invoking it */
+    while (entry->waiters) {
+        struct pproxy_resolve_waiter *waiter = entry->waiters;
+        pproxy_resolver_cancel(waiter);
+        (*waiter->cb)(result, entry->addrs, waiter->arg);
+    }
+}
+
+static void deadline_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+    struct pproxy_resolve_waiter *waiter = (struct pproxy_resolve_waiter*) arg;
+    log_debug("DNS lookup of %s timed out\n", waiter->entry->host);
+    pproxy_resolver_cancel(waiter);
+    (*waiter->cb)(EVUTIL_EAI_AGAIN, NULL, waiter->arg);
+}
+
+int pproxy_resolver_init(struct pproxy_resolver *resolver,
+        struct pproxy_worker *worker) {
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->worker = worker;
+
+    /* Aim for an average chain length below one */
+    resolver->num_buckets = 16;
+    while (resolver->num_buckets <
+            (unsigned long) worker->handle->options.dns_cache_size) {
+        resolver->num_buckets <<= 1;
+    }
+
+    resolver->buckets = (struct pproxy_dns_entry**) calloc(
+        resolver->num_buckets, sizeof(struct pproxy_dns_entry*));
+    if (!resolver->buckets) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void pproxy_resolver_free(struct pproxy_resolver *resolver) {
+    if (!resolver->buckets) {
+        return;
+    }
+
+    while (resolver->lru_head) {
+        struct pproxy_dns_entry *entry = resolver->lru_head;
+        if (entry->request) {
+            evdns_getaddrinfo_cancel(entry->request);
+            entry->request = NULL;
+        }
+        remove_entry(resolver, entry);
+    }
+
+    free(resolver->buckets);
+    resolver->buckets = NULL;
+}
+
+/* Returns a settled entry's result, or queues the waiter on its lookup */
+static int settled_result(struct pproxy_resolver *resolver,
+        struct pproxy_dns_entry *entry,
+        struct pproxy_resolve_waiter *waiter, struct evutil_addrinfo **addrs) {
+    if (!entry->request) {
+        if (entry->error) {
+            log_debug("DNS error for %s: %s\n", entry->host,
+                evutil_gai_strerror(entry->error));
+            return -1;
+        }
+        *addrs = entry->addrs;
+        return 0;
+    }
+
+    /* Join the lookup in flight */
+    int ms = resolver->worker->handle->options.dns_timeout_ms;
+    struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+    waiter->deadline = evtimer_new(resolver->worker->base, deadline_cb,
+        waiter);
+    if (!waiter->deadline || evtimer_add(waiter->deadline, &timeout)) {
+        if (waiter->deadline) {
+            event_free(waiter->deadline);
+            waiter->deadline = NULL;
+        }
+        return -1;
+    }
+
+    waiter->entry = entry;
+    waiter->prev = NULL;
+    waiter->next = entry->waiters;
+    if (entry->waiters) {
+        entry->waiters->prev = waiter;
+    }
+    entry->waiters = waiter;
+    return 1;
+}
+
+int pproxy_resolver_resolve(struct pproxy_resolver *resolver,
+        const char *host, struct pproxy_resolve_waiter *waiter,
+        struct evutil_addrinfo **addrs) {
+    const struct pproxy_options *options = &resolver->worker->handle->options;
+    unsigned long hash = hash_host(host);
+
+    struct pproxy_dns_entry *entry = find_entry(resolver, host, hash);
+    if (entry && !entry->request && is_expired(entry)) {
+        remove_entry(resolver, entry);
+        entry = NULL;
+    }
+
+    if (entry) {
+        lru_unlink(resolver, entry);
+        lru_push(resolver, entry);
+
+        return settled_result(resolver, entry, waiter, addrs);
+    }
+
+    if (resolver->size >= options->dns_cache_size) {
+        evict_entry(resolver);
+    }
+
+    entry = (struct pproxy_dns_entry*) calloc(1, sizeof(*entry));
+    if (!entry) {
+        return -1;
+    }
+    entry->resolver = resolver;
+    entry->hash = hash;
+    entry->host = strdup(host);
+    if (!entry->host) {
+        free(entry);
+        return -1;
+    }
+
+    struct pproxy_dns_entry **bucket =
+        &resolver->buckets[hash & (resolver->num_buckets - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    lru_push(resolver, entry);
+    ++resolver->size;
+
+    struct evutil_addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    /* A placeholder marks the lookup as in flight; numeric hosts and hosts
+     * file entries complete within the call, settling the entry */
+    entry->request = (struct evdns_getaddrinfo_request*) entry;
+    struct evdns_getaddrinfo_request *request = evdns_getaddrinfo(
+        resolver->worker->dns_base, host, NULL, &hints, lookup_cb, entry);
+    if (entry->request) {
+        if (!request) {
+            /* Should be unreachable; evdns reports errors via callback */
+            entry->request = NULL;
+            entry->error = EVUTIL_EAI_FAIL;
+            return -1;
+        }
+        entry->request = request;
+    }
+
+    return settled_result(resolver, entry, waiter, addrs);
+}
+
+void pproxy_resolver_cancel(struct pproxy_resolve_waiter *waiter) {
+    struct pproxy_dns_entry *entry = waiter->entry;
+    if (!entry) {
+        return;
+    }
+
+    event_free(waiter->deadline);
+    waiter->deadline = NULL;
+
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        entry->waiters = waiter->next;
+    }
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    }
+    waiter->entry = NULL;
+    waiter->next = waiter->prev = NULL;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Kernel-offloaded tunnels on Linux. Both sockets of a tunnel are placed in
+ * a BPF sockhash whose sk_skb verdict program redirects every received skb
+ * to the other socket, so tunnel bytes never reach user space. Each socket
+ * is keyed by its peer's socket cookie: the program looks up the cookie of
+ * the socket that received the skb and gets the socket to send it on.
+ *
+ * The program is built from raw instructions, so no BPF toolchain or
+ * library is needed:
+ *
+ *     r6 = r1
+ *     r0 = bpf_get_socket_cookie(skb)
+ *     *(u64 *)(r10 - 8) = r0
+ *     return bpf_sk_redirect_hash(skb, &sockhash, r10 - 8, 0)
+ *
+ * The proxy only watches the sockets for close.
+ */
+
+#if defined(__linux__)
+#include <linux/bpf.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "pproxy-internal.h"
+
+#if defined(__linux__)
+
+#if !defined(SO_COOKIE)
+#define SO_COOKIE 57
+#endif
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), \
+        .off = (o), .imm = (i) })
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int load_program(int map_fd) {
+    struct bpf_insn insns[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+        INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        /* 64-bit immediate load of the map; spans two instructions */
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0,
+            map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    static const char kLicense[] = "Dual MIT/GPL";
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t) (uintptr_t) insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (uint64_t) (uintptr_t) kLicense;
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+int pproxy_sockmap_init(struct pproxy_sockmap *sockmap, int max_entries) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size = sizeof(uint64_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = max_entries;
+    sockmap->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (sockmap->map_fd < 0) {
+        log_debug("Failed to create sockhash: %s\n", strerror(errno));
+        sockmap->map_fd = -1;
+        return -1;
+    }
+
+    for (;;) {
+        sockmap->prog_fd = load_program(sockmap->map_fd);
+        if (sockmap->prog_fd < 0) {
+            log_debug("Failed to load sk_skb program: %s\n",
+                strerror(errno));
+            sockmap->prog_fd = -1;
+            break;
+        }
+
+        memset(&attr, 0, sizeof(attr));
+        attr.target_fd = sockmap->map_fd;
+        attr.attach_bpf_fd = sockmap->prog_fd;
+        attr.attach_type = BPF_SK_SKB_VERDICT;
+        if (sys_bpf(BPF_PROG_ATTACH, &attr)) {
+            log_debug("Failed to attach sk_skb program: %s\n",
+                strerror(errno));
+            break;
+        }
+
+        return 0;
+    }
+
+    /* cleanup */
+
+    pproxy_sockmap_free(sockmap);
+    return -1;
+}
+
+void pproxy_sockmap_free(struct pproxy_sockmap *sockmap) {
+    if (sockmap->prog_fd != -1) {
+        close(sockmap->prog_fd);
+        sockmap->prog_fd = -1;
+    }
+    if (sockmap->map_fd != -1) {
+        close(sockmap->map_fd);
+        sockmap->map_fd = -1;
+    }
+}
+
+static int update_elem(int map_fd, uint64_t key, int fd) {
+    union bpf_attr attr;
+    uint32_t value = (uint32_t) fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t) (uintptr_t) &key;
+    attr.value = (uint64_t) (uintptr_t) &value;
+    attr.flags = BPF_NOEXIST;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void delete_elem(int map_fd, uint64_t key) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t) (uintptr_t) &key;
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static void close_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) what;
+    struct pproxy_sockmap_link *link = (struct pproxy_sockmap_link *) arg;
+
+    /* Received bytes are redirected before the socket is reported
+     * readable, so only an EOF or an error is visible here */
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    /* The tunnel closes with either side, as on the buffered path. The
+     * callback is expected to free the link. */
+    (*link->cb)(link->arg);
+}
+
+int pproxy_sockmap_link_start(struct pproxy_sockmap_link *link,
+        struct pproxy_sockmap *sockmap, struct event_base *base,
+        evutil_socket_t a, evutil_socket_t b, pproxy_tunnel_close_cb cb,
+        void *arg) {
+    memset(link, 0, sizeof(*link));
+
+    if (sockmap->prog_fd == -1) {
+        return -1;
+    }
+
+    link->sockmap = sockmap;
+    link->fds[0] = a;
+    link->fds[1] = b;
+    link->cb = cb;
+    link->arg = arg;
+
+    for (int i = 0; i < 2; ++i) {
+        socklen_t len = sizeof(link->cookies[i]);
+        if (getsockopt(link->fds[i], SOL_SOCKET, SO_COOKIE,
+                &link->cookies[i], &len)) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        link->events[i] = event_new(base, link->fds[i], EV_READ | EV_PERSIST,
+            close_cb, link);
+        if (!link->events[i]) {
+            pproxy_sockmap_link_free(link);
+            return -1;
+        }
+    }
+
+    /* Each socket is found by the cookie of the socket it receives for */
+    if (update_elem(sockmap->map_fd, link->cookies[0], link->fds[1])) {
+        log_debug("Failed to add tunnel to sockhash: %s\n", strerror(errno));
+        pproxy_sockmap_link_free(link);
+        return -1;
+    }
+    if (update_elem(sockmap->map_fd, link->cookies[1], link->fds[0])) {
+        log_debug("Failed to add tunnel to sockhash: %s\n", strerror(errno));
+        delete_elem(sockmap->map_fd, link->cookies[0]);
+        pproxy_sockmap_link_free(link);
+        return -1;
+    }
+    link->active = 1;
+
+    /* Bytes that arrived before the sockets were added sit in the receive
+     * queue until the next skb; lowering SO_RCVLOWAT runs the verdict
+     * program over them now */
+    int one = 1;
+    setsockopt(a, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+    setsockopt(b, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+
+    pproxy_sockmap_link_attach(link);
+
+    return 0;
+}
+
+void pproxy_sockmap_link_free(struct pproxy_sockmap_link *link) {
+    for (int i = 0; i < 2; ++i) {
+        if (link->events[i]) {
+            event_free(link->events[i]);
+            link->events[i] = 0;
+        }
+    }
+    if (link->active) {
+        /* Closing the sockets would also remove them */
+        delete_elem(link->sockmap->map_fd, link->cookies[0]);
+        delete_elem(link->sockmap->map_fd, link->cookies[1]);
+        link->active = 0;
+    }
+}
+
+void pproxy_sockmap_link_detach(struct pproxy_sockmap_link *link,
+        struct event_base *to) {
+    for (int i = 0; i < 2; ++i) {
+        event_del(link->events[i]);
+        event_base_set(to, link->events[i]);
+    }
+}
+
+void pproxy_sockmap_link_attach(struct pproxy_sockmap_link *link) {
+    event_add(link->events[0], NULL);
+    event_add(link->events[1], NULL);
+}
+
+#else /* !__linux__ */
+
+int pproxy_sockmap_init(struct pproxy_sockmap *sockmap, int max_entries) {
+    sockmap->map_fd = -1;
+    sockmap->prog_fd = -1;
+    return -1;
+}
+
+void pproxy_sockmap_free(struct pproxy_sockmap *sockmap) {
+}
+
+int pproxy_sockmap_link_start(struct pproxy_sockmap_link *link,
+        struct pproxy_sockmap *sockmap, struct event_base *base,
+        evutil_socket_t a, evutil_socket_t b, pproxy_tunnel_close_cb cb,
+        void *arg) {
+    memset(link, 0, sizeof(*link));
+    return -1;
+}
+
+void pproxy_sockmap_link_free(struct pproxy_sockmap_link *link) {
+}
+
+void pproxy_sockmap_link_detach(struct pproxy_sockmap_link *link,
+        struct event_base *to) {
+}
+
+void pproxy_sockmap_link_attach(struct pproxy_sockmap_link *link) {
+}
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Socket-to-socket tunnel forwarding with splice(2). Each direction of the
+ * tunnel has a pipe; bytes are spliced from the readable socket into the
+ * pipe and from the pipe into the other socket, so tunnel payload never
+ * enters user memory. A direction stops reading while its pipe holds bytes
+ * that the destination socket cannot yet accept.
+ *
+ * Only Linux provides splice(); elsewhere pproxy_splice_start fails and the
+ * tunnel stays on the buffered path.
+ */
+
+#if defined(__linux__)
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "pproxy-internal.h"
+
+#if defined(__linux__)
+
+/* bytes moved per splice; the default pipe capacity */
+#define SPLICE_CHUNK (1 << 16)
+
+static void splice_read_cb(evutil_socket_t fd, short what, void *arg);
+static void splice_write_cb(evutil_socket_t fd, short what, void *arg);
+
+static void free_half(struct pproxy_splice_half *half) {
+    if (half->read_event) {
+        event_free(half->read_event);
+        half->read_event = 0;
+    }
+    if (half->write_event) {
+        event_free(half->write_event);
+        half->write_event = 0;
+    }
+    if (half->pipe[0] != -1) {
+        close(half->pipe[0]);
+        close(half->pipe[1]);
+        half->pipe[0] = half->pipe[1] = -1;
+    }
+}
+
+static int init_half(struct pproxy_splice_half *half,
+        struct pproxy_splice *splice, struct event_base *base,
+        evutil_socket_t from, evutil_socket_t to) {
+    half->splice = splice;
+    half->from = from;
+    half->to = to;
+    half->pending = 0;
+
+    if (pipe2(half->pipe, O_NONBLOCK | O_CLOEXEC)) {
+        half->pipe[0] = half->pipe[1] = -1;
+        return -1;
+    }
+
+    half->read_event = event_new(base, from, EV_READ | EV_PERSIST,
+        splice_read_cb, half);
+    half->write_event = event_new(base, to, EV_WRITE | EV_PERSIST,
+        splice_write_cb, half);
+    if (!half->read_event || !half->write_event) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Waits for whichever socket the direction is blocked on */
+static void arm_half(struct pproxy_splice_half *half) {
+    if (half->pending) {
+        event_del(half->read_event);
+        event_add(half->write_event, NULL);
+    } else {
+        event_del(half->write_event);
+        event_add(half->read_event, NULL);
+    }
+}
+
+static void close_splice(struct pproxy_splice_half *half) {
+    struct pproxy_splice *splice = half->splice;
+    /* The callback is expected to free the splice */
+    (*splice->cb)(splice->arg);
+}
+
+/* @return 0 unless the destination socket failed */
+static int flush_half(struct pproxy_splice_half *half) {
+    while (half->pending) {
+        ssize_t n = splice(half->pipe[0], NULL, half->to, NULL, half->pending,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            log_debug("Tunnel splice to socket failed: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        half->pending -= (size_t) n;
+    }
+    return 0;
+}
+
+static void splice_read_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+    struct pproxy_splice_half *half = (struct pproxy_splice_half *) arg;
+
+    ssize_t n = splice(half->from, NULL, half->pipe[1], NULL, SPLICE_CHUNK,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+        /* Nothing is left in the pipe, since we only read into an empty
+         * one; the tunnel closes with either side, as on the buffered path */
+        close_splice(half);
+        return;
+    } else if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        log_debug("Tunnel splice from socket failed: %s\n", strerror(errno));
+        close_splice(half);
+        return;
+    }
+
+    half->pending = (size_t) n;
+    if (flush_half(half)) {
+        close_splice(half);
+        return;
+    }
+    if (half->pending) {
+        arm_half(half);
+    }
+}
+
+static void splice_write_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+    struct pproxy_splice_half *half = (struct pproxy_splice_half *) arg;
+
+    if (flush_half(half)) {
+        close_splice(half);
+        return;
+    }
+    if (!half->pending) {
+        arm_half(half);
+    }
+}
+
+int pproxy_splice_start(struct pproxy_splice *splice, struct event_base *base,
+        evutil_socket_t a, evutil_socket_t b, pproxy_tunnel_close_cb cb,
+        void *arg) {
+    memset(splice, 0, sizeof(*splice));
+    splice->halves[0].pipe[0] = splice->halves[0].pipe[1] = -1;
+    splice->halves[1].pipe[0] = splice->halves[1].pipe[1] = -1;
+    splice->cb = cb;
+    splice->arg = arg;
+
+    if (init_half(&splice->halves[0], splice, base, a, b) ||
+            init_half(&splice->halves[1], splice, base, b, a)) {
+        free_half(&splice->halves[0]);
+        free_half(&splice->halves[1]);
+        return -1;
+    }
+
+    splice->active = 1;
+    arm_half(&splice->halves[0]);
+    arm_half(&splice->halves[1]);
+
+    return 0;
+}
+
+void pproxy_splice_free(struct pproxy_splice *splice) {
+    if (!splice->active) {
+        return;
+    }
+    free_half(&splice->halves[0]);
+    free_half(&splice->halves[1]);
+    splice->active = 0;
+}
+
+void pproxy_splice_detach(struct pproxy_splice *splice,
+        struct event_base *to) {
+    for (int i = 0; i < 2; ++i) {
+        struct pproxy_splice_half *half = &splice->halves[i];
+        event_del(half->read_event);
+        event_del(half->write_event);
+        event_base_set(to, half->read_event);
+        event_base_set(to, half->write_event);
+    }
+}
+
+void pproxy_splice_attach(struct pproxy_splice *splice) {
+    arm_half(&splice->halves[0]);
+    arm_half(&splice->halves[1]);
+}
+
+#else /* !__linux__ */
+
+int pproxy_splice_start(struct pproxy_splice *splice, struct event_base *base,
+        evutil_socket_t a, evutil_socket_t b, pproxy_tunnel_close_cb cb,
+        void *arg) {
+    memset(splice, 0, sizeof(*splice));
+    return -1;
+}
+
+void pproxy_splice_free(struct pproxy_splice *splice) {
+}
+
+void pproxy_splice_detach(struct pproxy_splice *splice,
+        struct event_base *to) {
+}
+
+void pproxy_splice_attach(struct pproxy_splice *splice) {
+}
+
+#endif
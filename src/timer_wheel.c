@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Connections each carry a pause timer and a timeout that is rescheduled on
+ * nearly every read, so timers are embedded in the structures they time
+ * and kept on per-worker wheels rather than in libevent's heap: scheduling
+ * and cancelling are constant time and never allocate. Time advances in
+ * coarse ticks, driven by one persistent libevent timer that runs only
+ * while timers are scheduled.
+ *
+ * The first level has a slot per tick. Each further level has slots that
+ * span a whole turn of the level below; when a lower level wraps around,
+ * the next slot of the level above is cascaded down. Timers beyond the top
+ * level's range are parked in its farthest slot and placed again when they
+ * come up.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "pproxy-internal.h"
+
+/* farthest a timer can be placed from the next tick */
+#define MAX_DELTA ((UINT64_C(1) << (PPROXY_WHEEL_BITS + \
+    PPROXY_WHEEL_LEVELS * PPROXY_WHEEL_LEVEL_BITS)) - 1)
+
+static uint64_t current_tick(struct pproxy_timer_wheel *wheel) {
+    struct timeval now, elapsed;
+    event_base_gettimeofday_cached(wheel->worker->base, &now);
+    if (evutil_timercmp(&now, &wheel->origin, <)) {
+        return 0;
+    }
+    evutil_timersub(&now, &wheel->origin, &elapsed);
+    uint64_t ms = (uint64_t) elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+    return ms / wheel->tick_ms;
+}
+
+static void link_timer(struct pproxy_timer **slot, struct pproxy_timer *timer) {
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(struct pproxy_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void place_timer(struct pproxy_timer_wheel *wheel,
+        struct pproxy_timer *timer) {
+    uint64_t delta = timer->expires - wheel->next_tick;
+    uint64_t at = timer->expires;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        at = wheel->next_tick + MAX_DELTA;
+    }
+
+    if (delta < PPROXY_WHEEL_SIZE) {
+        link_timer(&wheel->slots[at & (PPROXY_WHEEL_SIZE - 1)], timer);
+        return;
+    }
+
+    int shift = PPROXY_WHEEL_BITS;
+    int level;
+    for (level = 0; level < PPROXY_WHEEL_LEVELS - 1; ++level) {
+        if (delta < UINT64_C(1) << (shift + PPROXY_WHEEL_LEVEL_BITS)) {
+            break;
+        }
+        shift += PPROXY_WHEEL_LEVEL_BITS;
+    }
+    link_timer(&wheel->levels[level][(at >> shift) &
+        (PPROXY_WHEEL_LEVEL_SIZE - 1)], timer);
+}
+
+/* Moves a level's slot into the levels below */
+static void cascade(struct pproxy_timer_wheel *wheel, int level,
+        size_t index) {
+    struct pproxy_timer *list = wheel->levels[level][index];
+    wheel->levels[level][index] = NULL;
+    if (list) {
+        list->pprev = &list;
+    }
+    while (list) {
+        struct pproxy_timer *timer = list;
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+    }
+}
+
+static void run_tick(struct pproxy_timer_wheel *wheel) {
+    uint64_t tick = wheel->next_tick;
+    size_t index = tick & (PPROXY_WHEEL_SIZE - 1);
+
+    int shift = PPROXY_WHEEL_BITS;
+    int level;
+    for (level = 0; index == 0 && level < PPROXY_WHEEL_LEVELS; ++level) {
+        index = (tick >> shift) & (PPROXY_WHEEL_LEVEL_SIZE - 1);
+        cascade(wheel, level, index);
+        shift += PPROXY_WHEEL_LEVEL_BITS;
+    }
+
+    /* Callbacks can cancel any timer, including those in this list */
+    index = tick & (PPROXY_WHEEL_SIZE - 1);
+    struct pproxy_timer *list = wheel->slots[index];
+    wheel->slots[index] = NULL;
+    if (list) {
+        list->pprev = &list;
+    }
+    wheel->next_tick = tick + 1;
+
+    while (list) {
+        struct pproxy_timer *timer = list;
+        unlink_timer(timer);
+        if (timer->expires > tick) {
+            /* Parked beyond the top level's range */
+            place_timer(wheel, timer);
+            continue;
+        }
+        --wheel->count;
+        (*timer->cb)(timer);
+    }
+}
+
+static void tick_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+    struct pproxy_timer_wheel *wheel = (struct pproxy_timer_wheel*) arg;
+
+    uint64_t now = current_tick(wheel);
+    while (wheel->count > 0 && wheel->next_tick <= now) {
+        run_tick(wheel);
+    }
+
+    if (wheel->count == 0) {
+        event_del(wheel->tick_event);
+    }
+}
+
+int pproxy_timer_wheel_init(struct pproxy_timer_wheel *wheel,
+        struct pproxy_worker *worker) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->worker = worker;
+    wheel->tick_ms = worker->handle->options.timer_tick_ms;
+    event_base_gettimeofday_cached(worker->base, &wheel->origin);
+
+    wheel->tick_event = event_new(worker->base, -1, EV_PERSIST, tick_cb,
+        wheel);
+    if (!wheel->tick_event) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void pproxy_timer_wheel_free(struct pproxy_timer_wheel *wheel) {
+    if (wheel->tick_event) {
+        event_free(wheel->tick_event);
+        wheel->tick_event = NULL;
+    }
+}
+
+void pproxy_timer_init(struct pproxy_timer *timer, pproxy_timer_cb cb) {
+    memset(timer, 0, sizeof(*timer));
+    timer->cb = cb;
+}
+
+void pproxy_timer_schedule(struct pproxy_timer_wheel *wheel,
+        struct pproxy_timer *timer, int ms) {
+    pproxy_timer_cancel(wheel, timer);
+
+    uint64_t now = current_tick(wheel);
+    if (!event_pending(wheel->tick_event, EV_TIMEOUT, NULL)) {
+        /* Nothing is scheduled, so the wheel can skip ahead */
+        struct timeval interval = { wheel->tick_ms / 1000,
+            (wheel->tick_ms % 1000) * 1000 };
+        wheel->next_tick = now;
+        event_add(wheel->tick_event, &interval);
+    }
+
+    /* Rounded up, plus a tick since the current one has partly elapsed */
+    timer->expires = now + (ms + wheel->tick_ms - 1) / wheel->tick_ms + 1;
+    if (timer->expires < wheel->next_tick) {
+        timer->expires = wheel->next_tick;
+    }
+
+    place_timer(wheel, timer);
+    ++wheel->count;
+}
+
+void pproxy_timer_cancel(struct pproxy_timer_wheel *wheel,
+        struct pproxy_timer *timer) {
+    if (!pproxy_timer_pending(timer)) {
+        return;
+    }
+    unlink_timer(timer);
+    assert(wheel->count > 0);
+    --wheel->count;
+}
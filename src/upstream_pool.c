@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2015 Nathan Rosenblum <flander@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Pool of idle keep-alive connections to targets.
+ *
+ * Each worker keeps its own pool, so pooled bufferevents always belong to the
+ * worker's event base and need no locking. Connections are keyed by the host
+ * and port from the request URL; a hit skips both the DNS lookup and the TCP
+ * handshake. Idle connections are closed when they expire, when the target
+ * closes them, or when they are evicted to make room for a newer one.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "pproxy-internal.h"
+
+/* As libevent's internal EVUTIL_ERR_RW_RETRIABLE */
+#if defined(_WIN32)
+#define ERR_RW_RETRIABLE(e) ((e) == WSAEWOULDBLOCK || (e) == WSAEINTR)
+#else
+#define ERR_RW_RETRIABLE(e) ((e) == EINTR || (e) == EAGAIN || \
+    (e) == EWOULDBLOCK)
+#endif
+
+static void unlink_entry(struct pproxy_upstream_pool *pool,
+        struct pproxy_pooled_upstream *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        pool->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        pool->tail = entry->prev;
+    }
+    entry->next = entry->prev = NULL;
+    --pool->size;
+}
+
+/* Releases the entry, but not its bufferevent */
+static void free_entry(struct pproxy_pooled_upstream *entry) {
+    if (entry->expiry) {
+        event_free(entry->expiry);
+    }
+    free(entry->host);
+    free(entry);
+}
+
+static void close_entry(struct pproxy_upstream_pool *pool,
+        struct pproxy_pooled_upstream *entry) {
+    unlink_entry(pool, entry);
+    pproxy_object_pool_put_bufferevent(&pool->worker->object_pool,
+        entry->bev);
+    free_entry(entry);
+}
+
+static void expiry_cb(evutil_socket_t fd, short what, void *arg) {
+    (void) fd;
+    (void) what;
+    struct pproxy_pooled_upstream *entry =
+        (struct pproxy_pooled_upstream*) arg;
+    close_entry(entry->pool, entry);
+}
+
+/* Idle connections should be silent; data or EOF means it is unusable */
+static void idle_read_cb(struct bufferevent *bev, void *ctx) {
+    (void) bev;
+    struct pproxy_pooled_upstream *entry = (struct pproxy_pooled_upstream*) ctx;
+    log_debug("Closing pooled connection to %s:%hu on unexpected data\n",
+        entry->host, entry->port);
+    close_entry(entry->pool, entry);
+}
+
+static void idle_event_cb(struct bufferevent *bev, short what, void *ctx) {
+    (void) bev;
+    (void) what;
+    struct pproxy_pooled_upstream *entry = (struct pproxy_pooled_upstream*) ctx;
+    close_entry(entry->pool, entry);
+}
+
+static int matches(struct pproxy_pooled_upstream *entry, const char *host,
+        uint16_t port) {
+    return entry->port == port && strcmp(entry->host, host) == 0;
+}
+
+/* Catches a close, an error or stray data that the event loop hasn't
+ * delivered yet. The socket is nonblocking, so only an idle connection
+ * fails the read with a retriable error. */
+static int is_idle(struct pproxy_pooled_upstream *entry) {
+    char c;
+    if (recv(bufferevent_getfd(entry->bev), &c, 1, MSG_PEEK) >= 0) {
+        return 0;
+    }
+    return ERR_RW_RETRIABLE(EVUTIL_SOCKET_ERROR());
+}
+
+void pproxy_upstream_pool_init(struct pproxy_upstream_pool *pool,
+        struct pproxy_worker *worker) {
+    memset(pool, 0, sizeof(*pool));
+    pool->worker = worker;
+}
+
+void pproxy_upstream_pool_free(struct pproxy_upstream_pool *pool) {
+    while (pool->head) {
+        close_entry(pool, pool->head);
+    }
+}
+
+struct bufferevent* pproxy_upstream_pool_get(struct pproxy_upstream_pool *pool,
+        const char *host, uint16_t port) {
+    struct pproxy_pooled_upstream *entry = pool->head;
+    while (entry) {
+        struct pproxy_pooled_upstream *next = entry->next;
+        if (matches(entry, host, port)) {
+            if (is_idle(entry)) {
+                break;
+            }
+            close_entry(pool, entry);
+        }
+        entry = next;
+    }
+    if (!entry) {
+        return NULL;
+    }
+
+    struct bufferevent *bev = entry->bev;
+    unlink_entry(pool, entry);
+    free_entry(entry);
+
+    bufferevent_disable(bev, EV_READ | EV_WRITE);
+    bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+    return bev;
+}
+
+int pproxy_upstream_pool_put(struct pproxy_upstream_pool *pool,
+        struct bufferevent *bev, const char *host, uint16_t port) {
+    const struct pproxy_options *options = &pool->worker->handle->options;
+    if (options->upstream_pool_size == 0) {
+        return -1;
+    }
+
+    /* Make room, preferring to evict this target's least recently used
+     * connection so that other targets keep theirs */
+    int per_host = 0;
+    struct pproxy_pooled_upstream *oldest = NULL;
+    struct pproxy_pooled_upstream *entry;
+    for (entry = pool->head; entry; entry = entry->next) {
+        if (matches(entry, host, port)) {
+            ++per_host;
+            oldest = entry;
+        }
+    }
+    if (per_host >= options->upstream_pool_per_host) {
+        close_entry(pool, oldest);
+    } else if (pool->size >= options->upstream_pool_size) {
+        close_entry(pool, pool->tail);
+    }
+
+    for (;;) {
+        entry = (struct pproxy_pooled_upstream*) calloc(1, sizeof(*entry));
+        if (!entry) {
+            break;
+        }
+        entry->pool = pool;
+        entry->port = port;
+
+        entry->host = strdup(host);
+        if (!entry->host) {
+            break;
+        }
+
+        entry->expiry = evtimer_new(pool->worker->base, expiry_cb, entry);
+        if (!entry->expiry) {
+            break;
+        }
+
+        struct timeval timeout = {
+            options->upstream_idle_timeout_ms / 1000,
+            (options->upstream_idle_timeout_ms % 1000) * 1000
+        };
+        if (evtimer_add(entry->expiry, &timeout)) {
+            break;
+        }
+
+        entry->bev = bev;
+        bufferevent_setcb(bev, idle_read_cb, NULL, idle_event_cb, entry);
+        bufferevent_disable(bev, EV_WRITE);
+        bufferevent_enable(bev, EV_READ);
+
+        entry->next = pool->head;
+        if (pool->head) {
+            pool->head->prev = entry;
+        } else {
+            pool->tail = entry;
+        }
+        pool->head = entry;
+        ++pool->size;
+
+        return 0;
+    }
+
+    if (entry) {
+        free_entry(entry);
+    }
+
+    return -1;
+}
@@ -20,13 +20,17 @@
  * SOFTWARE.
  */
 
+#include <atomic>
 #include <chrono>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
 #include "pproxy/callbacks.h"
 #include "pproxy/pproxy.h"
+#include "pproxy-internal.h"
 
 #include "util.h"
 
@@ -34,6 +38,9 @@
 
 namespace test {
 
+// libevent's cached time comes from a coarse clock that can trail ours
+static const std::chrono::milliseconds kClockSlack(10);
+
 class PproxyTest : public ::testing::Test {
 public:
     PproxyTest() : proxy_host("127.0.0.1"), handle(nullptr) { }
@@ -151,6 +158,1540 @@ TEST_F(PproxyTest, TestPut) {
     ASSERT_EQ(eret, pret);
 }
 
+TEST_F(PproxyTest, TestLargePut) {
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    // Spans many input chains, which are forwarded as they arrive
+    std::string body(8 << 20, 'x');
+    for (size_t i = 0; i < body.size(); i += 4096) {
+        body[i] = 'a' + (i / 4096) % 26;
+    }
+
+    HttpClient proxyClient("127.0.0.1", echo.port(), proxy.port());
+    auto pret = proxyClient.put("", body);
+    ASSERT_EQ(200, pret.first);
+    ASSERT_EQ("PUT " + body, pret.second);
+}
+
+TEST_F(PproxyTest, TestMultipleWorkers) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.num_workers = 4;
+
+    struct pproxy *mt_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&mt_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(mt_handle);
+        proxy.start();
+
+        HttpClient proxyClient("127.0.0.1", echo.port(), proxy.port());
+        for (int i = 0; i < 16; ++i) {
+            auto ret = proxyClient.get("");
+            ASSERT_EQ(200, ret.first);
+            ASSERT_EQ("GET", ret.second);
+        }
+    }
+
+    pproxy_free(mt_handle);
+}
+
+TEST_F(PproxyTest, TestHandoffWorkers) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.num_workers = 4;
+    options.accept_mode = PPROXY_ACCEPT_HANDOFF;
+    options.balance_policy = PPROXY_BALANCE_LEAST_LOADED;
+
+    struct pproxy *mt_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&mt_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(mt_handle);
+        proxy.start();
+
+        HttpClient proxyClient("127.0.0.1", echo.port(), proxy.port());
+        for (int i = 0; i < 16; ++i) {
+            auto ret = proxyClient.get("");
+            ASSERT_EQ(200, ret.first);
+            ASSERT_EQ("GET", ret.second);
+        }
+    }
+
+    pproxy_free(mt_handle);
+}
+
+static std::string absoluteGet(int16_t port, std::string const& extra = "") {
+    std::string target = "127.0.0.1:" +
+        std::to_string(static_cast<uint16_t>(port));
+    return "GET http://" + target + "/ HTTP/1.1\r\nHost: " + target +
+        "\r\n" + extra + "\r\n";
+}
+
+TEST_F(PproxyTest, TestKeepAlive) {
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    RawClient client(proxy.port());
+    for (int i = 0; i < 3; ++i) {
+        client.send(absoluteGet(echo.port()));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+        ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+    }
+}
+
+TEST_F(PproxyTest, TestConnectionClose) {
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    RawClient client(proxy.port());
+    client.send(absoluteGet(echo.port(), "Connection: close\r\n"));
+    auto resp = client.readResponse();
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    ASSERT_TRUE(client.closed());
+}
+
+static std::string absolutePut(int16_t port, std::string const& body) {
+    std::string target = "127.0.0.1:" +
+        std::to_string(static_cast<uint16_t>(port));
+    return "PUT http://" + target + "/ HTTP/1.1\r\nHost: " + target +
+        "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+        body;
+}
+
+TEST_F(PproxyTest, TestPipelinedRequests) {
+    RawServer target;
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.max_pipeline_depth = 4;
+
+    struct pproxy *pl_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&pl_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(pl_handle);
+        proxy.start();
+
+        // The target only responds once it has seen all three requests,
+        // which requires that the proxy forward them without waiting
+        auto responder = runAsync<bool>([&target]() -> bool {
+                auto conn = target.accept();
+                for (int i = 0; i < 3; ++i) {
+                    conn->readRequest();
+                }
+                for (auto const& body : {"a", "b", "c"}) {
+                    conn->send(std::string("HTTP/1.1 200 OK\r\n"
+                        "Content-Length: 1\r\n\r\n") + body);
+                }
+                return true;
+            });
+
+        RawClient client(proxy.port());
+        client.send(absolutePut(target.port(), "a") +
+            absoluteGet(target.port()) + absolutePut(target.port(), "c"));
+        for (auto const& body : {"a", "b", "c"}) {
+            auto resp = client.readResponse();
+            ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+            ASSERT_EQ(body, resp.substr(resp.size() - 1));
+        }
+        ASSERT_TRUE(responder.get());
+    }
+
+    pproxy_free(pl_handle);
+}
+
+TEST_F(PproxyTest, TestPipelinedRequestsSerialized) {
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    // With the default depth, pipelined requests are answered in order but
+    // forwarded to the target one at a time
+    RawClient client(proxy.port());
+    client.send(absoluteGet(echo.port()) + absolutePut(echo.port(), "x") +
+        absoluteGet(echo.port(), "Connection: close\r\n"));
+    auto resp = client.readResponse();
+    ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+    resp = client.readResponse();
+    ASSERT_EQ("PUT x", resp.substr(resp.size() - 5));
+    resp = client.readResponse();
+    ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+    ASSERT_TRUE(client.closed());
+}
+
+static std::string okResponse(std::string const& body) {
+    return "HTTP/1.1 200 OK\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+TEST_F(PproxyTest, TestUpstreamPool) {
+    RawServer target;
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.upstream_pool_size = 4;
+
+    struct pproxy *pool_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&pool_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(pool_handle);
+        proxy.start();
+
+        // The target accepts a single connection, so the requests from both
+        // clients must share it
+        auto responder = runAsync<bool>([&target]() -> bool {
+                auto conn = target.accept();
+                for (auto const& body : {"a", "b"}) {
+                    conn->readRequest();
+                    conn->send(okResponse(body));
+                }
+                return true;
+            });
+
+        for (auto const& body : {"a", "b"}) {
+            RawClient client(proxy.port());
+            client.send(absoluteGet(target.port()));
+            auto resp = client.readResponse();
+            ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+            ASSERT_EQ(body, resp.substr(resp.size() - 1));
+        }
+        ASSERT_TRUE(responder.get());
+    }
+
+    pproxy_free(pool_handle);
+}
+
+TEST_F(PproxyTest, TestChunkedResponse) {
+    RawServer target;
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    std::string chunk(70000, 'c');
+    auto responder = runAsync<bool>([&target, &chunk]() -> bool {
+            auto conn = target.accept();
+            conn->readRequest();
+            // Split within the chunks and their framing, so that forwarding
+            // stops and resumes inside body data
+            std::string resp = "HTTP/1.1 200 OK\r\n"
+                "Transfer-Encoding: chunked\r\n\r\n"
+                "11170\r\n" + chunk + "\r\n5\r\nhello\r\n0\r\n\r\n";
+            for (size_t off = 0; off < resp.size(); off += 9000) {
+                conn->send(resp.substr(off, 9000));
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            // Without pooling, the next request gets a new connection
+            conn = target.accept();
+            conn->readRequest();
+            conn->send(okResponse("next"));
+            return true;
+        });
+
+    RawClient client(proxy.port());
+    client.send(absoluteGet(target.port()));
+    auto resp = client.readUntil("\r\n0\r\n\r\n");
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    ASSERT_NE(std::string::npos, resp.find("\r\n\r\n11170\r\n" + chunk +
+        "\r\n5\r\nhello\r\n0\r\n\r\n"));
+
+    // The response was framed correctly, so the connection persists
+    client.send(absoluteGet(target.port()));
+    resp = client.readResponse();
+    ASSERT_EQ("next", resp.substr(resp.size() - 4));
+    ASSERT_TRUE(responder.get());
+}
+
+// Accepts a request and sends a response with a body of the given size,
+// counting the bytes as the target's socket takes them
+static std::future<bool> respondLarge(RawServer &target,
+        std::atomic<size_t> &sent, size_t size) {
+    return runAsync<bool>([&target, &sent, size]() -> bool {
+            auto conn = target.accept();
+            conn->readRequest();
+            conn->send("HTTP/1.1 200 OK\r\nContent-Length: " +
+                std::to_string(size) + "\r\n\r\n");
+            std::string chunk(64 * 1024, 'b');
+            while (sent < size) {
+                conn->send(chunk);
+                sent += chunk.size();
+            }
+            return true;
+        });
+}
+
+// Waits for the target's writes to block
+static void waitForStall(std::atomic<size_t> &sent) {
+    size_t last = 0;
+    for (int i = 0; i < 100; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (sent > 0 && sent == last) {
+            break;
+        }
+        last = sent;
+    }
+}
+
+static size_t bodySize(std::string const& resp) {
+    return resp.size() - resp.find("\r\n\r\n") - 4;
+}
+
+TEST_F(PproxyTest, TestBackpressure) {
+    RawServer target;
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.output_high_watermark = 64 * 1024;
+    options.output_low_watermark = 16 * 1024;
+
+    struct pproxy *bp_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&bp_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(bp_handle);
+        proxy.start();
+
+        // Far more than the socket buffers between the target and the
+        // client can hold
+        const size_t kBodySize = 64 << 20;
+        std::atomic<size_t> sent(0);
+        auto responder = respondLarge(target, sent, kBodySize);
+
+        RawClient client(proxy.port());
+        client.send(absoluteGet(target.port()));
+
+        // The client doesn't read, so the proxy stops reading the response
+        waitForStall(sent);
+        ASSERT_LT(sent.load(), kBodySize / 2);
+
+        // Reading resumes as the client catches up
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+        ASSERT_EQ(kBodySize, bodySize(resp));
+        ASSERT_TRUE(responder.get());
+    }
+
+    pproxy_free(bp_handle);
+}
+
+static void pauseResponseCallback(struct pproxy_connection_handle *handle) {
+    struct timeval pause = { 0, 300 * 1000 };
+    pproxy_conn_insert_pause(handle, &pause);
+}
+
+TEST_F(PproxyTest, TestPausedResponseIsNotBuffered) {
+    RawServer target;
+
+    // Without watermarks, only the pause can hold the response back
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.output_high_watermark = 0;
+
+    struct pproxy *pause_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&pause_handle, proxy_host, 0, &options));
+    struct pproxy_callbacks callbacks = { NULL, NULL, pauseResponseCallback };
+    ASSERT_SUCCESS(pproxy_set_callbacks(pause_handle, &callbacks));
+
+    {
+        PproxyServer proxy(pause_handle);
+        proxy.start();
+
+        const size_t kBodySize = 64 << 20;
+        std::atomic<size_t> sent(0);
+        auto responder = respondLarge(target, sent, kBodySize);
+
+        auto start = std::chrono::steady_clock::now();
+        RawClient client(proxy.port());
+        client.send(absoluteGet(target.port()));
+
+        // The proxy doesn't read the response while paused, although the
+        // client is reading
+        auto reader = runAsync<std::string>([&client]() -> std::string {
+                return client.readResponse();
+            });
+        waitForStall(sent);
+        ASSERT_LT(sent.load(), kBodySize / 2);
+
+        auto resp = reader.get();
+        ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(300));
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+        ASSERT_EQ(kBodySize, bodySize(resp));
+        ASSERT_TRUE(responder.get());
+    }
+
+    pproxy_free(pause_handle);
+}
+
+TEST_F(PproxyTest, TestSimdParser) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.parser_backend = PPROXY_PARSER_SIMD;
+
+    struct pproxy *simd_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&simd_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(simd_handle);
+        proxy.start();
+
+        HttpClient proxyClient("127.0.0.1", echo.port(), proxy.port());
+        auto pret = proxyClient.get("");
+        ASSERT_EQ(200, pret.first);
+        ASSERT_EQ("GET", pret.second);
+        pret = proxyClient.put("", "zomg");
+        ASSERT_EQ(200, pret.first);
+        ASSERT_EQ("PUT zomg", pret.second);
+
+        // Heads and chunk framing split across reads
+        RawClient client(proxy.port());
+        std::string get = absoluteGet(echo.port());
+        for (size_t off = 0; off < get.size(); off += 7) {
+            client.send(get.substr(off, 7));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto resp = client.readResponse();
+        ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+
+        std::string target = "127.0.0.1:" +
+            std::to_string(static_cast<uint16_t>(echo.port()));
+        std::string put = "PUT http://" + target + "/ HTTP/1.1\r\n"
+            "Host: " + target + "\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "3\r\nabc\r\nA\r\ndefghijklm\r\n0\r\n\r\n";
+        for (size_t off = 0; off < put.size(); off += 5) {
+            client.send(put.substr(off, 5));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        resp = client.readResponse();
+        ASSERT_EQ("PUT abcdefghijklm", resp.substr(resp.size() - 17));
+
+        client.send(absoluteGet(echo.port(), "Connection: close\r\n"));
+        resp = client.readResponse();
+        ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+        ASSERT_TRUE(client.closed());
+
+        RawClient bad(proxy.port());
+        bad.send("BOGUS / HTTP/1.1\r\n\r\n");
+        ASSERT_TRUE(bad.closed());
+    }
+
+    pproxy_free(simd_handle);
+}
+
+static enum http_errno parseHead(int backend, std::string const& head) {
+    static const struct pproxy_parser_callbacks callbacks = {};
+    struct pproxy_parser parser;
+    pproxy_parser_init(&parser, HTTP_REQUEST, backend, &callbacks, nullptr);
+    pproxy_parser_execute(&parser, head.data(), head.size());
+    enum http_errno ret = pproxy_parser_errno(&parser);
+    pproxy_parser_free(&parser);
+    return ret;
+}
+
+TEST_F(PproxyTest, TestSimdParserFraming) {
+    const std::string line = "POST http://localhost/ HTTP/1.1\r\n";
+    struct {
+        std::string headers;
+        enum http_errno expected;
+        // whether http_parser refuses it the same way; it is laxer with
+        // folded lines
+        bool compare;
+    } cases[] = {
+        { "Content-Length: 3\r\nTransfer-Encoding: chunked\r\n",
+          PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH, true },
+        { "Transfer-Encoding: chunked\r\nContent-Length: 3\r\n",
+          PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH, true },
+        { "Content-Length: 3\r\nContent-Length: 3\r\n",
+          PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH, true },
+        { "Content-Length: 3\r\nContent-Length: 30\r\n",
+          PPROXY_HPE_UNEXPECTED_CONTENT_LENGTH, true },
+        { "Transfer-Encoding: gzip\r\n",
+          PPROXY_HPE_INVALID_TRANSFER_ENCODING, true },
+        { "Transfer-Encoding: chunked, gzip\r\n",
+          PPROXY_HPE_INVALID_TRANSFER_ENCODING, true },
+        { "Content-Length: 3\r\n 4\r\n", HPE_INVALID_HEADER_TOKEN, false },
+        { "Transfer-Encoding: gzip,\r\n chunked\r\n",
+          HPE_INVALID_HEADER_TOKEN, false },
+        { " Content-Length: 3\r\n", HPE_INVALID_HEADER_TOKEN, false },
+    };
+
+    for (auto const& c : cases) {
+        std::string head = line + c.headers + "\r\n";
+        ASSERT_EQ(c.expected, parseHead(PPROXY_PARSER_SIMD, head)) << head;
+        if (PPROXY_HTTP_PARSER_STRICT_FRAMING && c.compare) {
+            ASSERT_EQ(c.expected,
+                parseHead(PPROXY_PARSER_HTTP_PARSER, head)) << head;
+        }
+    }
+
+    // Folding is still allowed in headers that don't frame the message
+    ASSERT_EQ(HPE_OK, parseHead(PPROXY_PARSER_SIMD,
+        line + "X-Folded: a\r\n b\r\nContent-Length: 0\r\n\r\n"));
+    ASSERT_EQ(HPE_OK, parseHead(PPROXY_PARSER_SIMD,
+        line + "Transfer-Encoding: gzip, chunked\r\n\r\n"));
+}
+
+TEST_F(PproxyTest, TestObjectPool) {
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    // Each closed connection leaves its structure and its client and target
+    // bufferevents for the next one
+    for (int i = 0; i < 3; ++i) {
+        RawClient client(proxy.port());
+        client.send(absoluteGet(echo.port(), "Connection: close\r\n"));
+        auto resp = client.readResponse();
+        ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+        ASSERT_TRUE(client.closed());
+    }
+
+    struct pproxy_pool_stats stats;
+    ASSERT_SUCCESS(pproxy_get_pool_stats(handle, &stats));
+    ASSERT_EQ(1, stats.connection_misses);
+    ASSERT_EQ(2, stats.connection_hits);
+    ASSERT_EQ(2, stats.bufferevent_misses);
+    ASSERT_EQ(4, stats.bufferevent_hits);
+}
+
+TEST_F(PproxyTest, TestAllocatorStats) {
+    struct pproxy_allocator_stats stats[64];
+    if (pproxy_get_allocator_stats(stats, 64) < 0) {
+        return; // the arenas are only installed by test_arena
+    }
+
+    long long before = pproxy_allocator_thread_bytes();
+    struct event_base *base = event_base_new();
+    ASSERT_LT(before, pproxy_allocator_thread_bytes());
+    event_base_free(base);
+    ASSERT_EQ(before, pproxy_allocator_thread_bytes());
+
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    HttpClient proxyClient("127.0.0.1", echo.port(), proxy.port());
+    ASSERT_EQ(200, proxyClient.get("").first);
+
+    // The worker's allocations are in an arena of its own
+    int count = pproxy_get_allocator_stats(stats, 64);
+    ASSERT_LE(2, count);
+    int busy = 0;
+    for (int i = 0; i < count && i < 64; ++i) {
+        ASSERT_LE(stats[i].bytes_outstanding, stats[i].bytes_reserved);
+        if (stats[i].in_use && stats[i].bytes_outstanding > 0) {
+            ++busy;
+        }
+    }
+    ASSERT_LE(2, busy);
+}
+
+TEST_F(PproxyTest, TestUpstreamPoolExpiry) {
+    RawServer target;
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.upstream_pool_size = 4;
+    options.upstream_idle_timeout_ms = 50;
+
+    struct pproxy *pool_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&pool_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(pool_handle);
+        proxy.start();
+
+        auto responder = runAsync<bool>([&target]() -> bool {
+                auto conn = target.accept();
+                conn->readRequest();
+                conn->send(okResponse("a"));
+                // Pooled, then closed by the proxy once it expires
+                auto start = std::chrono::steady_clock::now();
+                return conn->closed() &&
+                    std::chrono::steady_clock::now() - start >=
+                        std::chrono::milliseconds(40);
+            });
+
+        RawClient client(proxy.port());
+        client.send(absoluteGet(target.port()));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+        ASSERT_TRUE(responder.get());
+    }
+
+    pproxy_free(pool_handle);
+}
+
+static std::string namedGet(std::string const& host, int16_t port) {
+    std::string target = host + ":" +
+        std::to_string(static_cast<uint16_t>(port));
+    return "GET http://" + target + "/ HTTP/1.1\r\nHost: " + target +
+        "\r\n\r\n";
+}
+
+TEST_F(PproxyTest, TestDnsCache) {
+    EchoServer echo;
+    echo.start();
+
+    DnsServer dns;
+    dns.start();
+    dns.configure(handle->workers[0].dns_base);
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    for (int i = 0; i < 2; ++i) {
+        RawClient client(proxy.port());
+        client.send(namedGet("origin.test", echo.port()));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    }
+    ASSERT_EQ(1, dns.queries("origin.test"));
+
+    // Nonexistent names are cached, too
+    for (int i = 0; i < 2; ++i) {
+        RawClient client(proxy.port());
+        client.send(namedGet("missing.test", echo.port()));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 502"));
+        ASSERT_TRUE(client.closed());
+    }
+    ASSERT_EQ(1, dns.queries("missing.test"));
+}
+
+TEST_F(PproxyTest, TestDnsSharedLookup) {
+    EchoServer echo;
+    echo.start();
+
+    DnsServer dns(/*delayMs=*/ 50);
+    dns.start();
+    dns.configure(handle->workers[0].dns_base);
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    // Both requests arrive while the lookup is outstanding
+    std::vector<std::unique_ptr<RawClient>> clients;
+    for (int i = 0; i < 2; ++i) {
+        clients.emplace_back(new RawClient(proxy.port()));
+        clients.back()->send(namedGet("shared.test", echo.port()));
+    }
+    for (auto& client : clients) {
+        auto resp = client->readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    }
+    ASSERT_EQ(1, dns.queries("shared.test"));
+}
+
+TEST_F(PproxyTest, TestConnectRacesAddresses) {
+    EchoServer echo;
+    echo.start();
+
+    DnsServer dns;
+    dns.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.connect_stagger_ms = 50;
+
+    struct pproxy *race_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&race_handle, proxy_host, 0, &options));
+    dns.configure(race_handle->workers[0].dns_base);
+
+    {
+        PproxyServer proxy(race_handle);
+        proxy.start();
+
+        // The first address never answers; the second attempt starts after
+        // the stagger delay and wins
+        BlackholeServer blackhole("127.0.0.2", echo.port());
+        auto start = std::chrono::steady_clock::now();
+        RawClient client(proxy.port());
+        client.send(namedGet("multi.test", echo.port()));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ASSERT_GE(elapsed + kClockSlack, std::chrono::milliseconds(50));
+        ASSERT_LT(elapsed, std::chrono::seconds(2));
+    }
+
+    pproxy_free(race_handle);
+}
+
+static int16_t unusedPort() {
+    RawServer server;
+    return server.port();
+}
+
+TEST_F(PproxyTest, TestConnectRefused) {
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    RawClient client(proxy.port());
+    client.send(absoluteGet(unusedPort()));
+    auto resp = client.readResponse();
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 502"));
+    ASSERT_TRUE(client.closed());
+}
+
+TEST_F(PproxyTest, TestConnectRetriesRefusedAddress) {
+    EchoServer echo;
+    echo.start();
+
+    DnsServer dns;
+    dns.start();
+    dns.configure(handle->workers[0].dns_base);
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    // Nothing listens on 127.0.0.2, so the first attempt is refused and the
+    // next address is tried without waiting for the stagger delay
+    auto start = std::chrono::steady_clock::now();
+    RawClient client(proxy.port());
+    client.send(namedGet("multi.test", echo.port()));
+    auto resp = client.readResponse();
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    ASSERT_LT(std::chrono::steady_clock::now() - start,
+        std::chrono::milliseconds(200));
+}
+
+TEST_F(PproxyTest, TestConnectTimeout) {
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.connect_timeout_ms = 50;
+
+    struct pproxy *timeout_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&timeout_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(timeout_handle);
+        proxy.start();
+
+        int16_t port = unusedPort();
+        BlackholeServer blackhole("127.0.0.1", port);
+
+        RawClient client(proxy.port());
+        client.send(absoluteGet(port));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 504"));
+        ASSERT_TRUE(client.closed());
+    }
+
+    pproxy_free(timeout_handle);
+}
+
+TEST_F(PproxyTest, TestHeaderLimits) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.read_timeout_ms = 5000;
+    options.header_timeout_ms = 200;
+    options.max_header_size = 1024;
+
+    struct pproxy *limit_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&limit_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(limit_handle);
+        proxy.start();
+
+        // A request line that trickles in never resets the deadline, and
+        // is answered although its url is incomplete
+        RawClient slow(proxy.port());
+        auto start = std::chrono::steady_clock::now();
+        std::string line = "GET http://127.0.0.1:" +
+            std::to_string(static_cast<uint16_t>(echo.port())) + "/";
+        // Sent well within the deadline, since writing after the proxy
+        // closes would raise SIGPIPE
+        for (char c : line) {
+            slow.send(std::string(1, c));
+            std::this_thread::sleep_for(std::chrono::milliseconds(4));
+        }
+        std::string response = slow.readResponse();
+        ASSERT_EQ(0u, response.find("HTTP/1.1 408")) << response;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ASSERT_GE(elapsed + kClockSlack, std::chrono::milliseconds(200));
+        ASSERT_LT(elapsed, std::chrono::seconds(2));
+        ASSERT_TRUE(slow.closed());
+
+        // Refused once the head outgrows the limit, even with a valid
+        // request line
+        RawClient large(proxy.port());
+        large.send(absoluteGet(echo.port(),
+            "X-Large: " + std::string(2048, 'x') + "\r\n"));
+        ASSERT_EQ(0u, large.readResponse().find("HTTP/1.1 431"));
+        ASSERT_TRUE(large.closed());
+
+        // Heads within both limits are unaffected
+        RawClient client(proxy.port());
+        client.send(absoluteGet(echo.port(),
+            "X-Small: " + std::string(512, 'x') + "\r\n"));
+        ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 200"));
+    }
+
+    pproxy_free(limit_handle);
+}
+
+TEST_F(PproxyTest, TestConnectionLimit) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.max_connections = 2;
+    options.connection_low_watermark = 1;
+
+    struct pproxy *limit_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&limit_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(limit_handle);
+        proxy.start();
+
+        std::unique_ptr<RawClient> first(new RawClient(proxy.port()));
+        RawClient second(proxy.port());
+        first->send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, first->readResponse().find("HTTP/1.1 200"));
+        second.send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, second.readResponse().find("HTTP/1.1 200"));
+
+        // The third client waits in the accept queue...
+        RawClient third(proxy.port());
+        third.send(absoluteGet(echo.port()));
+        auto response = runAsync<std::string>([&third]() -> std::string {
+                return third.readResponse();
+            });
+        ASSERT_EQ(std::future_status::timeout,
+            response.wait_for(std::chrono::milliseconds(200)));
+
+        // ...until the count falls to the low watermark
+        first.reset();
+        ASSERT_EQ(std::future_status::ready,
+            response.wait_for(std::chrono::seconds(2)));
+        ASSERT_EQ(0u, response.get().find("HTTP/1.1 200"));
+    }
+
+    pproxy_free(limit_handle);
+}
+
+TEST_F(PproxyTest, TestCodelShedding) {
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.codel_target_ms = 5;
+    options.codel_interval_ms = 100;
+
+    struct pproxy_codel codel = {};
+    auto at = [](long ms) -> struct timeval {
+        struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+        return tv;
+    };
+    auto sample = [&](long accepted_ms, long now_ms) {
+        struct timeval accepted = at(accepted_ms);
+        struct timeval now = at(now_ms);
+        pproxy_codel_sample(&codel, &options, &now, &accepted);
+    };
+    auto admit = [&](long now_ms) -> bool {
+        struct timeval now = at(now_ms);
+        return pproxy_codel_admit(&codel, &options, &now) == 0;
+    };
+
+    // A delay above the target must persist for an interval
+    sample(1000, 1010);
+    ASSERT_TRUE(admit(1050));
+    sample(1090, 1100);
+    ASSERT_TRUE(admit(1100));
+    sample(1100, 1110);
+    ASSERT_FALSE(admit(1110));
+
+    // Shedding is spaced by the interval over the root of the count
+    ASSERT_TRUE(admit(1200));
+    ASSERT_FALSE(admit(1210));
+    ASSERT_TRUE(admit(1300));
+    ASSERT_FALSE(admit(1310));
+    ASSERT_FALSE(admit(1410));
+    ASSERT_TRUE(admit(1450));
+    ASSERT_FALSE(admit(1460));
+
+    // One connection served within the target ends it
+    sample(1500, 1501);
+    ASSERT_TRUE(admit(1510));
+    ASSERT_TRUE(admit(2000));
+}
+
+static struct pproxy_client_addr clientAddr(uint32_t ip) {
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(ip);
+    struct pproxy_client_addr addr;
+    pproxy_client_addr_set(&addr,
+        reinterpret_cast<struct sockaddr*>(&saddr));
+    return addr;
+}
+
+static struct pproxy_client_addr clientAddr6(const char *ip) {
+    struct sockaddr_in6 saddr = {};
+    saddr.sin6_family = AF_INET6;
+    evutil_inet_pton(AF_INET6, ip, &saddr.sin6_addr);
+    struct pproxy_client_addr addr;
+    pproxy_client_addr_set(&addr,
+        reinterpret_cast<struct sockaddr*>(&saddr));
+    return addr;
+}
+
+TEST_F(PproxyTest, TestClientTable) {
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.client_max_connections = 1;
+    options.client_table_size = 4;
+
+    struct pproxy_client_table table;
+    ASSERT_SUCCESS(pproxy_client_table_init(&table, &options));
+    ASSERT_EQ(1u, table.num_shards);
+    struct pproxy_client_shard *shard = &table.shards[0];
+
+    // Churn through many more clients than fit, in an order that spreads
+    // them over the table and forces entries to shift on removal
+    const uint32_t kClients = 1000;
+    for (uint32_t i = 0; i < kClients; ++i) {
+        struct pproxy_client_addr addr = clientAddr(0x0a000000 + i * 7919);
+        ASSERT_SUCCESS(pproxy_client_connect(&table, &addr));
+        ASSERT_LE(shard->count, 4u);
+        if (i < kClients - 4) {
+            pproxy_client_disconnect(&table, &addr);
+        }
+    }
+
+    // The clients still connected are at their limit...
+    for (uint32_t i = kClients - 4; i < kClients; ++i) {
+        struct pproxy_client_addr addr = clientAddr(0x0a000000 + i * 7919);
+        ASSERT_EQ(-1, pproxy_client_connect(&table, &addr));
+    }
+    // ...and are not forgotten to make room for another
+    struct pproxy_client_addr other = clientAddr(0x0a000000);
+    ASSERT_EQ(-1, pproxy_client_connect(&table, &other));
+
+    struct pproxy_client_addr last = clientAddr(
+        0x0a000000 + (kClients - 1) * 7919);
+    pproxy_client_disconnect(&table, &last);
+    ASSERT_SUCCESS(pproxy_client_connect(&table, &other));
+    ASSERT_EQ(-1, pproxy_client_connect(&table, &last));
+
+    pproxy_client_table_free(&table);
+}
+
+TEST_F(PproxyTest, TestClientTableIPv6Prefix) {
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.client_max_connections = 1;
+    options.num_workers = 4;
+
+    struct pproxy_client_table table;
+    ASSERT_SUCCESS(pproxy_client_table_init(&table, &options));
+    ASSERT_LT(1u, table.num_shards);
+
+    struct pproxy_client_addr first = clientAddr6("2001:db8:0:1::1");
+    struct pproxy_client_addr same_prefix =
+        clientAddr6("2001:db8:0:1:ffff::2");
+    struct pproxy_client_addr other_prefix = clientAddr6("2001:db8:0:2::1");
+
+    // Addresses in one /64 are one client
+    ASSERT_SUCCESS(pproxy_client_connect(&table, &first));
+    ASSERT_EQ(-1, pproxy_client_connect(&table, &same_prefix));
+    ASSERT_SUCCESS(pproxy_client_connect(&table, &other_prefix));
+
+    pproxy_client_disconnect(&table, &first);
+    ASSERT_SUCCESS(pproxy_client_connect(&table, &same_prefix));
+
+    pproxy_client_table_free(&table);
+}
+
+TEST_F(PproxyTest, TestClientLimits) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.client_request_rate = 1;
+    options.client_request_burst = 3;
+    options.client_max_connections = 2;
+
+    struct pproxy *limit_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&limit_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(limit_handle);
+        proxy.start();
+
+        RawClient first(proxy.port());
+        RawClient second(proxy.port());
+        first.send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, first.readResponse().find("HTTP/1.1 200"));
+        second.send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, second.readResponse().find("HTTP/1.1 200"));
+
+        // A third concurrent connection is refused outright
+        RawClient third(proxy.port());
+        ASSERT_EQ(0u, third.readResponse().find("HTTP/1.1 429"));
+        ASSERT_TRUE(third.closed());
+
+        // The burst is spent after one more request
+        first.send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, first.readResponse().find("HTTP/1.1 200"));
+        first.send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, first.readResponse().find("HTTP/1.1 429"));
+        ASSERT_TRUE(first.closed());
+    }
+
+    pproxy_free(limit_handle);
+}
+
+TEST_F(PproxyTest, TestClientRequestChargedOnce) {
+    EchoServer echo;
+    echo.start();
+    EchoServer other;
+    other.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.client_request_rate = 1;
+    options.client_request_burst = 2;
+    options.max_pipeline_depth = 4;
+
+    struct pproxy *limit_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&limit_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(limit_handle);
+        proxy.start();
+
+        // The second request waits for the first, as it is for another
+        // target, and is parsed again then without spending a second token
+        RawClient client(proxy.port());
+        client.send(absoluteGet(echo.port()) + absoluteGet(other.port()));
+        ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 200"));
+        ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 200"));
+
+        client.send(absoluteGet(other.port()));
+        ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 429"));
+        ASSERT_TRUE(client.closed());
+    }
+
+    pproxy_free(limit_handle);
+}
+
+struct TestTimer {
+    struct pproxy_timer timer; // first, so that the callback can cast
+    struct event_base *base;
+    std::chrono::steady_clock::time_point deadline;
+    std::vector<int> *fired;
+    int id;
+    bool early;
+};
+
+static void testTimerCb(struct pproxy_timer *timer) {
+    TestTimer *t = reinterpret_cast<TestTimer*>(timer);
+    t->early = std::chrono::steady_clock::now() + kClockSlack < t->deadline;
+    t->fired->push_back(t->id);
+}
+
+TEST_F(PproxyTest, TestTimerWheel) {
+    // One millisecond ticks, so that the delays below span three levels
+    handle->options.timer_tick_ms = 1;
+    struct pproxy_worker worker = {};
+    worker.handle = handle;
+    worker.base = event_base_new();
+    struct pproxy_timer_wheel wheel;
+    ASSERT_SUCCESS(pproxy_timer_wheel_init(&wheel, &worker));
+
+    std::vector<int> fired;
+    const int kDelays[] = { 300, 5, 20000, 600, 10, 17000 };
+    const int kNumTimers = sizeof(kDelays) / sizeof(kDelays[0]);
+    TestTimer timers[kNumTimers];
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumTimers; ++i) {
+        pproxy_timer_init(&timers[i].timer, testTimerCb);
+        timers[i].deadline = start + std::chrono::milliseconds(kDelays[i]);
+        timers[i].fired = &fired;
+        timers[i].id = i;
+        timers[i].early = false;
+        pproxy_timer_schedule(&wheel, &timers[i].timer, kDelays[i]);
+    }
+    // Rescheduling moves a timer; cancelling removes it
+    pproxy_timer_schedule(&wheel, &timers[2].timer, 400);
+    timers[2].deadline = start + std::chrono::milliseconds(400);
+    pproxy_timer_cancel(&wheel, &timers[5].timer);
+    ASSERT_FALSE(pproxy_timer_pending(&timers[5].timer));
+    ASSERT_EQ(5, wheel.count);
+
+    // The loop exits once the wheel's tick event is removed
+    event_base_dispatch(worker.base);
+
+    ASSERT_EQ(std::vector<int>({ 1, 4, 0, 2, 3 }), fired);
+    for (int i = 0; i < kNumTimers; ++i) {
+        ASSERT_FALSE(timers[i].early);
+    }
+    ASSERT_EQ(0, wheel.count);
+
+    pproxy_timer_wheel_free(&wheel);
+    event_base_free(worker.base);
+}
+
+TEST_F(PproxyTest, TestTimeouts) {
+    EchoServer echo;
+    echo.start();
+    RawServer target;
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.idle_timeout_ms = 100;
+    options.read_timeout_ms = 100;
+    options.response_timeout_ms = 100;
+
+    struct pproxy *timeout_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&timeout_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(timeout_handle);
+        proxy.start();
+
+        // Idle between requests
+        RawClient idle(proxy.port());
+        idle.send(absoluteGet(echo.port()));
+        ASSERT_EQ(0u, idle.readResponse().find("HTTP/1.1 200"));
+        auto start = std::chrono::steady_clock::now();
+        ASSERT_TRUE(idle.closed());
+        ASSERT_GE(std::chrono::steady_clock::now() - start + kClockSlack,
+            std::chrono::milliseconds(100));
+
+        // Stalled in the request head
+        RawClient slow(proxy.port());
+        slow.send("GET http://127.0.0.1:" +
+            std::to_string(static_cast<uint16_t>(echo.port())) + "/ HTTP/1.1\r\n");
+        ASSERT_TRUE(slow.closed());
+
+        // No response from the target
+        auto silent = runAsync<bool>([&target]() -> bool {
+                auto conn = target.accept();
+                conn->readRequest();
+                return conn->closed();
+            });
+        RawClient waiting(proxy.port());
+        waiting.send(absoluteGet(target.port()));
+        ASSERT_EQ(0u, waiting.readResponse().find("HTTP/1.1 504"));
+        ASSERT_TRUE(waiting.closed());
+        ASSERT_TRUE(silent.get());
+    }
+
+    pproxy_free(timeout_handle);
+}
+
+TEST_F(PproxyTest, TestDnsTimeout) {
+    DnsServer dns(/*delayMs=*/ 1000);
+    dns.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.dns_timeout_ms = 50;
+
+    struct pproxy *timeout_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&timeout_handle, proxy_host, 0, &options));
+    dns.configure(timeout_handle->workers[0].dns_base);
+
+    {
+        PproxyServer proxy(timeout_handle);
+        proxy.start();
+
+        auto start = std::chrono::steady_clock::now();
+        RawClient client(proxy.port());
+        client.send(namedGet("slow.test", unusedPort()));
+        auto resp = client.readResponse();
+        ASSERT_EQ(0u, resp.find("HTTP/1.1 504"));
+        ASSERT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(500));
+    }
+
+    pproxy_free(timeout_handle);
+}
+
+static void openTunnel(RawClient &client, int16_t port) {
+    std::string target = "127.0.0.1:" +
+        std::to_string(static_cast<uint16_t>(port));
+    client.send("CONNECT " + target + " HTTP/1.1\r\nHost: " + target +
+        "\r\n\r\n");
+    auto resp = client.readResponse();
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+}
+
+static void getThroughTunnel(RawClient &client) {
+    client.send("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    auto resp = client.readResponse();
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    ASSERT_EQ("GET", resp.substr(resp.size() - 3));
+}
+
+static void limitDownlinkCallback(struct pproxy_connection_handle *handle) {
+    pproxy_conn_set_rate_limit(handle, 0, 256 * 1024);
+}
+
+TEST_F(PproxyTest, TestUrlEndingAtPort) {
+    EchoServer echo;
+    echo.start();
+
+    PproxyServer proxy(handle);
+    proxy.start();
+
+    std::string target = "127.0.0.1:" +
+        std::to_string(static_cast<uint16_t>(echo.port()));
+    std::string host = "Host: " + target + "\r\n\r\n";
+
+    // A long url leaves digits behind in the connection's url buffer, which
+    // must not be taken for part of a later url's port
+    RawClient client(proxy.port());
+    client.send("GET http://" + target + "/" + std::string(200, '9') +
+        " HTTP/1.1\r\n" + host);
+    ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 200"));
+
+    client.send("GET http://user@" + target + " HTTP/1.1\r\n" + host);
+    ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 200"));
+
+    client.send("CONNECT " + target + " HTTP/1.1\r\n" + host);
+    ASSERT_EQ(0u, client.readResponse().find("HTTP/1.1 200"));
+    getThroughTunnel(client);
+}
+
+TEST_F(PproxyTest, TestConnectionRateLimit) {
+    RawServer target;
+
+    struct pproxy *rl_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init(&rl_handle, proxy_host, 0));
+    struct pproxy_callbacks callbacks = { limitDownlinkCallback, NULL, NULL };
+    ASSERT_SUCCESS(pproxy_set_callbacks(rl_handle, &callbacks));
+
+    {
+        PproxyServer proxy(rl_handle);
+        proxy.start();
+
+        const size_t kBodySize = 128 * 1024;
+        std::atomic<size_t> sent(0);
+        auto responder = respondLarge(target, sent, kBodySize);
+
+        auto start = std::chrono::steady_clock::now();
+        RawClient client(proxy.port());
+        client.send(absoluteGet(target.port()));
+        auto resp = client.readResponse();
+        ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(400));
+        ASSERT_EQ(kBodySize, bodySize(resp));
+        ASSERT_TRUE(responder.get());
+    }
+
+    pproxy_free(rl_handle);
+}
+
+static void joinGroupCallback(struct pproxy_connection_handle *handle) {
+    ASSERT_SUCCESS(pproxy_conn_join_rate_limit_group(handle, "downlink"));
+}
+
+TEST_F(PproxyTest, TestRateLimitGroup) {
+    RawServer target;
+
+    // Shaped tunnels must stay buffered whatever the engine
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.tunnel_engine = PPROXY_TUNNEL_SPLICE;
+
+    struct pproxy *rl_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&rl_handle, proxy_host, 0, &options));
+    ASSERT_SUCCESS(pproxy_define_rate_limit_group(rl_handle, "downlink", 0,
+        256 * 1024));
+    struct pproxy_callbacks callbacks = { joinGroupCallback, NULL, NULL };
+    ASSERT_SUCCESS(pproxy_set_callbacks(rl_handle, &callbacks));
+
+    {
+        PproxyServer proxy(rl_handle);
+        proxy.start();
+        ASSERT_EQ(-1, pproxy_define_rate_limit_group(rl_handle, "late", 1, 1));
+
+        // Two tunnels share the group's rate
+        const size_t kBodySize = 128 * 1024;
+        std::atomic<size_t> sent[2];
+        std::vector<std::future<bool>> responders;
+        std::vector<std::unique_ptr<RawClient>> clients;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 2; ++i) {
+            sent[i] = 0;
+            responders.push_back(respondLarge(target, sent[i], kBodySize));
+            clients.emplace_back(new RawClient(proxy.port()));
+            openTunnel(*clients.back(), target.port());
+            clients.back()->send("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        }
+        for (auto &client : clients) {
+            ASSERT_EQ(kBodySize, bodySize(client->readResponse()));
+        }
+        ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(800));
+        for (auto &responder : responders) {
+            ASSERT_TRUE(responder.get());
+        }
+    }
+
+    pproxy_free(rl_handle);
+}
+
+TEST_F(PproxyTest, TestLatencySampling) {
+    const double kSamples[] = { 40, 10, 20 };
+    struct pproxy_latency_profile profile = {};
+    profile.phases[PPROXY_LATENCY_DNS].type = PPROXY_LATENCY_CONSTANT;
+    profile.phases[PPROXY_LATENCY_DNS].value_ms = 2.5;
+    profile.phases[PPROXY_LATENCY_CONNECT].type = PPROXY_LATENCY_UNIFORM;
+    profile.phases[PPROXY_LATENCY_CONNECT].value_ms = 10;
+    profile.phases[PPROXY_LATENCY_CONNECT].spread_ms = 20;
+    profile.phases[PPROXY_LATENCY_FIRST_BYTE].type = PPROXY_LATENCY_NORMAL;
+    profile.phases[PPROXY_LATENCY_FIRST_BYTE].value_ms = 50;
+    profile.phases[PPROXY_LATENCY_FIRST_BYTE].spread_ms = 10;
+    profile.phases[PPROXY_LATENCY_CHUNK].type = PPROXY_LATENCY_EMPIRICAL;
+    profile.phases[PPROXY_LATENCY_CHUNK].samples_ms = kSamples;
+    profile.phases[PPROXY_LATENCY_CHUNK].num_samples = 3;
+    profile.seed = 42;
+    ASSERT_SUCCESS(pproxy_define_latency_profile(handle, "mixed", &profile));
+
+    struct pproxy_latency_profile invalid = profile;
+    invalid.phases[PPROXY_LATENCY_CONNECT].spread_ms = -1;
+    ASSERT_EQ(-1, pproxy_define_latency_profile(handle, "invalid", &invalid));
+    invalid = profile;
+    invalid.phases[PPROXY_LATENCY_CHUNK].num_samples = 0;
+    ASSERT_EQ(-1, pproxy_define_latency_profile(handle, "invalid", &invalid));
+    ASSERT_EQ(-1, pproxy_set_latency_profile(handle, "invalid"));
+
+    int index = pproxy_latency_find(handle, "mixed");
+    ASSERT_NE(-1, index);
+    const struct pproxy_latency_profile *defined =
+        &handle->latency_profiles[index].profile;
+
+    // The same stream repeats its delays; another stream differs
+    struct pproxy_latency first = {}, again = {}, other = {};
+    first.stream = again.stream = 7;
+    other.stream = 8;
+    pproxy_latency_seed(&first, defined);
+    pproxy_latency_seed(&again, defined);
+    pproxy_latency_seed(&other, defined);
+
+    bool differs = false;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(3, pproxy_latency_sample(&first, PPROXY_LATENCY_DNS));
+        pproxy_latency_sample(&again, PPROXY_LATENCY_DNS);
+
+        int connect = pproxy_latency_sample(&first, PPROXY_LATENCY_CONNECT);
+        ASSERT_EQ(connect,
+            pproxy_latency_sample(&again, PPROXY_LATENCY_CONNECT));
+        ASSERT_GE(connect, 10);
+        ASSERT_LE(connect, 30);
+        differs = differs ||
+            connect != pproxy_latency_sample(&other, PPROXY_LATENCY_CONNECT);
+
+        int first_byte = pproxy_latency_sample(&first,
+            PPROXY_LATENCY_FIRST_BYTE);
+        ASSERT_EQ(first_byte,
+            pproxy_latency_sample(&again, PPROXY_LATENCY_FIRST_BYTE));
+        ASSERT_GE(first_byte, 0);
+
+        int chunk = pproxy_latency_sample(&first, PPROXY_LATENCY_CHUNK);
+        ASSERT_EQ(chunk, pproxy_latency_sample(&again, PPROXY_LATENCY_CHUNK));
+        ASSERT_GE(chunk, 10);
+        ASSERT_LE(chunk, 40);
+    }
+    ASSERT_TRUE(differs);
+}
+
+static std::atomic<bool> clearLatency(false);
+
+static void latencyCallback(struct pproxy_connection_handle *handle) {
+    if (clearLatency) {
+        ASSERT_SUCCESS(pproxy_conn_set_latency_profile(handle, NULL));
+    }
+}
+
+TEST_F(PproxyTest, TestLatencyProfile) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_latency_profile profile = {};
+    profile.phases[PPROXY_LATENCY_DNS].type = PPROXY_LATENCY_CONSTANT;
+    profile.phases[PPROXY_LATENCY_DNS].value_ms = 40;
+    profile.phases[PPROXY_LATENCY_CONNECT].type = PPROXY_LATENCY_CONSTANT;
+    profile.phases[PPROXY_LATENCY_CONNECT].value_ms = 40;
+    profile.phases[PPROXY_LATENCY_FIRST_BYTE].type = PPROXY_LATENCY_CONSTANT;
+    profile.phases[PPROXY_LATENCY_FIRST_BYTE].value_ms = 80;
+    ASSERT_SUCCESS(pproxy_define_latency_profile(handle, "slow", &profile));
+    ASSERT_SUCCESS(pproxy_set_latency_profile(handle, "slow"));
+    struct pproxy_callbacks callbacks = { latencyCallback, NULL, NULL };
+    ASSERT_SUCCESS(pproxy_set_callbacks(handle, &callbacks));
+
+    PproxyServer proxy(handle);
+    proxy.start();
+    ASSERT_EQ(-1, pproxy_set_latency_profile(handle, NULL));
+
+    // Every phase's delay applies to a profiled connection
+    clearLatency = false;
+    auto start = std::chrono::steady_clock::now();
+    RawClient slow(proxy.port());
+    slow.send(absoluteGet(echo.port()));
+    ASSERT_EQ(0u, slow.readResponse().find("HTTP/1.1 200"));
+    ASSERT_GE(std::chrono::steady_clock::now() - start + kClockSlack,
+        std::chrono::milliseconds(160));
+
+    // The profile can be lifted from on_connect
+    clearLatency = true;
+    start = std::chrono::steady_clock::now();
+    RawClient fast(proxy.port());
+    fast.send(absoluteGet(echo.port()));
+    ASSERT_EQ(0u, fast.readResponse().find("HTTP/1.1 200"));
+    ASSERT_LT(std::chrono::steady_clock::now() - start,
+        std::chrono::milliseconds(80));
+}
+
+TEST_F(PproxyTest, TestTunnelMigration) {
+    EchoServer echo;
+    echo.start();
+
+    struct pproxy_options options;
+    pproxy_options_init(&options);
+    options.num_workers = 2;
+    options.accept_mode = PPROXY_ACCEPT_HANDOFF;
+    options.balance_policy = PPROXY_BALANCE_ROUND_ROBIN;
+    options.migrate_tunnels = 1;
+    options.migrate_interval_ms = 10;
+
+    struct pproxy *mt_handle = nullptr;
+    ASSERT_SUCCESS(pproxy_init_ex(&mt_handle, proxy_host, 0, &options));
+
+    {
+        PproxyServer proxy(mt_handle);
+        proxy.start();
+
+        std::vector<std::unique_ptr<RawClient>> tunnels;
+        for (int i = 0; i < 4; ++i) {
+            tunnels.emplace_back(new RawClient(proxy.port()));
+            openTunnel(*tunnels.back(), echo.port());
+        }
+
+        // Round-robin placement put tunnels 1 and 3 on the second worker;
+        // closing them leaves the first worker with two more connections.
+        tunnels[1].reset();
+        tunnels[3].reset();
+
+        bool balanced = false;
+        for (int i = 0; i < 100 && !balanced; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            FENCE();
+            balanced = mt_handle->workers[0].active_connections == 1 &&
+                mt_handle->workers[1].active_connections == 1;
+        }
+        ASSERT_TRUE(balanced);
+
+        getThroughTunnel(*tunnels[0]);
+        getThroughTunnel(*tunnels[2]);
+    }
+
+    pproxy_free(mt_handle);
+}
+
+static void putThroughTunnel(RawClient &client, std::string const& body) {
+    client.send("PUT / HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body);
+    auto resp = client.readResponse();
+    ASSERT_EQ(0u, resp.find("HTTP/1.1 200"));
+    ASSERT_EQ("PUT " + body, resp.substr(resp.find("\r\n\r\n") + 4));
+}
+
+TEST_F(PproxyTest, TestTunnelEngines) {
+    EchoServer echo;
+    echo.start();
+
+    for (int engine : { PPROXY_TUNNEL_BUFFERED, PPROXY_TUNNEL_SPLICE,
+            PPROXY_TUNNEL_SOCKMAP }) {
+        struct pproxy_options options;
+        pproxy_options_init(&options);
+        options.tunnel_engine = engine;
+
+        struct pproxy *st_handle = nullptr;
+        ASSERT_SUCCESS(pproxy_init_ex(&st_handle, proxy_host, 0, &options));
+
+        {
+            PproxyServer proxy(st_handle);
+            proxy.start();
+
+            std::unique_ptr<RawClient> client(new RawClient(proxy.port()));
+            openTunnel(*client, echo.port());
+            getThroughTunnel(*client);
+
+            // The handover follows the response's write on the proxy side
+            struct pproxy_connection *tunnel = nullptr;
+            int spliced = 0, offloaded = 0;
+            for (int i = 0; i < 100 && !spliced && !offloaded; ++i) {
+                FENCE();
+                tunnel = st_handle->workers[0].tunnels;
+                spliced = tunnel->tunnel_engine == PPROXY_TUNNEL_SPLICE;
+                offloaded = tunnel->tunnel_engine == PPROXY_TUNNEL_SOCKMAP;
+                if (!spliced && !offloaded) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            if (engine == PPROXY_TUNNEL_SOCKMAP &&
+                    st_handle->sockmap.prog_fd != -1) {
+                ASSERT_TRUE(offloaded);
+            } else {
+                // Without BPF support, sockmap tunnels are spliced
+                ASSERT_EQ(engine != PPROXY_TUNNEL_BUFFERED, spliced);
+            }
+
+            // Larger than a pipe, so that splicing has to wait for the
+            // destination to accept what it has read
+            putThroughTunnel(*client, std::string(1 << 20, 'x'));
+
+            client.reset();
+            for (int i = 0; i < 100 &&
+                    st_handle->workers[0].active_connections; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                FENCE();
+            }
+            ASSERT_EQ(0, st_handle->workers[0].active_connections);
+        }
+
+        pproxy_free(st_handle);
+    }
+}
+
 int connect_called = 0;
 static void connectCallback(struct pproxy_connection_handle *) {
     ++connect_called;
@@ -22,7 +22,15 @@
 
 #include "util.h"
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
 #include <event2/bufferevent.h>
+#include <event2/dns_struct.h>
 #include <event2/thread.h>
 
 namespace test {
@@ -130,11 +138,19 @@ HttpClient::HttpClient(std::string const& host, int16_t port, int16_t proxyPort)
         : host_(host), port_(port), proxyPort_(proxyPort) {
 }
 
+struct PendingRequest {
+    std::promise<std::pair<int, std::string>> promise;
+    struct event_base *base;
+};
+
 void request_done(struct evhttp_request *request, void *ctx) {
-    auto promise = reinterpret_cast<std::promise<
-        std::pair<int, std::string>>*>(ctx);
+    auto pending = reinterpret_cast<PendingRequest*>(ctx);
+
+    // The connection may persist; stop waiting once the response is in
+    event_base_loopexit(pending->base, nullptr);
+
     if (!request) {
-        promise->set_exception(std::make_exception_ptr(
+        pending->promise.set_exception(std::make_exception_ptr(
             std::runtime_error("Timeout on request")));
         return;
     }
@@ -143,7 +159,7 @@ void request_done(struct evhttp_request *request, void *ctx) {
     size_t size = evbuffer_get_length(buffer);
     std::string body(reinterpret_cast<char*>(evbuffer_pullup(buffer, size)),
         size);
-    promise->set_value(std::make_pair(
+    pending->promise.set_value(std::make_pair(
         evhttp_request_get_response_code(request), body));
 }
 
@@ -152,11 +168,12 @@ std::string HttpClient::formatAbsoluteUri(std::string const& path) {
 }
 
 void HttpClient::execute(struct evhttp_request *request, std::string const& path,
-        evhttp_cmd_type type) {
+        evhttp_cmd_type type, struct event_base **basep) {
     struct event_base *base = event_base_new();
     if (!base) {
         throw std::runtime_error("Error creating base");
     }
+    *basep = base;
 
     struct evhttp_connection *conn = evhttp_connection_base_new(base, nullptr,
         host_.c_str(), proxyPort_);
@@ -177,25 +194,292 @@ void HttpClient::execute(struct evhttp_request *request, std::string const& path
 }
 
 std::pair<int, std::string> HttpClient::get(std::string const& path) {
-    std::promise<decltype(this->get(path))> promise;
-    auto result = promise.get_future();
-    struct evhttp_request *req = evhttp_request_new(request_done, &promise);
-    execute(req, path, EVHTTP_REQ_GET);
+    PendingRequest pending;
+    auto result = pending.promise.get_future();
+    struct evhttp_request *req = evhttp_request_new(request_done, &pending);
+    execute(req, path, EVHTTP_REQ_GET, &pending.base);
     return result.get();
 }
 
 std::pair<int, std::string> HttpClient::put(std::string const& path,
         std::string const& content) {
-    std::promise<decltype(this->get(path))> promise;
-    auto result = promise.get_future();
-    struct evhttp_request *req = evhttp_request_new(request_done, &promise);
+    PendingRequest pending;
+    auto result = pending.promise.get_future();
+    struct evhttp_request *req = evhttp_request_new(request_done, &pending);
     struct evbuffer *output = evhttp_request_get_output_buffer(req);
     struct evbuffer *buf = evbuffer_new();
     evbuffer_add(buf, content.c_str(), content.size());
     evbuffer_add_buffer(output, buf);
     evbuffer_free(buf);
-    execute(req, path, EVHTTP_REQ_PUT);
+    execute(req, path, EVHTTP_REQ_PUT, &pending.base);
     return result.get();
 }
 
+RawClient::RawClient(int16_t port) : fd_(-1) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ == -1) {
+        throw std::runtime_error("Failed to create socket");
+    }
+
+    struct timeval tv = {5, 0};
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &saddr.sin_addr);
+    if (connect(fd_, reinterpret_cast<struct sockaddr*>(&saddr),
+            sizeof(saddr))) {
+        close(fd_);
+        throw std::runtime_error("Failed to connect");
+    }
+}
+
+RawClient::~RawClient() {
+    close(fd_);
+}
+
+std::unique_ptr<RawClient> RawClient::adopt(int fd) {
+    std::unique_ptr<RawClient> client(new RawClient());
+    client->fd_ = fd;
+
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return client;
+}
+
+void RawClient::send(std::string const& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t rc = ::send(fd_, data.data() + sent, data.size() - sent, 0);
+        if (rc <= 0) {
+            throw std::runtime_error("Failed to send");
+        }
+        sent += rc;
+    }
+}
+
+bool RawClient::fill() {
+    char buf[4096];
+    ssize_t rc = recv(fd_, buf, sizeof(buf), 0);
+    if (rc <= 0) {
+        return false;
+    }
+    buffered_.append(buf, rc);
+    return true;
+}
+
+std::string RawClient::readUntil(std::string const& delim) {
+    size_t end;
+    while ((end = buffered_.find(delim)) == std::string::npos) {
+        if (!fill()) {
+            throw std::runtime_error("Connection closed before delimiter");
+        }
+    }
+    std::string ret = buffered_.substr(0, end + delim.size());
+    buffered_.erase(0, end + delim.size());
+    return ret;
+}
+
+std::string RawClient::readResponse() {
+    size_t end;
+    while ((end = buffered_.find("\r\n\r\n")) == std::string::npos) {
+        if (!fill()) {
+            throw std::runtime_error("Connection closed reading headers");
+        }
+    }
+    end += 4;
+
+    size_t length = 0;
+    static const char kContentLength[] = "\r\ncontent-length:";
+    for (size_t i = 0; i < end; ++i) {
+        if (!strncasecmp(&buffered_[i], kContentLength,
+                sizeof(kContentLength) - 1)) {
+            length = std::stoul(buffered_.substr(
+                i + sizeof(kContentLength) - 1));
+            break;
+        }
+    }
+
+    while (buffered_.size() < end + length) {
+        if (!fill()) {
+            throw std::runtime_error("Connection closed reading body");
+        }
+    }
+
+    std::string ret = buffered_.substr(0, end + length);
+    buffered_.erase(0, end + length);
+    return ret;
+}
+
+static void dns_request(struct evdns_server_request *request, void *ctx) {
+    reinterpret_cast<DnsServer*>(ctx)->handleRequest(request);
+}
+
+static void dns_respond(evutil_socket_t, short, void *ctx) {
+    auto request = reinterpret_cast<struct evdns_server_request*>(ctx);
+    int err = 0;
+    for (int i = 0; i < request->nquestions; ++i) {
+        auto question = request->questions[i];
+        if (!strncasecmp(question->name, "missing", 7)) {
+            err = DNS_ERR_NOTEXIST;
+        } else if (question->type == EVDNS_TYPE_A) {
+            struct in_addr addrs[2];
+            int count = 0;
+            if (!strncasecmp(question->name, "multi", 5)) {
+                inet_pton(AF_INET, "127.0.0.2", &addrs[count++]);
+            }
+            inet_pton(AF_INET, "127.0.0.1", &addrs[count++]);
+            evdns_server_request_add_a_reply(request, question->name, count,
+                addrs, 60);
+        }
+    }
+    evdns_server_request_respond(request, err);
+}
+
+DnsServer::DnsServer(int delayMs) : base_(nullptr), server_(nullptr),
+        fd_(-1), port_(0), delayMs_(delayMs) {
+    base_ = event_base_new();
+
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &saddr.sin_addr);
+    socklen_t len = sizeof(saddr);
+    if (fd_ == -1 ||
+            bind(fd_, reinterpret_cast<struct sockaddr*>(&saddr), len) ||
+            getsockname(fd_, reinterpret_cast<struct sockaddr*>(&saddr),
+                &len)) {
+        throw std::runtime_error("Failed to bind");
+    }
+    port_ = ntohs(saddr.sin_port);
+    evutil_make_socket_nonblocking(fd_);
+
+    server_ = evdns_add_server_port_with_base(base_, fd_, 0, dns_request,
+        this);
+}
+
+DnsServer::~DnsServer() {
+    event_base_loopexit(base_, 0);
+    if (loop_.joinable()) {
+        loop_.join();
+    }
+    evdns_close_server_port(server_);
+    close(fd_);
+    event_base_free(base_);
+}
+
+void DnsServer::start() {
+    loop_ = std::thread([this]() -> void {
+            auto event = event_new(base_, -1, EV_PERSIST, persist_callback,
+                nullptr);
+            timeval tv = {3600, 0};
+            event_add(event, &tv);
+            event_base_dispatch(base_);
+            event_free(event);
+        });
+}
+
+int16_t DnsServer::port() {
+    return port_;
+}
+
+int DnsServer::queries(std::string const& name) {
+    std::lock_guard<std::mutex> guard(lock_);
+    return queries_[name];
+}
+
+void DnsServer::configure(struct evdns_base *dnsBase) {
+    std::string address = "127.0.0.1:" +
+        std::to_string(static_cast<uint16_t>(port_));
+    evdns_base_clear_nameservers_and_suspend(dnsBase);
+    evdns_base_search_clear(dnsBase);
+    evdns_base_nameserver_ip_add(dnsBase, address.c_str());
+    evdns_base_resume(dnsBase);
+}
+
+void DnsServer::handleRequest(struct evdns_server_request *request) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (int i = 0; i < request->nquestions; ++i) {
+            if (request->questions[i]->type == EVDNS_TYPE_A) {
+                // Undo evdns' randomization of the name's case
+                std::string name = request->questions[i]->name;
+                for (auto& c : name) {
+                    c = tolower(c);
+                }
+                ++queries_[name];
+            }
+        }
+    }
+
+    timeval tv = {delayMs_ / 1000, (delayMs_ % 1000) * 1000};
+    event_base_once(base_, -1, EV_TIMEOUT, dns_respond, request, &tv);
+}
+
+bool RawClient::closed() {
+    return buffered_.empty() && !fill();
+}
+
+BlackholeServer::BlackholeServer(std::string const& address, int16_t port)
+        : fd_(-1), filler_(-1) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    filler_ = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    inet_pton(AF_INET, address.c_str(), &saddr.sin_addr);
+    // A zero backlog admits one connection, which the filler takes
+    if (fd_ == -1 || filler_ == -1 ||
+            bind(fd_, reinterpret_cast<struct sockaddr*>(&saddr),
+                sizeof(saddr)) ||
+            listen(fd_, 0) ||
+            connect(filler_, reinterpret_cast<struct sockaddr*>(&saddr),
+                sizeof(saddr))) {
+        throw std::runtime_error("Failed to set up blackhole");
+    }
+}
+
+BlackholeServer::~BlackholeServer() {
+    close(filler_);
+    close(fd_);
+}
+
+RawServer::RawServer() : fd_(-1), port_(0) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ == -1) {
+        throw std::runtime_error("Failed to create socket");
+    }
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &saddr.sin_addr);
+    socklen_t len = sizeof(saddr);
+    if (bind(fd_, reinterpret_cast<struct sockaddr*>(&saddr), len) ||
+            listen(fd_, 16) ||
+            getsockname(fd_, reinterpret_cast<struct sockaddr*>(&saddr),
+                &len)) {
+        close(fd_);
+        throw std::runtime_error("Failed to bind");
+    }
+    port_ = ntohs(saddr.sin_port);
+}
+
+RawServer::~RawServer() {
+    close(fd_);
+}
+
+int16_t RawServer::port() {
+    return port_;
+}
+
+std::unique_ptr<RawClient> RawServer::accept() {
+    int fd = ::accept(fd_, nullptr, nullptr);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to accept");
+    }
+    return RawClient::adopt(fd);
+}
+
 } // test namespace
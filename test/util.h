@@ -24,10 +24,14 @@
 #define TEST_UTIL_H_
 
 #include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <utility>
 
+#include <event2/dns.h>
 #include <evhttp.h>
 
 namespace test {
@@ -70,13 +74,87 @@ public:
 private:
     std::string formatAbsoluteUri(std::string const& path);
     void execute(struct evhttp_request *request, std::string const& path,
-        evhttp_cmd_type type);
+        evhttp_cmd_type type, struct event_base **basep);
 
     std::string host_;
     uint16_t port_;
     uint16_t proxyPort_;
 };
 
+// Answers A queries with 127.0.0.1, except that names beginning with
+// "missing" do not exist, and names beginning with "multi" list 127.0.0.2
+// first. Answers are delayed by delayMs.
+class DnsServer {
+public:
+    explicit DnsServer(int delayMs = 0);
+    ~DnsServer();
+    void start();
+    int16_t port();
+    // Returns the number of A queries received for the name
+    int queries(std::string const& name);
+    // Directs a proxy DNS base at this server
+    void configure(struct evdns_base *dnsBase);
+
+    void handleRequest(struct evdns_server_request *);
+private:
+    struct event_base *base_;
+    struct evdns_server_port *server_;
+    int fd_;
+    int16_t port_;
+    int delayMs_;
+    std::thread loop_;
+    std::mutex lock_;
+    std::map<std::string, int> queries_;
+};
+
+// Blocking client over a raw socket, for exercising the proxy protocol
+// directly (CONNECT, persistent connections, etc.)
+class RawClient {
+public:
+    explicit RawClient(int16_t port);
+    ~RawClient();
+    // Wraps a connected socket, e.g. one accepted by RawServer
+    static std::unique_ptr<RawClient> adopt(int fd);
+    void send(std::string const& data);
+    // Reads one message: headers plus a Content-Length delimited body
+    std::string readResponse();
+    std::string readRequest() { return readResponse(); }
+    // Reads through the first occurrence of the delimiter
+    std::string readUntil(std::string const& delim);
+    // Returns true if the peer has closed the connection
+    bool closed();
+private:
+    RawClient() : fd_(-1) { }
+    bool fill();
+
+    int fd_;
+    std::string buffered_;
+};
+
+// Listener that never completes a handshake: its accept queue is kept full,
+// so the kernel drops further SYNs and connects hang
+class BlackholeServer {
+public:
+    BlackholeServer(std::string const& address, int16_t port);
+    ~BlackholeServer();
+private:
+    int fd_;
+    int filler_;
+};
+
+// Blocking listener over a raw socket, for targets that need precise
+// control over when responses are written
+class RawServer {
+public:
+    RawServer();
+    ~RawServer();
+    int16_t port();
+    std::unique_ptr<RawClient> accept();
+private:
+    int fd_;
+    int16_t port_;
+};
+
 } // test namespace
 
 #endif // TEST_UTIL_H_